@@ -0,0 +1,116 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Arena module for the avrdis project, hands out the many small blocks
+ *     of a run from big ones, and releases all of them in one step. A reset
+ *     arena reuses its blocks for the next image.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "avrdis.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_MAX_BLOCK_SIZE (4 * 1024 * 1024)
+
+#define ALIGNED(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+struct arenablock {
+    struct arenablock *next;
+    size_t size;        /* Usable bytes after the aligned header */
+    size_t used;
+};
+
+struct arena {
+    struct arenablock *first;
+    struct arenablock *current;     /* The one allocated from, the ones before it are full */
+};
+
+struct arena *allocarena(void)
+{
+    struct arena *a = malloc(sizeof(struct arena));
+
+    if (a)
+        memset(a, 0, sizeof(struct arena));
+    return a;
+}
+
+void freearena(struct arena *a)
+{
+    struct arenablock *b, *next;
+
+    for (b = a->first; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    free(a);
+}
+
+/* Empties the arena, keeping its blocks for the next allocations */
+void resetarena(struct arena *a)
+{
+    struct arenablock *b;
+
+    for (b = a->first; b; b = b->next)
+        b->used = 0;
+    a->current = a->first;
+}
+
+/* Returns size bytes aligned for any type, valid until the arena is reset or freed, NULL on error */
+void *arenaalloc(struct arena *a, size_t size)
+{
+    struct arenablock *b, *last = NULL;
+    size_t blocksize;
+
+    size = ALIGNED(size);
+
+    /* The blocks kept by a reset are tried in order */
+    for (b = a->current; b; last = b, b = b->next)
+        if (b->size - b->used >= size) {
+            a->current = b;
+            b->used += size;
+            return (char *) b + ALIGNED(sizeof(struct arenablock)) + b->used - size;
+        }
+
+    /* Each new block doubles the previous one up to a limit */
+    if (!last)
+        for (last = a->first; last && last->next; last = last->next);
+    blocksize = last ? 2 * last->size : ARENA_BLOCK_SIZE;
+    if (blocksize > ARENA_MAX_BLOCK_SIZE)
+        blocksize = ARENA_MAX_BLOCK_SIZE;
+    if (blocksize < size)
+        blocksize = size;
+
+    if ((b = malloc(ALIGNED(sizeof(struct arenablock)) + blocksize)) == NULL)
+        return NULL;
+    b->next = NULL;
+    b->size = blocksize;
+    b->used = size;
+    if (last)
+        last->next = b;
+    else
+        a->first = b;
+    a->current = b;
+    return (char *) b + ALIGNED(sizeof(struct arenablock));
+}
+
+char *arenastrdup(struct arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = arenaalloc(a, len);
+
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
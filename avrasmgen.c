@@ -17,11 +17,34 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
 
 #include "avrdis.h"
 
 #define DEFAULT_LABELS_SIZE 128
 #define PADDING_TAB_SIZE 4
+#define RENDER_SLOT_SIZE 32
+#define MIN_CHUNK_WORDS 4096
+#define MAX_SINKS 3
+#define DATA_ROW_WORDS 8
+#define FILL_MIN_WORDS 8
+#define STRING_MIN_CHARS 6
+#define STRING_LINE_WORDS 32
+#define DEADLINE_CHECK_INSTRS 64
+
+#define BYTES_ONES 0x0101010101010101ull
+#define BYTES_HIGHS (0x80 * BYTES_ONES)
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
 
 struct labelrecord {
     uint32_t wordaddress;
@@ -32,6 +55,106 @@ struct labelstruct {
     struct labelrecord *labels;
     size_t labelscount;
     size_t labelssize;
+    struct wordindex *wi;   /* Of the image, during the collection only */
+    uint8_t *seen;          /* Bitmap of the label addresses in the image, during the collection only */
+    uint8_t *enabled;       /* Bitmap of the enabled words in the image, during the collection only */
+    struct region **owner;  /* The disabled region collected of each word in the image, during the collection only */
+    uint32_t seenbase;      /* Word address of the first word of the bitmaps and the owners */
+    uint32_t seencount;     /* Word addresses covered by the bitmaps and the owners */
+    struct arena *arena;    /* Of the array and the names of the labels */
+    const struct timespec *deadline;    /* Of the walks, NULL when unlimited */
+    size_t steps;           /* Instructions walked, the deadline is checked every DEADLINE_CHECK_INSTRS */
+    int stopped;            /* The walks were stopped by the deadline */
+    struct walkframe *frames;   /* The walks of the cut regions stopped, innermost first */
+    size_t framescount;
+    size_t framessize;
+};
+
+/* Rendered text of the position independent instructions by instruction word */
+struct rendercache {
+    uint8_t len[65536];     /* 0 when not rendered yet */
+    char text[65536][RENDER_SLOT_SIZE];
+};
+
+struct analysis {
+    struct wordindex *wi;
+    struct labelstruct *ls;
+    struct regionstruct *disregs;
+    struct cfg *cfg;
+    struct callgraph *cg;
+    struct loopforest *lf;
+    struct annotations *as;
+    uint8_t *code;              /* Disassembled as code or not, by word index */
+    struct arena *arena;        /* Of the labels and the disabled regions */
+    int ownsarena;              /* Released with the analysis, otherwise reset by the owner */
+    struct timespec deadline;   /* When the time budget runs out */
+    int partial;                /* The time budget ran out, some of the analyses were left out */
+    uint32_t stoppedat;         /* Where the walk stopped, UINT32_MAX when it has finished */
+};
+
+/* Kinds of the outputs written in the same pass */
+enum sinkkind {
+    SINK_ASM,       /* AVRASM source */
+    SINK_LISTING,   /* Listing with the word addresses and the raw instruction words */
+    SINK_GAS,       /* GNU as source */
+    SINK_JSONL,     /* JSON Lines records */
+    SINK_BIN,       /* Binary records */
+    SINK_RECORDS    /* Records passed to a callback one by one */
+};
+
+struct renderjob;
+struct renderedinstr;
+
+struct sink {
+    int kind;               /* One of enum sinkkind */
+    const char *filename;   /* NULL for the standard output or a callback */
+    int fd;
+    int compact;            /* Writes the runs of data words compacted */
+    void (*write)(struct renderjob *job, struct outbuf *ob, const struct renderedinstr *ri, uint32_t lastwordaddr);
+    int (*flush)(void *arg, const char *buf, size_t len);       /* Takes the text instead of fd, NULL when off */
+    int (*record)(void *arg, const struct instrrecord *ir);     /* Takes the records of SINK_RECORDS */
+    void *arg;
+};
+
+/* An instruction rendered once, then written into every sink */
+struct renderedinstr {
+    struct wordlist *instr;     /* First word of the instruction */
+    struct wordlist *last;      /* Last word, the second one of 32-bit opcodes */
+    const char *label;          /* NULL when none */
+    int code;
+    int indexed;                /* The line of the primary output goes into the index */
+    const char *text;           /* Mnemonic and operands, not terminated */
+    size_t textlen;
+};
+
+/* Rendering of a chunk of words, the analysis is shared read-only */
+struct renderjob {
+    struct analysis *an;
+    struct regionstruct *enaregs;
+    struct sink *sinks;         /* The primary output first */
+    size_t nsinks;
+    size_t padding;
+    struct wordlist *first;     /* First word of the chunk */
+    size_t firstindex;          /* Index of the first word */
+    struct wordlist *stop;      /* First word after the chunk, NULL at the end */
+    uint32_t lastwordaddr;      /* Word address before the chunk, for the .org directives */
+    struct outbuf *ob[MAX_SINKS];
+    struct outbuf *scratch;     /* Text of the instruction being rendered */
+    struct rendercache *rc;
+    struct strtab *st;          /* Strings of the binary records */
+    uint64_t records;           /* Records written to the primary output */
+    struct outindex *ix;        /* Offsets of the lines in the chunk, NULL when off */
+    unsigned int indexstep;
+    uint64_t base;              /* Offset of the chunk in the output */
+    int head;                   /* The first chunk, its first line is always indexed */
+    int compact;                /* Some sinks compact the data runs */
+    int allcompact;             /* All of them do */
+    uint16_t *runwords;         /* Words of the data run being compacted */
+    uint32_t *runprintable;     /* Printable words from each word of the run on */
+    size_t runsize;
+    int err;
+    pthread_t thread;
+    int threaded;               /* Rendered by a worker thread */
 };
 
 static int condrelbranch(uint16_t word, uint32_t wordaddress, const char **mnemonic, uint32_t *targetwordaddr)
@@ -157,7 +280,7 @@ static int call(struct wordlist *wl, uint32_t *targetwordaddr)
         return 0;
 
     if (wl->next == NULL) {
-        fprintf(stderr, "2nd word of 32-bit opcode after word address %05x missing\n", wl->wordaddress);
+        errmsg("2nd word of 32-bit opcode after word address %05x missing\n", wl->wordaddress);
         return 0;
     }
 
@@ -173,7 +296,7 @@ static int jmp(struct wordlist *wl, uint32_t *targetwordaddr)
         return 0;
 
     if (wl->next == NULL) {
-        fprintf(stderr, "2nd word of 32-bit opcode after word address %05x missing\n", wl->wordaddress);
+        errmsg("2nd word of 32-bit opcode after word address %05x missing\n", wl->wordaddress);
         return 0;
     }
 
@@ -635,7 +758,7 @@ static int lds(struct wordlist *wl, int *thirtytwobit, int *d, int *k)
     if ((wl->word & 0xfe0f) == 0x9000) {
 
         if (wl->next == NULL) {
-            fprintf(stderr, "2nd word of 32-bit opcode after word address %05x missing\n", wl->wordaddress);
+            errmsg("2nd word of 32-bit opcode after word address %05x missing\n", wl->wordaddress);
             return 0;
         }
 
@@ -1039,7 +1162,7 @@ static int sts(struct wordlist *wl, int *thirtytwobit, int *k, int *r)
     if ((wl->word & 0xfe0f) == 0x9200) {
 
         if (wl->next == NULL) {
-            fprintf(stderr, "2nd word of 32-bit opcode after word address %05x missing\n", wl->wordaddress);
+            errmsg("2nd word of 32-bit opcode after word address %05x missing\n", wl->wordaddress);
             return 0;
         }
 
@@ -1131,41 +1254,307 @@ static int skipinstr(uint16_t word)
             cpse(word, NULL, NULL);
 }
 
-static struct labelstruct *alloclabels(void)
+static int thirtytwobitop(uint16_t word)
+{
+    return  (word & 0xfe0e) == 0x940e ||   /* call */
+            (word & 0xfe0e) == 0x940c ||   /* jmp */
+            (word & 0xfe0f) == 0x9000 ||   /* lds */
+            (word & 0xfe0f) == 0x9200;     /* sts */
+}
+
+/* Tells if the rendering of the instruction word does not depend on its address or the next word */
+static int positionindependent(uint16_t word)
+{
+    uint32_t targetwordaddr;
+
+    return  !thirtytwobitop(word) &&
+            !condrelbranch(word, 0, NULL, &targetwordaddr) &&
+            !rcall(word, 0, &targetwordaddr) &&
+            !rjmp(word, 0, &targetwordaddr);
+}
+
+static int knownop(uint16_t word)
+{
+    switch (word) {
+        case 0x0000:    /* nop */
+        case 0x9408:    /* sec */
+        case 0x9418:    /* sez */
+        case 0x9428:    /* sen */
+        case 0x9438:    /* sev */
+        case 0x9448:    /* ses */
+        case 0x9458:    /* seh */
+        case 0x9468:    /* set */
+        case 0x9478:    /* sei */
+        case 0x9488:    /* clc */
+        case 0x9498:    /* clz */
+        case 0x94a8:    /* cln */
+        case 0x94b8:    /* clv */
+        case 0x94c8:    /* cls */
+        case 0x94d8:    /* clh */
+        case 0x94e8:    /* clt */
+        case 0x94f8:    /* cli */
+        case 0x9509:    /* icall */
+        case 0x9519:    /* eicall */
+        case 0x9588:    /* sleep */
+        case 0x9598:    /* break */
+        case 0x95a8:    /* wdr */
+        case 0x95e8:    /* spm */
+            return 1;
+    }
+
+    return  adc(word, NULL, NULL) || add(word, NULL, NULL) || adiw(word, NULL, NULL) ||
+            and(word, NULL, NULL) || andi(word, NULL, NULL) || asr(word, NULL) ||
+            bld(word, NULL, NULL) || bst(word, NULL, NULL) || cbi(word, NULL, NULL) ||
+            com(word, NULL) || cp(word, NULL, NULL) || cpc(word, NULL, NULL) ||
+            cpi(word, NULL, NULL) || cpse(word, NULL, NULL) || dec(word, NULL) ||
+            des(word, NULL) || elpm(word, NULL, NULL) || eor(word, NULL, NULL) ||
+            fmul(word, NULL, NULL) || fmuls(word, NULL, NULL) || fmulsu(word, NULL, NULL) ||
+            in(word, NULL, NULL) || inc(word, NULL) || lac(word, NULL) ||
+            las(word, NULL) || lat(word, NULL) || ld(word, NULL, NULL, NULL) ||
+            ldi(word, NULL, NULL) || (word & 0xf800) == 0xa000 /* 16-bit lds */ ||
+            lpm(word, NULL, NULL) || lsr(word, NULL) || mov(word, NULL, NULL) ||
+            movw(word, NULL, NULL) || mul(word, NULL, NULL) || muls(word, NULL, NULL) ||
+            mulsu(word, NULL, NULL) || neg(word, NULL) || or(word, NULL, NULL) ||
+            ori(word, NULL, NULL) || out(word, NULL, NULL) || pop(word, NULL) ||
+            push(word, NULL) || ror(word, NULL) || sbc(word, NULL, NULL) ||
+            sbci(word, NULL, NULL) || sbi(word, NULL, NULL) || sbiw(word, NULL, NULL) ||
+            st(word, NULL, NULL, NULL) || (word & 0xf800) == 0xa800 /* 16-bit sts */ ||
+            sub(word, NULL, NULL) || subi(word, NULL, NULL) || swap(word, NULL) ||
+            xch(word, NULL);
+}
+
+#define ARITH_FLAGS (FLAG_H | FLAG_S | FLAG_V | FLAG_N | FLAG_Z | FLAG_C)
+#define LOGIC_FLAGS (FLAG_S | FLAG_V | FLAG_N | FLAG_Z)
+#define WORD_FLAGS (FLAG_S | FLAG_V | FLAG_N | FLAG_Z | FLAG_C)
+
+/* Registers of the pointer in a ld/st operand */
+static uint64_t pointerregs(const char *operand)
+{
+    switch (*operand == '-' ? operand[1] : operand[0]) {
+        case 'X':
+            return REGPAIR(26);
+        case 'Y':
+            return REGPAIR(28);
+        default:
+            return REGPAIR(30);
+    }
+}
+
+static int pointerupdate(const char *operand)
+{
+    return *operand == '-' || operand[1] == '+';
+}
+
+/*
+ * Fills in the registers and flags written and read by the instruction.
+ * Follows the decoding order of the generator. Calls and indirect jumps are
+ * opaque, those are assumed to read and write everything.
+ */
+static void decodedefuse(struct wordlist *wl, struct instrinfo *ii)
+{
+    uint16_t word = wl->word;
+    int d, r, K, thirtytwobit;
+    const char *operand;
+    uint64_t def = 0, use = 0;
+
+    if (adc(word, &d, &r))
+        def = REG(d) | ARITH_FLAGS, use = REG(d) | REG(r) | FLAG_C;
+    else if (add(word, &d, &r))
+        def = REG(d) | ARITH_FLAGS, use = REG(d) | REG(r);
+    else if (adiw(word, &d, &K))
+        def = REGPAIR(2*d+24) | WORD_FLAGS, use = REGPAIR(2*d+24);
+    else if (and(word, &d, &r))
+        def = REG(d) | LOGIC_FLAGS, use = REG(d) | REG(r);
+    else if (andi(word, &d, &K))
+        def = REG(d+16) | LOGIC_FLAGS, use = REG(d+16);
+    else if (asr(word, &d))
+        def = REG(d) | WORD_FLAGS, use = REG(d);
+    else if (bld(word, &d, NULL))
+        def = REG(d), use = REG(d) | FLAG_T;
+    else if (bst(word, &r, NULL))
+        def = FLAG_T, use = REG(r);
+    else if (condrelbranch(word, wl->wordaddress, NULL, NULL))
+        use = FLAG_C << (word & 0x0007);
+    else if (rjmp(word, wl->wordaddress, NULL) || jmp(wl, NULL))
+        ;
+    else if (rcall(word, wl->wordaddress, NULL) || call(wl, NULL) ||
+             word == 0x9509 || word == 0x9519) /* icall, eicall */
+        def = use = ALL_REGS | ALL_FLAGS;
+    else if ((word & 0xff8f) == 0x9408)     /* sec, sez, ... sei */
+        def = FLAG_C << ((word & 0x0070) >> 4);
+    else if ((word & 0xff8f) == 0x9488)     /* clc, clz, ... cli */
+        def = FLAG_C << ((word & 0x0070) >> 4);
+    else if (com(word, &d) || neg(word, &d))
+        def = REG(d) | ARITH_FLAGS, use = REG(d);
+    else if (cp(word, &d, &r))
+        def = ARITH_FLAGS, use = REG(d) | REG(r);
+    else if (cpc(word, &d, &r))
+        def = ARITH_FLAGS, use = REG(d) | REG(r) | FLAG_C | FLAG_Z;
+    else if (cpi(word, &d, &K))
+        def = ARITH_FLAGS, use = REG(d+16);
+    else if (cpse(word, &d, &r))
+        use = REG(d) | REG(r);
+    else if (dec(word, &d) || inc(word, &d))
+        def = REG(d) | LOGIC_FLAGS, use = REG(d);
+    else if (des(word, NULL))
+        def = 0x0000ffffULL, use = 0x0000ffffULL | FLAG_H;
+    else if (eijmp(word) || ijmp(word))
+        use = ALL_REGS | ALL_FLAGS;
+    else if (elpm(word, &d, &operand) || lpm(word, &d, &operand)) {
+        use = REGPAIR(30);
+        if (!*operand)
+            def = REG(0);
+        else
+            def = REG(d) | (operand[1] == '+' ? REGPAIR(30) : 0);
+    }
+    else if (eor(word, &d, &r))
+        def = REG(d) | LOGIC_FLAGS, use = d != r ? REG(d) | REG(r) : 0;
+    else if (fmul(word, &d, &r) || fmuls(word, &d, &r) || fmulsu(word, &d, &r))
+        def = REGPAIR(0) | FLAG_Z | FLAG_C, use = REG(d+16) | REG(r+16);
+    else if (in(word, &d, NULL))
+        def = REG(d);
+    else if (lac(word, &d) || las(word, &d) || lat(word, &d))
+        def = REG(d), use = REG(d) | REGPAIR(30);
+    else if (ld(word, &d, &operand, NULL)) {
+        def = REG(d) | (pointerupdate(operand) ? pointerregs(operand) : 0);
+        use = pointerregs(operand);
+    }
+    else if (ldi(word, &d, NULL))
+        def = REG(d+16);
+    else if (lds(wl, &thirtytwobit, &d, NULL))
+        def = REG(thirtytwobit ? d : d+16);
+    else if (lsr(word, &d) || ror(word, &d))
+        def = REG(d) | WORD_FLAGS, use = REG(d) | (ror(word, NULL) ? FLAG_C : 0);
+    else if (mov(word, &d, &r))
+        def = REG(d), use = REG(r);
+    else if (movw(word, &d, &r))
+        def = REGPAIR(2*d), use = REGPAIR(2*r);
+    else if (mul(word, &d, &r))
+        def = REGPAIR(0) | FLAG_Z | FLAG_C, use = REG(d) | REG(r);
+    else if (muls(word, &d, &r) || mulsu(word, &d, &r))
+        def = REGPAIR(0) | FLAG_Z | FLAG_C, use = REG(d+16) | REG(r+16);
+    else if (or(word, &d, &r))
+        def = REG(d) | LOGIC_FLAGS, use = REG(d) | REG(r);
+    else if (ori(word, &d, &K))
+        def = REG(d+16) | LOGIC_FLAGS, use = REG(d+16);
+    else if (out(word, NULL, &r))
+        use = REG(r);
+    else if (pop(word, &d))
+        def = REG(d);
+    else if (push(word, &r))
+        use = REG(r);
+    else if (ret(word) || reti(word))
+        use = ALL_REGS | ALL_FLAGS;
+    else if (sbc(word, &d, &r))
+        def = REG(d) | ARITH_FLAGS, use = REG(d) | REG(r) | FLAG_C | FLAG_Z;
+    else if (sbci(word, &d, &K))
+        def = REG(d+16) | ARITH_FLAGS, use = REG(d+16) | FLAG_C | FLAG_Z;
+    else if (sbiw(word, &d, &K))
+        def = REGPAIR(2*d+24) | WORD_FLAGS, use = REGPAIR(2*d+24);
+    else if (sbrc(word, &r, NULL) || sbrs(word, &r, NULL))
+        use = REG(r);
+    else if (word == 0x95e8)                /* spm */
+        use = REGPAIR(0) | REGPAIR(30);
+    else if (st(word, &operand, NULL, &r)) {
+        def = pointerupdate(operand) ? pointerregs(operand) : 0;
+        use = REG(r) | pointerregs(operand);
+    }
+    else if (sts(wl, &thirtytwobit, NULL, &r))
+        use = REG(thirtytwobit ? r : r+16);
+    else if (sub(word, &d, &r))
+        def = REG(d) | ARITH_FLAGS, use = REG(d) | REG(r);
+    else if (subi(word, &d, &K))
+        def = REG(d+16) | ARITH_FLAGS, use = REG(d+16);
+    else if (swap(word, &d))
+        def = REG(d), use = REG(d);
+    else if (xch(word, &d))
+        def = REG(d), use = REG(d) | REGPAIR(30);
+
+    ii->def = def;
+    ii->use = use;
+}
+
+/*
+ * Decodes the size and the control flow properties of the instruction at wl.
+ * Returns 0 for words which are not valid opcodes, 1 otherwise.
+ */
+int decodeinstr(struct wordlist *wl, struct instrinfo *ii)
+{
+    uint32_t targetwordaddr = 0;
+
+    memset(ii, 0, sizeof(struct instrinfo));
+    ii->wordaddress = wl->wordaddress;
+    ii->word = wl->word;
+    ii->size = 1;
+    ii->flow = FLOW_NONE;
+
+    if (thirtytwobitop(wl->word)) {
+        /* 2nd word of the 32-bit opcode must be present */
+        if (!wl->next)
+            return 0;
+        ii->size = 2;
+        if (call(wl, &targetwordaddr))
+            ii->flow = FLOW_CALL;
+        else if (jmp(wl, &targetwordaddr))
+            ii->flow = FLOW_JUMP;
+    }
+    else if (condrelbranch(wl->word, wl->wordaddress, NULL, &targetwordaddr))
+        ii->flow = FLOW_BRANCH;
+    else if (rcall(wl->word, wl->wordaddress, &targetwordaddr))
+        ii->flow = FLOW_CALL;
+    else if (rjmp(wl->word, wl->wordaddress, &targetwordaddr))
+        ii->flow = FLOW_JUMP;
+    else if (ret(wl->word) || reti(wl->word))
+        ii->flow = FLOW_RET;
+    else if (ijmp(wl->word) || eijmp(wl->word))
+        ii->flow = FLOW_IJUMP;
+    else if (wl->word == 0x9509 || wl->word == 0x9519)
+        ii->flow = FLOW_ICALL;
+    else if (skipinstr(wl->word))
+        ii->flow = FLOW_SKIP;
+    else if (!knownop(wl->word))
+        return 0;
+
+    ii->target = targetwordaddr;
+    decodedefuse(wl, ii);
+    return 1;
+}
+
+/* The labels are kept in the arena, released with it */
+static struct labelstruct *alloclabels(struct arena *a)
 {
     struct labelstruct *ls = malloc(sizeof(struct labelstruct));
 
     if (ls) {
         memset(ls, 0, sizeof(struct labelstruct));
 
-        ls->labels = calloc(DEFAULT_LABELS_SIZE, sizeof(struct labelrecord));
+        ls->labels = arenaalloc(a, DEFAULT_LABELS_SIZE * sizeof(struct labelrecord));
         if (!ls->labels) {
             free(ls);
             return NULL;
         }
+        memset(ls->labels, 0, DEFAULT_LABELS_SIZE * sizeof(struct labelrecord));
         ls->labelssize = DEFAULT_LABELS_SIZE;
+        ls->arena = a;
     }
     return ls;
 }
 
 static void freelabels(struct labelstruct *ls)
 {
-    size_t i;
-    char *label;
-
-    if (ls->labels) {
-        for (i = 0; i < ls->labelscount; i++)
-            if ((label = ls->labels[i].label))
-                free(label);
-        free(ls->labels);
-    }
+    free(ls->frames);
     free(ls);
 }
 
 static int addrinlist(struct labelstruct *ls, uint32_t wordaddress)
 {
+    uint32_t bit = wordaddress - ls->seenbase;
     int i;
 
+    /* The bitmap answers for the addresses in the image, the rest are searched */
+    if (ls->seen && bit < ls->seencount)
+        return ls->seen[bit >> 3] >> (bit & 7) & 1;
+
     for (i = 0; i < ls->labelscount; i++)
         if (ls->labels[i].wordaddress == wordaddress)
             return 1;
@@ -1180,34 +1569,109 @@ static int addlabeladdr(struct labelstruct *ls, uint32_t wordaddress)
     if (addrinlist(ls, wordaddress))
         return 1;
 
-    /* Reallocate when limit reached, increase capacity by DEFAULT_LABELS_SIZE */
+    /* Move to a twice as big array when limit reached, the old one stays in the arena */
     if (ls->labelscount >= ls->labelssize) {
-        newlabels = realloc(ls->labels, (ls->labelssize + DEFAULT_LABELS_SIZE) * sizeof(struct labelrecord));
+        newlabels = arenaalloc(ls->arena, 2 * ls->labelssize * sizeof(struct labelrecord));
         if (!newlabels) {
-            fprintf(stderr, "Error allocating memory.\n");
+            errmsg("Error allocating memory.\n");
             return 0;
         }
+        memcpy(newlabels, ls->labels, ls->labelscount * sizeof(struct labelrecord));
         ls->labels = newlabels;
-        ls->labelssize += DEFAULT_LABELS_SIZE;
+        ls->labelssize *= 2;
     }
 
     /* Add address in the order its found */
     ls->labels[ls->labelscount++].wordaddress = wordaddress;
+    if (ls->seen && wordaddress - ls->seenbase < ls->seencount)
+        ls->seen[(wordaddress - ls->seenbase) >> 3] |= 1 << ((wordaddress - ls->seenbase) & 7);
+
+    return 1;
+}
+
+static int collectlabelsbetween(struct wordlist *wl, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs,
+                                struct walkframe *wf);
+
+/* Sets the bits of the words from begin to end in a bitmap of ls, the ones in the image */
+static void markwords(struct labelstruct *ls, uint8_t *bitmap, uint32_t begin, uint32_t end)
+{
+    uint64_t i, last = (uint64_t) ls->seenbase + ls->seencount - 1;
+
+    for (i = begin < ls->seenbase ? ls->seenbase : begin; i <= end && i <= last; i++)
+        bitmap[(i - ls->seenbase) >> 3] |= 1 << ((i - ls->seenbase) & 7);
+}
+
+/* Sets the disabled region of the words from begin to end, the ones in the image, NULL when none */
+static void setowner(struct labelstruct *ls, struct region *r, uint32_t begin, uint32_t end)
+{
+    uint64_t i, last = (uint64_t) ls->seenbase + ls->seencount - 1;
+
+    for (i = begin < ls->seenbase ? ls->seenbase : begin; i <= end && i <= last; i++)
+        ls->owner[i - ls->seenbase] = r;
+}
+
+static int adddisregion(struct labelstruct *ls, struct regionstruct *disregs, uint32_t begin, uint32_t end)
+{
+    if (!addregion(disregs, begin, end))
+        return 0;
+    if (ls->owner)
+        setowner(ls, disregs->last, begin, end);
+    return 1;
+}
+
+static int isenabled(struct labelstruct *ls, struct regionstruct *enaregs, uint32_t wordaddress)
+{
+    uint32_t bit = wordaddress - ls->seenbase;
+
+    if (ls->enabled && bit < ls->seencount)
+        return ls->enabled[bit >> 3] >> (bit & 7) & 1;
+    return inregions(enaregs, wordaddress) != NULL;
+}
+
+/* Keeps the walk stopped, after the ones stopped within it */
+static int pushframe(struct labelstruct *ls, const struct walkframe *wf)
+{
+    struct walkframe *frames;
 
+    if (ls->framescount == ls->framessize) {
+        if ((frames = realloc(ls->frames, (ls->framessize ? 2 * ls->framessize : 4) * sizeof(struct walkframe))) == NULL) {
+            errmsg("Error allocating memory\n");
+            return 0;
+        }
+        ls->frames = frames;
+        ls->framessize = ls->framessize ? 2 * ls->framessize : 4;
+    }
+    ls->frames[ls->framescount++] = *wf;
     return 1;
 }
 
-static int collectlabelsbetween(struct wordlist *wl, uint32_t from, uint32_t to, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs);
+/* Walks a walk kept, keeping it again when stopped before its end */
+static int walkframe(struct wordlist *wl, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs,
+                     struct walkframe *wf)
+{
+    if (!collectlabelsbetween(wl, ls, enaregs, disregs, wf))
+        return 0;
+    return !ls->stopped || wf->next > wf->end || pushframe(ls, wf);
+}
 
-static void sliceregionandcollect(struct wordlist *wl, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs, uint32_t wordaddress)
+static int sliceregionandcollect(struct wordlist *wl, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs, uint32_t wordaddress)
 {
-    struct region *r, *prev;
-    uint32_t to;
+    struct region *r, *prev = NULL;
+    struct walkframe wf;
+    uint32_t to, bit = wordaddress - ls->seenbase;
+
+    /* The owners tell the region without searching, there is none outside the image, the emptied ones are unlinked after the walk */
+    if (ls->owner)
+        r = bit < ls->seencount ? ls->owner[bit] : NULL;
+    else
+        r = inregionswithprev(disregs, wordaddress, &prev);
 
-    if ((r = inregionswithprev(disregs, wordaddress, &prev))) {
+    if (r) {
         to = r->end;
         r->end = wordaddress - 1;
-        if (r->begin > r->end) {
+        if (ls->owner)
+            setowner(ls, NULL, wordaddress, to);
+        if (r->begin > r->end && !ls->owner) {
             if (!prev)
                 disregs->first = r->next;
             else
@@ -1218,28 +1682,73 @@ static void sliceregionandcollect(struct wordlist *wl, struct labelstruct *ls, s
                 else
                     disregs->last = NULL;
             }
-            free(r);
+            dropregion(disregs, r);
         }
-        collectlabelsbetween(wl, wordaddress, to, ls, enaregs, disregs);
+
+        /* A new walk has no instruction before its first word */
+        memset(&wf, 0, sizeof(struct walkframe));
+        wf.next = wordaddress;
+        wf.prev = UINT32_MAX;
+        wf.end = to;
+        return walkframe(wl, ls, enaregs, disregs, &wf);
     }
+    return 1;
 }
 
-static int collectlabelsbetween(struct wordlist *wl, uint32_t from, uint32_t to, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs)
+/*
+ * Adds the target of a branch, a call or a jump, and collects from it when
+ * new. A label found earlier is never inside a disabled region: the walks
+ * end theirs at the labels, and cut them at the labels found later.
+ */
+static int addtarget(struct wordlist *wl, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs, uint32_t wordaddress)
 {
-    struct wordlist *words, *temp, *prev = NULL;
-    uint32_t begin;
-    uint32_t targetwordaddr;
-    int skip = 0;
+    if (addrinlist(ls, wordaddress))
+        return 1;
+    if (!addlabeladdr(ls, wordaddress))
+        return 0;
+    return sliceregionandcollect(wl, ls, enaregs, disregs, wordaddress);
+}
 
-    for (words = wl; words && words->wordaddress < from; words = words->next);
+static int pastdeadline(const struct timespec *deadline)
+{
+    struct timespec now;
 
-    for (; words && words->wordaddress <= to; words = words->next) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/*
+ * Walks the words of wf from its next one to its end, continuing from the
+ * state in wf. Every walk, the ones of the sliced regions too, stops at an
+ * instruction when the deadline has passed or a walk within it has stopped,
+ * leaving its state in wf. Otherwise next is set past the end.
+ */
+static int collectlabelsbetween(struct wordlist *wl, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs,
+                                struct walkframe *wf)
+{
+    struct wordlist *words, *temp, *prev = wordat(ls->wi, wf->prev);
+    uint32_t from = wf->next, begin = wf->begin, to = wf->end;
+    uint32_t targetwordaddr;
+    int skip = wf->skip;
+
+    wf->next = to + 1;
+    wf->skip = 0;
+    for (words = wordfrom(ls->wi, from); words && words->wordaddress <= to; words = words->next) {
+
+        if (prev && (ls->stopped || (ls->deadline && ++ls->steps % DEADLINE_CHECK_INSTRS == 0 && pastdeadline(ls->deadline)))) {
+            wf->next = words->wordaddress;
+            wf->prev = prev->wordaddress;
+            wf->skip = skip;
+            wf->begin = begin;
+            ls->stopped = 1;
+            return 1;
+        }
 
         temp = words;
 
         if (skip && addrinlist(ls, words->wordaddress)) {
             if (begin <= prev->wordaddress)
-                if (!addregion(disregs, begin, prev->wordaddress))
+                if (!adddisregion(ls, disregs, begin, prev->wordaddress))
                     return 0;
             skip = 0;
         }
@@ -1247,40 +1756,36 @@ static int collectlabelsbetween(struct wordlist *wl, uint32_t from, uint32_t to,
         if (!skip) {
             if (condrelbranch(words->word, words->wordaddress, NULL, &targetwordaddr) ||
                 rcall(words->word, words->wordaddress, &targetwordaddr)) {
-                if (!addlabeladdr(ls, targetwordaddr))
+                if (!addtarget(wl, ls, enaregs, disregs, targetwordaddr))
                     return 0;
-                sliceregionandcollect(wl, ls, enaregs, disregs, targetwordaddr);
             }
             else if (call(words, &targetwordaddr)) {
-                if (!addlabeladdr(ls, targetwordaddr))
+                if (!addtarget(wl, ls, enaregs, disregs, targetwordaddr))
                     return 0;
-                sliceregionandcollect(wl, ls, enaregs, disregs, targetwordaddr);
                 words = words->next; /* 32-bit opcode */
             }
             else if (jmp(words, &targetwordaddr)) {
-                if (!addlabeladdr(ls, targetwordaddr))
+                if (!addtarget(wl, ls, enaregs, disregs, targetwordaddr))
                     return 0;
-                sliceregionandcollect(wl, ls, enaregs, disregs, targetwordaddr);
                 words = words->next; /* 32-bit opcode */
 
                 if (prev && !skipinstr(prev->word)) {
                     if (!words->next)
                         break;
-                    if (!inregions(enaregs, words->next->wordaddress)) {
+                    if (!isenabled(ls, enaregs, words->next->wordaddress)) {
                         begin = words->next->wordaddress;
                         skip = 1;
                     }
                 }
             }
             else if (rjmp(words->word, words->wordaddress, &targetwordaddr)) {
-                if (!addlabeladdr(ls, targetwordaddr))
+                if (!addtarget(wl, ls, enaregs, disregs, targetwordaddr))
                     return 0;
-                sliceregionandcollect(wl, ls, enaregs, disregs, targetwordaddr);
 
                 if (prev && !skipinstr(prev->word)) {
                     if (!words->next)
                         break;
-                    if (!inregions(enaregs, words->next->wordaddress)) {
+                    if (!isenabled(ls, enaregs, words->next->wordaddress)) {
                         begin = words->next->wordaddress;
                         skip = 1;
                     }
@@ -1292,7 +1797,7 @@ static int collectlabelsbetween(struct wordlist *wl, uint32_t from, uint32_t to,
                 if (prev && !skipinstr(prev->word)) {
                     if (!words->next)
                         break;
-                    if (!inregions(enaregs, words->next->wordaddress)) {
+                    if (!isenabled(ls, enaregs, words->next->wordaddress)) {
                         begin = words->next->wordaddress;
                         skip = 1;
                     }
@@ -1304,26 +1809,48 @@ static int collectlabelsbetween(struct wordlist *wl, uint32_t from, uint32_t to,
     }   /* collect for loop */
 
     if (skip && begin <= prev->wordaddress)
-        if (!addregion(disregs, begin, prev->wordaddress))
+        if (!adddisregion(ls, disregs, begin, prev->wordaddress))
             return 0;
 
     return 1;
 }
 
-static int genlabels(struct labelstruct *ls)
+static int genlabels(struct labelstruct *ls, struct callgraph *cg, const struct sessiontexts *names,
+                     const struct symbols *symbols)
 {
-    size_t i;
-    int sz;
+    size_t i, n = 0;
+    int sz, function;
+    uint32_t wordaddress;
+    const char *name;
     char *buf, *fmt = "L%zu";
 
     for (i = 0; i < ls->labelscount; i++) {
-        sz = snprintf(NULL, 0, fmt, i);
-        buf = malloc(sz+1);
+        wordaddress = ls->labels[i].wordaddress;
+
+        /* The names given are kept, then the ones of the symbols */
+        if ((names && (name = findtext(names, wordaddress))) || (symbols && (name = findsymbol(symbols, wordaddress)))) {
+            if ((ls->labels[i].label = arenastrdup(ls->arena, name)) == NULL) {
+                errmsg("Error allocating memory.\n");
+                return 0;
+            }
+            continue;
+        }
+
+        /* Function entry points are named after their address, the rest are numbered */
+        function = cg && findfunction(cg, wordaddress) != CFG_NONE;
+        if (function)
+            sz = snprintf(NULL, 0, FUNCTION_LABEL_FMT, wordaddress);
+        else
+            sz = snprintf(NULL, 0, fmt, n);
+        buf = arenaalloc(ls->arena, sz+1);
         if (!buf) {
-            fprintf(stderr, "Error allocating memory.\n");
+            errmsg("Error allocating memory.\n");
             return 0;
         }
-        snprintf(buf, sz+1, fmt, i);
+        if (function)
+            snprintf(buf, sz+1, FUNCTION_LABEL_FMT, wordaddress);
+        else
+            snprintf(buf, sz+1, fmt, n++);
 
         ls->labels[i].label = buf;
     }
@@ -1331,6 +1858,16 @@ static int genlabels(struct labelstruct *ls)
     return 1;
 }
 
+static size_t maxlabellen(struct labelstruct *ls)
+{
+    size_t i, len, max = 0;
+
+    for (i = 0; i < ls->labelscount; i++)
+        if ((len = strlen(ls->labels[i].label)) > max)
+            max = len;
+    return max;
+}
+
 static int labelreccmp(const void *lhs, const void *rhs)
 {
     const struct labelrecord *l = lhs;
@@ -1345,10 +1882,44 @@ static int labelreccmp(const void *lhs, const void *rhs)
     return 0;
 }
 
-static int collectlabels(struct wordlist *wl, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs)
+/* Unlinks the regions emptied by cutting them at their first word */
+static void dropemptyregions(struct regionstruct *rs)
+{
+    struct region *r, *next, *prev = NULL;
+
+    for (r = rs->first; r; r = next) {
+        next = r->next;
+        if (r->begin <= r->end) {
+            prev = r;
+            continue;
+        }
+        if (prev)
+            prev->next = next;
+        else
+            rs->first = next;
+        if (rs->last == r)
+            rs->last = prev;
+        dropregion(rs, r);
+    }
+}
+
+/*
+ * Collects the labels and the disabled regions of the image. The walks
+ * continue the ones stopped in resume, unless NULL. When stopped by the
+ * deadline of ls, the entry points not reached are left out, the next run
+ * takes them all again, and the state of the walks goes into stop, with the
+ * frames of ls.
+ */
+static int collectlabels(struct wordlist *wl, struct labelstruct *ls, struct regionstruct *enaregs, struct regionstruct *disregs,
+                         const uint32_t *entries, size_t entriescount, const struct walkstate *resume, struct walkstate *stop)
 {
     struct wordlist *words;
+    struct walkstate walk;
+    struct walkframe frame;
+    struct region *r;
     uint32_t from, to;
+    size_t i;
+    int res;
 
     if (!wl)
         return 1;
@@ -1359,13 +1930,91 @@ static int collectlabels(struct wordlist *wl, struct labelstruct *ls, struct reg
         words = words->next;
     to = words->wordaddress;
 
-    if (!collectlabelsbetween(wl, from, to, ls, enaregs, disregs))
+    /* Look up the words where the walk continues, the labels found, the enabled words and the disabled regions by address during the walk */
+    ls->seenbase = from;
+    ls->seencount = to - from + 1;
+    if ((ls->wi = allocwordindex(wl)) == NULL || (ls->seen = calloc(ls->seencount / 8 + 1, 1)) == NULL ||
+        (ls->enabled = calloc(ls->seencount / 8 + 1, 1)) == NULL || (ls->owner = calloc(ls->seencount, sizeof(struct region *))) == NULL) {
+        errmsg("Error allocating memory\n");
+        res = 0;
+    } else {
+        for (r = enaregs->first; r; r = r->next)
+            markwords(ls, ls->enabled, r->begin, r->end);
+
+        /* A new walk has no instruction before the first word */
+        memset(&walk, 0, sizeof(struct walkstate));
+        walk.image.next = from;
+        walk.image.prev = UINT32_MAX;
+        res = 1;
+        if (resume) {
+            walk = *resume;
+            for (i = 0; res && i < resume->labelscount; i++)
+                res = addlabeladdr(ls, resume->labels[i]);
+            for (r = resume->disregs->first; res && r; r = r->next)
+                if (!(res = adddisregion(ls, disregs, r->begin, r->end)))
+                    errmsg("Error allocating memory\n");
+
+            /* The walks of the cut regions go on first, innermost first, like they would have returned */
+            for (i = 0; res && i < resume->framescount; i++) {
+                frame = resume->frames[i];
+                res = ls->stopped ? pushframe(ls, &frame) : walkframe(wl, ls, enaregs, disregs, &frame);
+            }
+        }
+        walk.image.end = to;
+        if (res && !ls->stopped)
+            res = collectlabelsbetween(wl, ls, enaregs, disregs, &walk.image);
+        if (ls->stopped && stop) {
+            *stop = walk;
+            stop->frames = ls->frames;
+            stop->framescount = ls->framescount;
+            stop->labels = NULL;
+            stop->labelscount = 0;
+            stop->disregs = NULL;
+        }
+    }
+
+    /* The entry points given are collected like call targets, after the whole image */
+    for (i = 0; res && !ls->stopped && i < entriescount; i++)
+        if ((res = addlabeladdr(ls, entries[i])))
+            res = sliceregionandcollect(wl, ls, enaregs, disregs, entries[i]);
+
+    if (ls->wi)
+        freewordindex(ls->wi);
+    free(ls->seen);
+    free(ls->enabled);
+    if (ls->owner)
+        dropemptyregions(disregs);
+    free(ls->owner);
+    ls->wi = NULL;
+    ls->seen = NULL;
+    ls->enabled = NULL;
+    ls->owner = NULL;
+    if (!res)
         return 0;
 
     if (ls->labels)
         qsort(ls->labels, ls->labelscount, sizeof(struct labelrecord), labelreccmp);
 
-    return genlabels(ls);
+    return 1;
+}
+
+/* Collects the disabled regions only, without keeping the labels */
+int collectregions(struct wordlist *wl, struct regionstruct *enaregs, struct regionstruct *disregs)
+{
+    struct labelstruct *ls = NULL;
+    struct arena *a;
+    int res;
+
+    if ((a = allocarena()) == NULL || (ls = alloclabels(a)) == NULL) {
+        errmsg("Error allocating memory\n");
+        if (a)
+            freearena(a);
+        return 0;
+    }
+    res = collectlabels(wl, ls, enaregs, disregs, NULL, 0, NULL, NULL);
+    freelabels(ls);
+    freearena(a);
+    return res;
 }
 
 static const char *lookuplabel(struct labelstruct *ls, uint32_t wordaddress)
@@ -1384,297 +2033,1676 @@ static const char *lookuplabel(struct labelstruct *ls, uint32_t wordaddress)
     return NULL;
 }
 
-int emitavrasm(struct wordlist *wl, struct regionstruct *enaregs, int listing)
+void freeanalysis(struct analysis *an)
+{
+    if (an->lf)
+        freeloops(an->lf);
+    if (an->cg)
+        freecallgraph(an->cg);
+    if (an->cfg)
+        freecfg(an->cfg);
+    if (an->disregs)
+        freeregions(an->disregs);
+    if (an->ls)
+        freelabels(an->ls);
+    if (an->wi)
+        freewordindex(an->wi);
+    if (an->as)
+        freeannotations(an->as);
+    free(an->code);
+    if (an->ownsarena)
+        freearena(an->arena);
+    free(an);
+}
+
+/*
+ * Marks the words disassembled as code by their index, sweeping the regions
+ * once instead of searching them for every word. The data regions of the
+ * session and of the symbols, when given, are data even when enabled.
+ */
+static uint8_t *codemap(struct wordindex *wi, struct regionstruct *enaregs, struct regionstruct *disregs,
+                        struct regionstruct *dataregs, struct regionstruct *symregs)
+{
+    uint8_t *code;
+    struct region *r;
+    size_t i;
+
+    if ((code = malloc(wi->count ? wi->count : 1)) == NULL)
+        return NULL;
+    memset(code, 1, wi->count);
+
+    for (r = disregs->first; r; r = r->next)
+        for (i = wordpos(wi, r->begin); i < wi->count && wi->words[i]->wordaddress <= r->end; i++)
+            code[i] = 0;
+    for (r = enaregs->first; r; r = r->next)
+        for (i = wordpos(wi, r->begin); i < wi->count && wi->words[i]->wordaddress <= r->end; i++)
+            code[i] = 1;
+    for (r = dataregs ? dataregs->first : NULL; r; r = r->next)
+        for (i = wordpos(wi, r->begin); i < wi->count && wi->words[i]->wordaddress <= r->end; i++)
+            code[i] = 0;
+    for (r = symregs ? symregs->first : NULL; r; r = r->next)
+        for (i = wordpos(wi, r->begin); i < wi->count && wi->words[i]->wordaddress <= r->end; i++)
+            code[i] = 0;
+
+    return code;
+}
+
+/* Replaces the walk kept in the session with the stopped one, or drops it when stop is NULL */
+static int keepwalk(struct session *s, const struct walkstate *stop, struct labelstruct *ls, struct regionstruct *disregs)
 {
-    const char *label, *mnemonic, *operand;
-    int d, r, b, k, K, A, q;
-    int thirtytwobit;
-    uint32_t targetwordaddr;
-    uint32_t lastwordaddr = 0;
-    size_t padding = 0, pd, lablen;
-    struct labelstruct *ls;
-    struct regionstruct *disregs;
+    struct walkstate *ws = NULL;
+    size_t i;
 
-    if ((ls = alloclabels()) == NULL) {
-        fprintf(stderr, "Error allocating memory\n");
-        return 0;   /* Error */
+    if (stop) {
+        if ((ws = malloc(sizeof(struct walkstate))) == NULL) {
+            errmsg("Error allocating memory\n");
+            return 0;
+        }
+        *ws = *stop;
+        ws->frames = malloc((stop->framescount ? stop->framescount : 1) * sizeof(struct walkframe));
+        ws->labels = malloc((ls->labelscount ? ls->labelscount : 1) * sizeof(uint32_t));
+        ws->disregs = copyregions(disregs);
+        if (!ws->frames || !ws->labels || !ws->disregs) {
+            errmsg("Error allocating memory\n");
+            freewalk(ws);
+            return 0;
+        }
+        if (stop->framescount)
+            memcpy(ws->frames, stop->frames, stop->framescount * sizeof(struct walkframe));
+        for (i = 0; i < ls->labelscount; i++)
+            ws->labels[i] = ls->labels[i].wordaddress;
+        ws->labelscount = ls->labelscount;
     }
+    if (s->walk)
+        freewalk(s->walk);
+    s->walk = ws;
+    return 1;
+}
 
-    if ((disregs = allocregions()) == NULL) {
-        fprintf(stderr, "Error allocating memory\n");
-        return 0;   /* Error */
+/* Appends the code symbols within the image to the n entry points, into the arena of an, NULL on error */
+static uint32_t *symbolentries(const struct symbols *st, struct analysis *an, const uint32_t *entries, size_t *n)
+{
+    uint32_t *all = arenaalloc(an->arena, (*n + st->entriescount + 1) * sizeof(uint32_t));
+    size_t i;
+
+    if (!all) {
+        errmsg("Error allocating memory\n");
+        return NULL;
     }
+    if (*n)
+        memcpy(all, entries, *n * sizeof(uint32_t));
+
+    /* The symbols of an earlier build can be past the end of this image */
+    for (i = 0; i < st->entriescount; i++)
+        if (wordat(an->wi, st->entries[i]))
+            all[(*n)++] = st->entries[i];
+    return all;
+}
+
+/*
+ * Collects the labels and the disabled regions. The budgeted collection
+ * continues the walk kept in the session, and stops when the time budget
+ * runs out, keeping the walk in opts->resume for the next run. The words not
+ * walked yet are disabled then.
+ */
+static int collect(struct wordlist *wl, struct regionstruct *enaregs, const struct options *opts, int budgeted, struct analysis *an)
+{
+    const struct session *session = opts->session;
+    const uint32_t *entries = session ? session->entries : NULL;
+    size_t entriescount = session ? session->entriescount : 0;
+    const struct walkstate *resume = NULL;
+    struct walkstate stop;
+    uint64_t digest = 0;
+    size_t i;
 
-    if (!collectlabels(wl, ls, enaregs, disregs))
-        return 0;   /* Error */
+    if ((an->ls = alloclabels(an->arena)) == NULL || (an->disregs = allocarenaregions(an->arena)) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+    if (budgeted && opts->timebudget >= 0)
+        an->ls->deadline = &an->deadline;
+    if (opts->symbols && (entries = symbolentries(opts->symbols, an, entries, &entriescount)) == NULL)
+        return 0;
 
-    /* Print disabled regions in lising mode only */
-    if (listing)
-        printregions(disregs);
+    /* A walk made with other enabled regions or entry points is started over */
+    if (budgeted && opts->resume) {
+        digest = walkdigest(opts->resume, enaregs, entries, entriescount);
+        if (opts->resume->walk && opts->resume->walk->digest == digest)
+            resume = opts->resume->walk;
+    }
+    if (!collectlabels(wl, an->ls, enaregs, an->disregs, entries, entriescount, resume, &stop))
+        return 0;
+    stop.digest = digest;
+    if (budgeted && opts->resume && !keepwalk(opts->resume, an->ls->stopped ? &stop : NULL, an->ls, an->disregs))
+        return 0;
+    if (!an->ls->stopped)
+        return 1;
 
-    if (ls->labelscount)
-        padding = ((strlen(ls->labels[ls->labelscount-1].label)+1)/PADDING_TAB_SIZE+1)*PADDING_TAB_SIZE;
+    /* The words not reached by the stopped walks are disabled, the innermost one tells where it stopped */
+    an->partial = 1;
+    an->stoppedat = stop.framescount ? stop.frames[0].next : stop.image.next;
+    for (i = 0; i < stop.framescount; i++)
+        if (!addregion(an->disregs, stop.frames[i].skip ? stop.frames[i].begin : stop.frames[i].next, stop.frames[i].end))
+            goto err_alloc;
+    if (stop.image.next <= stop.image.end &&
+        !addregion(an->disregs, stop.image.skip ? stop.image.begin : stop.image.next, stop.image.end))
+        goto err_alloc;
+    return 1;
 
-    /* Main disassembly loop */
-    for (; wl; wl = wl->next) {
+err_alloc:
+    errmsg("Error allocating memory\n");
+    return 0;
+}
+
+/*
+ * Runs the analysis of the whole image: collects the labels and the disabled
+ * regions, and identifies the functions on request. The labels and the
+ * disabled regions go into the arena of an. On failure, the partial results
+ * are left in an for freeanalysis().
+ */
+static int analyze(struct wordlist *wl, struct regionstruct *enaregs, const struct options *opts, struct analysis *an)
+{
+    int added, n = 0, late;
+    size_t i;
+
+    if ((an->wi = allocwordindex(wl)) == NULL || (an->as = allocannotations()) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
 
-        /* If there is a discontinuity in the address, emit a .org directive */
-        if (!listing && lastwordaddr+1 != wl->wordaddress) {
-            for (pd = 0; pd < padding; pd++)
-                putc(' ', stdout);
-            printf(".org 0x%04x\n", wl->wordaddress);
+    an->stoppedat = UINT32_MAX;
+    if (opts->timebudget >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &an->deadline);
+        an->deadline.tv_sec += opts->timebudget / 1000;
+        an->deadline.tv_nsec += (long) (opts->timebudget % 1000) * 1000000;
+        if (an->deadline.tv_nsec >= 1000000000) {
+            an->deadline.tv_sec++;
+            an->deadline.tv_nsec -= 1000000000;
         }
+    }
 
-        /* Prepend word address and instruction word when in listing mode */
-        if (listing)
-            printf("C:%05x %04x ", wl->wordaddress, wl->word);
+    /* The walk from the reset and the interrupt vectors comes first within the time budget */
+    if (!collect(wl, enaregs, opts, 1, an))
+        return 0;
 
-        /* If there is a label for this address, then print the label */
-        if ((label = lookuplabel(ls, wl->wordaddress)))
-            printf("%s:", label), lablen = strlen(label)+1;
-        else
-            lablen = 0;
+    /*
+     * Past the time budget the refinements are left out: the regions those
+     * are likely code stay disabled, and the functions and the loops are
+     * found only for the files those go into.
+     */
+    late = an->partial || (opts->timebudget >= 0 && pastdeadline(&an->deadline));
+    if (late && (opts->enablethreshold >= 0 || opts->autoenable || opts->functions || opts->deadstores || opts->loops))
+        an->partial = 1;
+
+    /* Enable the disabled regions those are likely code, then collect again */
+    if (!late && (opts->enablethreshold >= 0 || opts->autoenable)) {
+        added = 0;
+        if (opts->enablethreshold >= 0 &&
+            (added = enablescoredregions(an->wi, an->disregs, enaregs, opts->enablethreshold)) < 0)
+            return 0;
+        if (opts->autoenable && (n = autoenableregions(wl, an->wi, enaregs)) < 0)
+            return 0;
+        if (added || n) {
+            freeregions(an->disregs);
+            freelabels(an->ls);
+            an->disregs = NULL;
+            an->ls = NULL;
+            if (!collect(wl, enaregs, opts, 0, an))
+                return 0;
+        }
+    }
 
-        /* Pad disassembled code line */
-        for (pd = 0; pd < padding-lablen; pd++)
-            putc(' ', stdout);
+    /* Recover the control flow graph for the analyses requested */
+    if ((!late && (opts->functions || opts->deadstores || opts->loops)) || opts->callgraph || opts->loopfile || opts->splitdir) {
+        if ((an->cfg = alloccfg()) == NULL) {
+            errmsg("Error allocating memory\n");
+            return 0;
+        }
+        if (!buildcfg(wl, enaregs, an->disregs, an->cfg))
+            return 0;
+    }
+
+    /* Identify the functions and their calls, the loops need those too */
+    if ((!late && (opts->functions || opts->loops)) || opts->callgraph || opts->loopfile || opts->splitdir) {
+        if ((an->cg = alloccallgraph()) == NULL) {
+            errmsg("Error allocating memory\n");
+            return 0;
+        }
+        if (!findfunctions(an->cfg, an->cg))
+            return 0;
+    }
+
+    /* Find the loops */
+    if ((!late && opts->loops) || opts->loopfile) {
+        if ((an->lf = allocloops()) == NULL) {
+            errmsg("Error allocating memory\n");
+            return 0;
+        }
+        if (!findloops(an->cfg, an->cg, an->lf))
+            return 0;
+    }
+
+    /* The comments of the session come first */
+    for (i = 0; opts->session && i < opts->session->comments.count; i++)
+        if (!addannotation(an->as, opts->session->comments.items[i].wordaddress, opts->session->comments.items[i].text)) {
+            errmsg("Error allocating memory\n");
+            return 0;
+        }
+    if (!late && opts->deadstores && !annotatedeadstores(an->cfg, an->as))
+        return 0;
+    if (!late && opts->loops && !annotateloops(an->cfg, an->lf, an->as))
+        return 0;
+    sortannotations(an->as);
+
+    if ((an->code = codemap(an->wi, enaregs, an->disregs, opts->session ? opts->session->dataregs : NULL,
+                            opts->symbols ? opts->symbols->dataregs : NULL)) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+
+    return genlabels(an->ls, opts->functions && !late ? an->cg : NULL, opts->session ? &opts->session->labels : NULL,
+                     opts->symbols);
+}
+
+/* Analyzes the image into the arena given, or into one of its own when NULL, NULL on error */
+static struct analysis *analyzein(struct wordlist *wl, struct regionstruct *enaregs, const struct options *opts,
+                                  struct arena *a)
+{
+    struct analysis *an = malloc(sizeof(struct analysis));
+
+    if (!an) {
+        errmsg("Error allocating memory\n");
+        return NULL;
+    }
+    memset(an, 0, sizeof(struct analysis));
+    if ((an->arena = a) == NULL) {
+        if ((an->arena = allocarena()) == NULL) {
+            errmsg("Error allocating memory\n");
+            free(an);
+            return NULL;
+        }
+        an->ownsarena = 1;
+    }
+    if (!analyze(wl, enaregs, opts, an)) {
+        freeanalysis(an);
+        return NULL;
+    }
+    return an;
+}
+
+/* Analyzes the image for rendering, NULL on error */
+struct analysis *allocanalysis(struct wordlist *wl, struct regionstruct *enaregs, const struct options *opts)
+{
+    return analyzein(wl, enaregs, opts, NULL);
+}
+
+static void indexline(struct renderjob *job, const struct renderedinstr *ri, struct outbuf *ob)
+{
+    if (!addindexentry(job->ix, ri->instr->wordaddress, ri->label, ob->pos + ob->len))
+        job->err = 1;
+}
+
+/*
+ * Writes the lines of the instruction into a source or a listing sink. Only
+ * instantiated for a constant kind by the writers below, so the tests of the
+ * kind are resolved at compile time.
+ */
+static ALWAYS_INLINE void writetextlines(struct renderjob *job, int kind, struct outbuf *ob, const struct renderedinstr *ri, uint32_t lastwordaddr)
+{
+    struct annotations *as = job->an->as;
+    struct annotation *ann;
+    uint32_t wordaddress = ri->instr->wordaddress;
+    size_t lablen = ri->label ? strlen(ri->label)+1 : 0;
+    const char *sep;
+
+    /* If there is a discontinuity in the address, emit a .org directive, GNU as counts bytes */
+    if (kind != SINK_LISTING && lastwordaddr+1 != wordaddress) {
+        obpad(ob, job->padding);
+        obfmt(ob, ".org 0x%04x\n", kind == SINK_GAS ? 2*wordaddress : wordaddress);
+    }
+
+    if (ri->indexed && ob == job->ob[0])
+        indexline(job, ri, ob);
+
+    /* Prepend word address and instruction word in the listing */
+    if (kind == SINK_LISTING) {
+        obputs(ob, "C:");
+        obhex(ob, wordaddress, 5);
+        obputc(ob, ' ');
+        obhex(ob, ri->instr->word, 4);
+        obputc(ob, ' ');
+    }
+
+    /* If there is a label for this address, then print the label */
+    if (ri->label)
+        obfmt(ob, "%s:", ri->label);
+
+    /* Pad disassembled code line */
+    obpad(ob, job->padding-lablen);
+
+    if (kind == SINK_GAS && ri->textlen > 4 && !memcmp(ri->text, ".dw ", 4)) {
+        obputs(ob, ".word ");
+        obwrite(ob, ri->text + 4, ri->textlen - 4);
+    } else
+        obwrite(ob, ri->text, ri->textlen);
+
+    /* Append the annotations of the instruction as comment */
+    if ((ann = findannotation(as, wordaddress)))
+        for (sep = " ; "; ann < as->items + as->count && ann->wordaddress == wordaddress; ann++) {
+            obfmt(ob, "%s%s", sep, ann->text);
+            sep = "; ";
+        }
+    obputc(ob, '\n');
+
+    /* Continuation line of a 32-bit opcode in the listing */
+    if (kind == SINK_LISTING && ri->last != ri->instr)
+        obfmt(ob, "C:%05x %04x\n", ri->last->wordaddress, ri->last->word);
+}
+
+/* Writes the instruction as a record into a record sink, instantiated like writetextlines() */
+static ALWAYS_INLINE void writerecord(struct renderjob *job, int kind, struct outbuf *ob, const struct renderedinstr *ri, uint32_t lastwordaddr)
+{
+    struct instrrecord ir;
+    struct instrinfo ii;
+
+    if (ri->indexed && ob == job->ob[0])
+        indexline(job, ri, ob);
+
+    memset(&ir, 0, sizeof(struct instrrecord));
+    ir.wordaddress = ri->instr->wordaddress;
+    ir.words[0] = ri->instr->word;
+    ir.words[1] = ri->last->word;
+    ir.size = ri->last != ri->instr ? 2 : 1;
+    ir.region = !ri->code ? REGION_DATA : inregions(job->enaregs, ir.wordaddress) ? REGION_ENABLED : REGION_CODE;
+    if (ri->code && decodeinstr(ri->instr, &ii)) {
+        ir.flow = ii.flow;
+        ir.hastarget = ii.flow == FLOW_BRANCH || ii.flow == FLOW_JUMP || ii.flow == FLOW_CALL;
+        ir.target = ii.target;
+    }
+    ir.text = ri->text;
+    ir.textlen = ri->textlen;
+    ir.label = ri->label;
+
+    if (kind == SINK_JSONL)
+        writejsonrecord(ob, &ir);
+    else if (kind == SINK_RECORDS) {
+        /* The callback failing stops the output like a failed write */
+        if (!ob->err && !job->sinks[0].record(job->sinks[0].arg, &ir))
+            ob->err = 1;
+    } else if (!writebinrecord(ob, job->st, &ir))
+        job->err = 1;
+    if (ob == job->ob[0])
+        job->records++;
+}
+
+#define SINK_WRITER(name, write, kind) \
+static void name(struct renderjob *job, struct outbuf *ob, const struct renderedinstr *ri, uint32_t lastwordaddr) \
+{ \
+    write(job, kind, ob, ri, lastwordaddr); \
+}
+
+SINK_WRITER(writeasm, writetextlines, SINK_ASM)
+SINK_WRITER(writelisting, writetextlines, SINK_LISTING)
+SINK_WRITER(writegas, writetextlines, SINK_GAS)
+SINK_WRITER(writejsonl, writerecord, SINK_JSONL)
+SINK_WRITER(writebin, writerecord, SINK_BIN)
+SINK_WRITER(writerecords, writerecord, SINK_RECORDS)
+
+/* The writers by enum sinkkind */
+static void (*const sinkwriters[])(struct renderjob *, struct outbuf *, const struct renderedinstr *, uint32_t) = {
+    writeasm, writelisting, writegas, writejsonl, writebin, writerecords
+};
+
+/*
+ * Marks the bytes of x in the range of 0x20-0x7e, except the quote and the
+ * backslash, in their top bit. Works on all the eight bytes at once, without
+ * carries between the bytes.
+ */
+static uint64_t printablebytes(uint64_t x)
+{
+    uint64_t low = x & ~BYTES_HIGHS;
+    uint64_t q = x ^ ('"' * BYTES_ONES), b = x ^ ('\\' * BYTES_ONES);
+
+    return (low + 0x60 * BYTES_ONES) & ~(low + BYTES_ONES) & ~x &
+           (((q & ~BYTES_HIGHS) + ~BYTES_HIGHS) | q) &
+           (((b & ~BYTES_HIGHS) + ~BYTES_HIGHS) | b) & BYTES_HIGHS;
+}
 
-        if (!inregions(enaregs, wl->wordaddress) && inregions(disregs, wl->wordaddress))
-            printf(".dw 0x%04x\n", wl->word);
+static int printablechar(unsigned int c)
+{
+    return c >= 0x20 && c < 0x7f && c != '"' && c != '\\';
+}
+
+/* Counts the printable words from each word of the run on, scanning four words at a time */
+static void scanprintable(const uint16_t *v, uint32_t *printable, size_t n)
+{
+    uint64_t x, m;
+    size_t i, j;
+
+    for (i = 0; i < n; i += 4) {
+        for (x = 0, j = 0; j < 4 && i+j < n; j++)
+            x |= (uint64_t) v[i+j] << (16*j);
+        m = printablebytes(x);
+        for (j = 0; j < 4 && i+j < n; j++)
+            printable[i+j] = ((m >> (16*j)) & 0x8080) == 0x8080;
+    }
+    for (i = n; i-- > 1; )
+        if (printable[i-1])
+            printable[i-1] += printable[i];
+}
+
+/* Returns the length of the string at word i in chars, setting its words and if it is zero terminated */
+static size_t stringat(struct renderjob *job, size_t n, size_t i, size_t *words, int *terminated)
+{
+    const uint16_t *v = job->runwords;
+
+    *words = job->runprintable[i];
+    *terminated = i + *words < n && printablechar(v[i + *words] & 0xff) && !(v[i + *words] >> 8);
+    return 2 * *words + *terminated;
+}
+
+/* Tells if the fill at word i gets collapsed, returns its end */
+static size_t fillat(struct renderjob *job, int kind, size_t n, size_t i)
+{
+    const uint16_t *v = job->runwords;
+    size_t j;
+
+    for (j = i+1; j < n && v[j] == v[i]; j++);
+    if (j - i < FILL_MIN_WORDS || (kind != SINK_GAS && v[i] != 0xffff))
+        return i;
+    return j;
+}
+
+/* Starts a line of a data run: the index entry, the label and the padding */
+static void startdataline(struct renderjob *job, struct outbuf *ob, const char *label, uint32_t begin, uint32_t end, uint32_t before)
+{
+    if (job->ix && ob == job->ob[0] &&
+        (label || (job->head && begin == job->first->wordaddress) ||
+         end / job->indexstep != before / job->indexstep) &&
+        !addindexentry(job->ix, begin, label, ob->pos + ob->len))
+        job->err = 1;
+
+    if (label)
+        obfmt(ob, "%s:", label);
+    obpad(ob, job->padding - (label ? strlen(label)+1 : 0));
+}
+
+/*
+ * Writes the run of data words compacted into a source sink: strings as
+ * .db or .ascii, fills of the same word as .fill for GNU as and erased flash
+ * skipped with .org for AVRASM, the rest in rows of .dw or .word.
+ */
+static void writedatarun(struct renderjob *job, int kind, struct outbuf *ob, uint32_t first, const char *label, size_t n, uint32_t lastwordaddr)
+{
+    const uint16_t *v = job->runwords;
+    size_t i = 0, j, k, words, chars;
+    uint32_t before = lastwordaddr;
+    int terminated;
+
+    if (lastwordaddr+1 != first) {
+        obpad(ob, job->padding);
+        obfmt(ob, ".org 0x%04x\n", kind == SINK_GAS ? 2*first : first);
+    }
+
+    for (; i < n; label = NULL, before = first + i - 1) {
+        /* A labeled fill starts with a row, so the label stays */
+        if (!label && (j = fillat(job, kind, n, i)) > i) {
+            if (kind == SINK_GAS) {
+                startdataline(job, ob, NULL, first + i, first + j - 1, before);
+                obfmt(ob, ".fill %u, 2, 0x%04x\n", (unsigned int) (j - i), v[i]);
+            } else {
+                obpad(ob, job->padding);
+                obfmt(ob, ".org 0x%04x\n", first + j);
+            }
+            i = j;
+            continue;
+        }
+
+        if ((chars = stringat(job, n, i, &words, &terminated)) >= STRING_MIN_CHARS) {
+            if (words > STRING_LINE_WORDS) {
+                words = STRING_LINE_WORDS;
+                terminated = 0;
+            }
+            startdataline(job, ob, label, first + i, first + i + words + terminated - 1, before);
+            obputs(ob, kind == SINK_GAS ? (terminated ? ".asciz \"" : ".ascii \"") : ".db \"");
+            for (k = i; k < i + words; k++) {
+                obputc(ob, v[k] & 0xff);
+                obputc(ob, v[k] >> 8);
+            }
+            if (terminated)
+                obputc(ob, v[k] & 0xff);
+            obputs(ob, terminated && kind != SINK_GAS ? "\", 0\n" : "\"\n");
+            i += words + terminated;
+            continue;
+        }
+
+        /* A row up to the next string or collapsed fill */
+        for (j = i+1; j < n && j - i < DATA_ROW_WORDS && fillat(job, kind, n, j) == j &&
+                      stringat(job, n, j, &words, &terminated) < STRING_MIN_CHARS; j++);
+        startdataline(job, ob, label, first + i, first + j - 1, before);
+        obputs(ob, kind == SINK_GAS ? ".word " : ".dw ");
+        for (k = i; k < j; k++)
+            obfmt(ob, k > i ? ", 0x%04x" : "0x%04x", v[k]);
+        obputc(ob, '\n');
+        i = j;
+    }
+}
+
+/*
+ * Collects the run of data words from wl: the following data words of the
+ * chunk without gaps and labels, and writes it into the compacting sinks.
+ * Returns the length of the run, 0 on error.
+ */
+static size_t writedataruns(struct renderjob *job, struct wordlist *wl, size_t index, const char *label, uint32_t lastwordaddr)
+{
+    struct analysis *an = job->an;
+    struct wordlist *w;
+    size_t n = 0, s, size;
+    uint16_t *words;
+    uint32_t *printable;
+
+    for (w = wl; w != job->stop && !an->code[index + n] &&
+                 (w == wl || (w->wordaddress == wl->wordaddress + n && !lookuplabel(an->ls, w->wordaddress)));
+         w = w->next) {
+        if (n == job->runsize) {
+            size = job->runsize ? 2 * job->runsize : 256;
+            if ((words = realloc(job->runwords, size * sizeof(uint16_t))) == NULL)
+                goto err_alloc;
+            job->runwords = words;
+            if ((printable = realloc(job->runprintable, size * sizeof(uint32_t))) == NULL)
+                goto err_alloc;
+            job->runprintable = printable;
+            job->runsize = size;
+        }
+        job->runwords[n++] = w->word;
+    }
+
+    scanprintable(job->runwords, job->runprintable, n);
+    for (s = 0; s < job->nsinks; s++)
+        if (job->sinks[s].compact)
+            writedatarun(job, job->sinks[s].kind, job->ob[s], wl->wordaddress, label, n, lastwordaddr);
+    return n;
+
+err_alloc:
+    job->err = 1;
+    return 0;
+}
+
+/* Renders the words of the job, the lines of the instructions starting in it into every sink */
+static void renderwords(struct renderjob *job)
+{
+    const char *mnemonic, *operand;
+    int d, r, b, k, K, A, q;
+    int thirtytwobit, code, hit;
+    uint32_t targetwordaddr;
+    uint32_t lastwordaddr = job->lastwordaddr;
+    size_t i, index, runleft = 0;
+    uint16_t word;
+    struct wordlist *wl, *instr;
+    struct renderedinstr ri;
+    struct analysis *an = job->an;
+    struct labelstruct *ls = an->ls;
+    struct outbuf *ob = job->scratch;
+    struct rendercache *rc = job->rc;
+
+    /* Main disassembly loop */
+    for (wl = job->first, index = job->firstindex; wl != job->stop; wl = wl->next, index++) {
+
+        instr = wl;
+        ri.label = lookuplabel(ls, wl->wordaddress);
+
+        /* Index the lines of the labels and the first line of every sampled block of addresses */
+        ri.indexed = job->ix && (ri.label || (job->head && wl == job->first) ||
+                                 wl->wordaddress / job->indexstep != lastwordaddr / job->indexstep);
+
+        /* Render once, so the text can be saved in the cache and written into every sink */
+        word = wl->word;
+        code = an->code[index];
+        hit = code && rc->len[word];
+
+        /* Write a whole run of data words at once into the compacting sinks */
+        if (job->compact && !code && !runleft)
+            runleft = writedataruns(job, wl, index, ri.label, lastwordaddr);
+        if (runleft && job->allcompact) {
+            runleft--;
+            lastwordaddr = wl->wordaddress;
+            continue;
+        }
+
+        ob->len = 0;
+
+        if (!code)
+            obfmt(ob, ".dw 0x%04x", wl->word);
+        else if (hit)
+            obwrite(ob, rc->text[wl->word], rc->len[wl->word]);
         else if (adc(wl->word, &d, &r))
             if (d != r)
-                printf("adc r%d, r%d\n", d, r);
+                obfmt(ob, "adc r%d, r%d", d, r);
             else
-                printf("rol r%d\n", d);
+                obfmt(ob, "rol r%d", d);
         else if (add(wl->word, &d, &r))
             if (d != r)
-                printf("add r%d, r%d\n", d, r);
+                obfmt(ob, "add r%d, r%d", d, r);
             else
-                printf("lsl r%d\n", d);
+                obfmt(ob, "lsl r%d", d);
         else if (adiw(wl->word, &d, &K))
-            printf("adiw r%d:r%d, %d\n", 2*d+24+1, 2*d+24, K);
+            obfmt(ob, "adiw r%d:r%d, %d", 2*d+24+1, 2*d+24, K);
         else if (and(wl->word, &d, &r))
             if (d != r)
-                printf("and r%d, r%d\n", d, r);
+                obfmt(ob, "and r%d, r%d", d, r);
             else
-                printf("tst r%d\n", d);
+                obfmt(ob, "tst r%d", d);
         else if (andi(wl->word, &d, &K))
-            printf("andi r%d, %d\n", d+16, K);
+            obfmt(ob, "andi r%d, %d", d+16, K);
         else if (asr(wl->word, &d))
-            printf("asr r%d\n", d);
+            obfmt(ob, "asr r%d", d);
         else if (bld(wl->word, &d, &b))
-            printf("bld r%d, %d\n", d, b);
+            obfmt(ob, "bld r%d, %d", d, b);
         else if (bst(wl->word, &r, &b))
-            printf("bst r%d, %d\n", r, b);
+            obfmt(ob, "bst r%d, %d", r, b);
         else if (condrelbranch(wl->word, wl->wordaddress, &mnemonic, &targetwordaddr))
-            printf("%s %s\n", mnemonic, lookuplabel(ls, targetwordaddr));
+            obfmt(ob, "%s %s", mnemonic, lookuplabel(ls, targetwordaddr));
         else if (rcall(wl->word, wl->wordaddress, &targetwordaddr))
-            printf("rcall %s\n", lookuplabel(ls, targetwordaddr));
+            obfmt(ob, "rcall %s", lookuplabel(ls, targetwordaddr));
         else if (rjmp(wl->word, wl->wordaddress, &targetwordaddr))
-            printf("rjmp %s\n", lookuplabel(ls, targetwordaddr));
+            obfmt(ob, "rjmp %s", lookuplabel(ls, targetwordaddr));
         else if (call(wl, &targetwordaddr)) {
-            printf("call %s\n", lookuplabel(ls, targetwordaddr));
+            obfmt(ob, "call %s", lookuplabel(ls, targetwordaddr));
             wl = wl->next; /* 32-bit opcode */
-            if (listing)
-                printf("C:%05x %04x\n", wl->wordaddress, wl->word);
         }
         else if (jmp(wl, &targetwordaddr)) {
-            printf("jmp %s\n", lookuplabel(ls, targetwordaddr));
+            obfmt(ob, "jmp %s", lookuplabel(ls, targetwordaddr));
             wl = wl->next; /* 32-bit opcode */
-            if (listing)
-                printf("C:%05x %04x\n", wl->wordaddress, wl->word);
         }
         else if (wl->word == 0x9598)
-            printf("break\n");
+            obfmt(ob, "break");
         else if (cbi(wl->word, &A, &b))
-            printf("cbi 0x%02x, %d\n", A, b);
+            obfmt(ob, "cbi 0x%02x, %d", A, b);
         else if (wl->word == 0x9488)
-            printf("clc\n");
+            obfmt(ob, "clc");
         else if (wl->word == 0x94d8)
-            printf("clh\n");
+            obfmt(ob, "clh");
         else if (wl->word == 0x94f8)
-            printf("cli\n");
+            obfmt(ob, "cli");
         else if (wl->word == 0x94a8)
-            printf("cln\n");
+            obfmt(ob, "cln");
         else if (wl->word == 0x94c8)
-            printf("cls\n");
+            obfmt(ob, "cls");
         else if (wl->word == 0x94e8)
-            printf("clt\n");
+            obfmt(ob, "clt");
         else if (wl->word == 0x94b8)
-            printf("clv\n");
+            obfmt(ob, "clv");
         else if (wl->word == 0x9498)
-            printf("clz\n");
+            obfmt(ob, "clz");
         else if (com(wl->word, &d))
-            printf("com r%d\n", d);
+            obfmt(ob, "com r%d", d);
         else if (cp(wl->word, &d, &r))
-            printf("cp r%d, r%d\n", d, r);
+            obfmt(ob, "cp r%d, r%d", d, r);
         else if (cpc(wl->word, &d, &r))
-            printf("cpc r%d, r%d\n", d, r);
+            obfmt(ob, "cpc r%d, r%d", d, r);
         else if (cpi(wl->word, &d, &K))
-            printf("cpi r%d, %d\n", d+16, K);
+            obfmt(ob, "cpi r%d, %d", d+16, K);
         else if (cpse(wl->word, &d, &r))
-            printf("cpse r%d, r%d\n", d, r);
+            obfmt(ob, "cpse r%d, r%d", d, r);
         else if (dec(wl->word, &d))
-            printf("dec r%d\n", d);
+            obfmt(ob, "dec r%d", d);
         else if (des(wl->word, &K))
-            printf("des 0x%02x\n", K);
+            obfmt(ob, "des 0x%02x", K);
         else if (wl->word == 0x9519)
-            printf("eicall\n");
+            obfmt(ob, "eicall");
         else if (eijmp(wl->word))
-            printf("eijmp\n");
+            obfmt(ob, "eijmp");
         else if (elpm(wl->word, &d, &operand))
             if (*operand)
-                printf("elpm r%d, %s\n", d, operand);
+                obfmt(ob, "elpm r%d, %s", d, operand);
             else
-                printf("elpm\n");
+                obfmt(ob, "elpm");
         else if (eor(wl->word, &d, &r))
             if (d != r)
-                printf("eor r%d, r%d\n", d, r);
+                obfmt(ob, "eor r%d, r%d", d, r);
             else
-                printf("clr r%d\n", d);
+                obfmt(ob, "clr r%d", d);
         else if (fmul(wl->word, &d, &r))
-            printf("fmul r%d, r%d\n", d+16, r+16);
+            obfmt(ob, "fmul r%d, r%d", d+16, r+16);
         else if (fmuls(wl->word, &d, &r))
-            printf("fmuls r%d, r%d\n", d+16, r+16);
+            obfmt(ob, "fmuls r%d, r%d", d+16, r+16);
         else if (fmulsu(wl->word, &d, &r))
-            printf("fmulsu r%d, r%d\n", d+16, r+16);
+            obfmt(ob, "fmulsu r%d, r%d", d+16, r+16);
         else if (wl->word == 0x9509)
-            printf("icall\n");
+            obfmt(ob, "icall");
         else if (ijmp(wl->word))
-            printf("ijmp\n");
+            obfmt(ob, "ijmp");
         else if (in(wl->word, &d, &A))
-            printf("in r%d, 0x%02x\n", d, A);
+            obfmt(ob, "in r%d, 0x%02x", d, A);
         else if (inc(wl->word, &d))
-            printf("inc r%d\n", d);
+            obfmt(ob, "inc r%d", d);
         else if (lac(wl->word, &d))
-            printf("lac Z, r%d\n", d);
+            obfmt(ob, "lac Z, r%d", d);
         else if (las(wl->word, &d))
-            printf("las Z, r%d\n", d);
+            obfmt(ob, "las Z, r%d", d);
         else if (lat(wl->word, &d))
-            printf("lat Z, r%d\n", d);
+            obfmt(ob, "lat Z, r%d", d);
         else if (ld(wl->word, &d, &operand, &q))
             if (q > 0)
-                printf("ldd r%d, %s+%d\n", d, operand, q);
+                obfmt(ob, "ldd r%d, %s+%d", d, operand, q);
             else
-                printf("ld r%d, %s\n", d, operand);
+                obfmt(ob, "ld r%d, %s", d, operand);
         else if (ldi(wl->word, &d, &K))
             if (K != 0xff)
-                printf("ldi r%d, %d\n", d+16, K);
+                obfmt(ob, "ldi r%d, %d", d+16, K);
             else
-                printf("ser r%d\n", d+16);
+                obfmt(ob, "ser r%d", d+16);
         else if (lds(wl, &thirtytwobit, &d, &k)) {
-            printf("lds r%d, 0x%02x\n", d, k);
+            obfmt(ob, "lds r%d, 0x%02x", d, k);
             if (thirtytwobit) {
                 wl = wl->next; /* 32-bit opcode */
-                if (listing)
-                    printf("C:%05x %04x\n", wl->wordaddress, wl->word);
             }
         }
         else if (lpm(wl->word, &d, &operand))
             if (*operand)
-                printf("lpm r%d, %s\n", d, operand);
+                obfmt(ob, "lpm r%d, %s", d, operand);
             else
-                printf("lpm\n");
+                obfmt(ob, "lpm");
         else if (lsr(wl->word, &d))
-            printf("lsr r%d\n", d);
+            obfmt(ob, "lsr r%d", d);
         else if (mov(wl->word, &d, &r))
-            printf("mov r%d, r%d\n", d, r);
+            obfmt(ob, "mov r%d, r%d", d, r);
         else if (movw(wl->word, &d, &r))
-            printf("movw r%d:r%d, r%d:r%d\n", 2*d+1, 2*d, 2*r+1, 2*r);
+            obfmt(ob, "movw r%d:r%d, r%d:r%d", 2*d+1, 2*d, 2*r+1, 2*r);
         else if (mul(wl->word, &d, &r))
-            printf("mul r%d, r%d\n", d, r);
+            obfmt(ob, "mul r%d, r%d", d, r);
         else if (muls(wl->word, &d, &r))
-            printf("muls r%d, r%d\n", d+16, r+16);
+            obfmt(ob, "muls r%d, r%d", d+16, r+16);
         else if (mulsu(wl->word, &d, &r))
-            printf("mulsu r%d, r%d\n", d+16, r+16);
+            obfmt(ob, "mulsu r%d, r%d", d+16, r+16);
         else if (neg(wl->word, &d))
-            printf("neg r%d\n", d);
+            obfmt(ob, "neg r%d", d);
         else if (wl->word == 0x0000)
-            printf("nop\n");
+            obfmt(ob, "nop");
         else if (or(wl->word, &d, &r))
-            printf("or r%d, r%d\n", d, r);
+            obfmt(ob, "or r%d, r%d", d, r);
         else if (ori(wl->word, &d, &K))
-            printf("ori r%d, %d\n", d+16, K);
+            obfmt(ob, "ori r%d, %d", d+16, K);
         else if (out(wl->word, &A, &r))
-            printf("out 0x%02x, r%d\n", A, r);
+            obfmt(ob, "out 0x%02x, r%d", A, r);
         else if (pop(wl->word, &d))
-            printf("pop r%d\n", d);
+            obfmt(ob, "pop r%d", d);
         else if (push(wl->word, &r))
-            printf("push r%d\n", r);
+            obfmt(ob, "push r%d", r);
         else if (ret(wl->word))
-            printf("ret\n");
+            obfmt(ob, "ret");
         else if (reti(wl->word))
-            printf("reti\n");
+            obfmt(ob, "reti");
         else if (ror(wl->word, &d))
-            printf("ror r%d\n", d);
+            obfmt(ob, "ror r%d", d);
         else if (sbc(wl->word, &d, &r))
-            printf("sbc r%d, r%d\n", d, r);
+            obfmt(ob, "sbc r%d, r%d", d, r);
         else if (sbci(wl->word, &d, &K))
-            printf("sbci r%d, %d\n", d+16, K);
+            obfmt(ob, "sbci r%d, %d", d+16, K);
         else if (sbi(wl->word, &A, &b))
-            printf("sbi 0x%02x, %d\n", A, b);
+            obfmt(ob, "sbi 0x%02x, %d", A, b);
         else if (sbic(wl->word, &A, &b))
-            printf("sbic 0x%02x, %d\n", A, b);
+            obfmt(ob, "sbic 0x%02x, %d", A, b);
         else if (sbis(wl->word, &A, &b))
-            printf("sbis 0x%02x, %d\n", A, b);
+            obfmt(ob, "sbis 0x%02x, %d", A, b);
         else if (sbiw(wl->word, &d, &K))
-            printf("sbiw r%d:r%d, %d\n", 2*d+24+1, 2*d+24, K);
+            obfmt(ob, "sbiw r%d:r%d, %d", 2*d+24+1, 2*d+24, K);
         else if (sbrc(wl->word, &r, &b))
-            printf("sbrc r%d, %d\n", r, b);
+            obfmt(ob, "sbrc r%d, %d", r, b);
         else if (sbrs(wl->word, &r, &b))
-            printf("sbrs r%d, %d\n", r, b);
+            obfmt(ob, "sbrs r%d, %d", r, b);
         else if (wl->word == 0x9408)
-            printf("sec\n");
+            obfmt(ob, "sec");
         else if (wl->word == 0x9458)
-            printf("seh\n");
+            obfmt(ob, "seh");
         else if (wl->word == 0x9478)
-            printf("sei\n");
+            obfmt(ob, "sei");
         else if (wl->word == 0x9428)
-            printf("sen\n");
+            obfmt(ob, "sen");
         else if (wl->word == 0x9448)
-            printf("ses\n");
+            obfmt(ob, "ses");
         else if (wl->word == 0x9468)
-            printf("set\n");
+            obfmt(ob, "set");
         else if (wl->word == 0x9438)
-            printf("sev\n");
+            obfmt(ob, "sev");
         else if (wl->word == 0x9418)
-            printf("sez\n");
+            obfmt(ob, "sez");
         else if (wl->word == 0x9588)
-            printf("sleep\n");
+            obfmt(ob, "sleep");
         else if (wl->word == 0x95e8)
-            printf("spm\n");
+            obfmt(ob, "spm");
         else if (st(wl->word, &operand, &q, &r))
             if (q > 0)
-                printf("std %s+%d, r%d\n", operand, q, r);
+                obfmt(ob, "std %s+%d, r%d", operand, q, r);
             else
-                printf("st %s, r%d\n", operand, r);
+                obfmt(ob, "st %s, r%d", operand, r);
         else if (sts(wl, &thirtytwobit, &k, &r)) {
-            printf("sts 0x%02x, r%d\n", k, r);
+            obfmt(ob, "sts 0x%02x, r%d", k, r);
             if (thirtytwobit) {
                 wl = wl->next; /* 32-bit opcode */
-                if (listing)
-                    printf("C:%05x %04x\n", wl->wordaddress, wl->word);
             }
         }
         else if (sub(wl->word, &d, &r))
-            printf("sub r%d, r%d\n", d, r);
+            obfmt(ob, "sub r%d, r%d", d, r);
         else if (subi(wl->word, &d, &K))
-            printf("subi r%d, %d\n", d+16, K);
+            obfmt(ob, "subi r%d, %d", d+16, K);
         else if (swap(wl->word, &d))
-            printf("swap r%d\n", d);
+            obfmt(ob, "swap r%d", d);
         else if (wl->word == 0x95a8)
-            printf("wdr\n");
+            obfmt(ob, "wdr");
         else if (xch(wl->word, &d))
-            printf("xch Z, r%d\n", d);
+            obfmt(ob, "xch Z, r%d", d);
         else
-            printf(".dw 0x%04x\n", wl->word); /* Unknown */
+            obfmt(ob, ".dw 0x%04x", wl->word); /* Unknown */
+
+        /* Save the rendering of the instructions not depending on their position */
+        if (code && !hit && ob->len <= RENDER_SLOT_SIZE && positionindependent(word)) {
+            memcpy(rc->text[word], ob->buf, ob->len);
+            rc->len[word] = ob->len;
+        }
+
+        if (wl != instr)
+            index++;    /* 32-bit opcode */
+
+        ri.instr = instr;
+        ri.last = wl;
+        ri.code = code;
+        ri.text = ob->buf;
+        ri.textlen = ob->len;
+        for (i = 0; i < job->nsinks; i++)
+            if (!runleft || !job->sinks[i].compact)
+                job->sinks[i].write(job, job->ob[i], &ri, lastwordaddr);
+        if (runleft)
+            runleft--;
 
         /* Save last address for discontinuity check */
         lastwordaddr = wl->wordaddress;
     }   /* Main disassembly loop */
+}
 
-    freeregions(disregs);
-    freelabels(ls);
+static void *renderthread(void *arg)
+{
+    renderwords(arg);
+    return NULL;
+}
+
+/* Tells if the word at index i is the second word of a 32-bit opcode, looking back only as far as needed */
+static int secondwordat(struct analysis *an, size_t i)
+{
+    int second = 0;
+
+    /* The words of a run of 32-bit opcodes pair up from the beginning of the run */
+    while (i--) {
+        if (!thirtytwobitop(an->wi->words[i]->word) || !an->code[i])
+            break;
+        second = !second;
+    }
+    return second;
+}
+
+/*
+ * Splits the words from index lo up to hi into at most n chunks of about the
+ * same size for the jobs, never between the two words of a 32-bit opcode,
+ * and when compacting the data runs, never inside a run. Returns the number
+ * of the chunks.
+ */
+static size_t splitwords(struct analysis *an, struct renderjob *jobs, size_t n, size_t lo, size_t hi, int compact)
+{
+    struct wordindex *wi = an->wi;
+    struct wordlist *w;
+    size_t i, k = 1;
+    int secondword = 0;
+
+    /* A window starts with a .org directive */
+    jobs[0].first = lo < wi->count ? wi->words[lo] : NULL;
+    jobs[0].firstindex = lo;
+    jobs[0].lastwordaddr = lo < wi->count && lo ? wi->words[lo]->wordaddress : 0;
+
+    for (i = lo; i < hi && k < n; i++) {
+        w = wi->words[i];
+        if (secondword) {
+            secondword = 0;
+            continue;
+        }
+        if (i >= lo + k * (hi - lo) / n && (!compact || an->code[i])) {
+            jobs[k].first = w;
+            jobs[k].firstindex = i;
+            jobs[k].lastwordaddr = wi->words[i-1]->wordaddress;
+            jobs[k-1].stop = w;
+            k++;
+        }
+        secondword = thirtytwobitop(w->word) && w->next && an->code[i];
+    }
+    jobs[k-1].stop = hi < wi->count ? wi->words[hi] : NULL;
+
+    return k;
+}
+
+/*
+ * Finds the window of the words to render, from the beginning of the
+ * instruction at the start address up to the end of the instruction at the
+ * end address.
+ */
+static void findwindow(struct analysis *an, const struct options *opts, size_t *lo, size_t *hi)
+{
+    struct wordindex *wi = an->wi;
+
+    *lo = 0;
+    *hi = wi->count;
+    if (!opts->range)
+        return;
+
+    *lo = wordpos(wi, opts->rangebegin);
+    *hi = opts->rangeend < UINT32_MAX ? wordpos(wi, opts->rangeend + 1) : wi->count;
+    if (*lo < wi->count && secondwordat(an, *lo))
+        (*lo)--;
+    if (*hi < wi->count && secondwordat(an, *hi))
+        (*hi)++;
+    if (*hi < *lo)
+        *hi = *lo;
+}
+
+static int addrcmp(const void *lhs, const void *rhs)
+{
+    uint32_t l = *(const uint32_t *) lhs;
+    uint32_t r = *(const uint32_t *) rhs;
+
+    return l < r ? -1 : l > r;
+}
+
+/*
+ * Emits the labels the instructions of the window refer to, but which are
+ * defined outside of it, as .equ directives, so the window assembles alone.
+ */
+static int emitwindowlabels(struct outbuf *ob, int kind, struct analysis *an, size_t lo, size_t hi, size_t padding)
+{
+    struct wordindex *wi = an->wi;
+    struct wordlist *w;
+    struct instrinfo ii;
+    uint32_t *targets;
+    const char *label;
+    size_t i, n = 0;
+
+    if (lo >= hi)
+        return 1;
+    if ((targets = malloc((hi - lo) * sizeof(uint32_t))) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+
+    for (i = lo; i < hi; i++) {
+        w = wi->words[i];
+        if (!an->code[i] || !decodeinstr(w, &ii))
+            continue;
+        if (ii.size == 2)
+            i++;    /* 32-bit opcode */
+        if ((ii.flow == FLOW_BRANCH || ii.flow == FLOW_JUMP || ii.flow == FLOW_CALL) &&
+            (ii.target < wi->words[lo]->wordaddress || ii.target > wi->words[hi-1]->wordaddress))
+            targets[n++] = ii.target;
+    }
+
+    qsort(targets, n, sizeof(uint32_t), addrcmp);
+    for (i = 0; i < n; i++)
+        if ((!i || targets[i] != targets[i-1]) && (label = lookuplabel(an->ls, targets[i]))) {
+            obpad(ob, padding);
+            if (kind == SINK_GAS)
+                obfmt(ob, ".equ %s, 0x%04x\n", label, 2*targets[i]);
+            else
+                obfmt(ob, ".equ %s = 0x%04x\n", label, targets[i]);
+        }
+
+    free(targets);
+    return 1;
+}
+
+/* Copies the regions overlapping the window */
+static struct regionstruct *windowregions(struct regionstruct *rs, uint32_t begin, uint32_t end)
+{
+    struct regionstruct *ws;
+    struct region *r;
+
+    if ((ws = allocregions()) == NULL)
+        return NULL;
+    for (r = rs->first; r; r = r->next)
+        if (r->end >= begin && r->begin <= end && !addregion(ws, r->begin, r->end)) {
+            freeregions(ws);
+            return NULL;
+        }
+    return ws;
+}
+
+/* The number of rendering threads asked for, one per processor by default */
+size_t jobcount(const struct options *opts)
+{
+    long cpus;
+
+    if (opts->jobs)
+        return opts->jobs;
+    return (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? cpus : 1;
+}
+
+static size_t labelpadding(struct labelstruct *ls)
+{
+    if (!ls->labelscount)
+        return 0;
+    return ((maxlabellen(ls)+1)/PADDING_TAB_SIZE+1)*PADDING_TAB_SIZE;
+}
+
+/* A part of the image written to a file of its own */
+struct segment {
+    size_t lo, hi;          /* Word indices, hi is the first one after the segment */
+    char name[16];          /* F_nnnn for the functions, C_nnnn for other code, D_nnnn for data */
+    const char *kind;
+};
+
+/* Segments shared by the threads writing them */
+struct splitpool {
+    struct analysis *an;
+    struct regionstruct *enaregs;
+    const struct options *opts;
+    size_t padding;
+    struct segment *segs;
+    size_t count;
+    size_t next;            /* Next segment to write */
+    pthread_mutex_t lock;
+    int err;
+};
+
+/*
+ * Cuts the image into segments: a new one starts at each function entry and
+ * where the words turn from code to data or back, but never inside a 32-bit
+ * opcode.
+ */
+static struct segment *findsegments(struct analysis *an, size_t *count)
+{
+    struct wordindex *wi = an->wi;
+    struct callgraph *cg = an->cg;
+    struct segment *segs = NULL, *ns;
+    size_t i, f = 0, n = 0, size = 0;
+    uint32_t wordaddress;
+    int entry;
+
+    for (i = 0; i < wi->count; i++) {
+        wordaddress = wi->words[i]->wordaddress;
+        while (f < cg->funccount && cg->funcs[f].entry < wordaddress)
+            f++;
+        entry = an->code[i] && f < cg->funccount && cg->funcs[f].entry == wordaddress;
+        if (i && ((!entry && an->code[i] == an->code[i-1]) || secondwordat(an, i)))
+            continue;
+
+        if (n == size) {
+            size = size ? 2 * size : 64;
+            if ((ns = realloc(segs, size * sizeof(struct segment))) == NULL) {
+                free(segs);
+                return NULL;
+            }
+            segs = ns;
+        }
+        if (n)
+            segs[n-1].hi = i;
+        segs[n].lo = i;
+        snprintf(segs[n].name, sizeof(segs[n].name), entry ? FUNCTION_LABEL_FMT : an->code[i] ? "C_%04x" : "D_%04x",
+                 wordaddress);
+        segs[n].kind = entry ? "function" : an->code[i] ? "code" : "data";
+        n++;
+    }
+    if (n)
+        segs[n-1].hi = wi->count;
+
+    *count = n;
+    return segs ? segs : malloc(1);
+}
+
+/* Writes the segment into its file, in the output kind of the job's sink */
+static int writesegment(struct splitpool *pool, struct renderjob *job, struct segment *seg)
+{
+    struct analysis *an = pool->an;
+    struct wordindex *wi = an->wi;
+    struct sink *sink = job->sinks;
+    struct outbuf *ob = job->ob[0];
+    struct regionstruct *shown;
+    char path[4096];
+    int res = 0;
+
+    snprintf(path, sizeof(path), "%s/%s.%s", pool->opts->splitdir, seg->name, sink->kind == SINK_LISTING ? "lst" : "asm");
+    if ((sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        errmsg("Error opening file: %s\n", path);
+        return 0;
+    }
+    ob->fd = sink->fd;
+    ob->err = 0;
+    ob->pos = 0;
+
+    /* The disabled regions of the segment in the listing, the labels of the others in the source */
+    if (sink->kind == SINK_LISTING) {
+        if ((shown = windowregions(an->disregs, wi->words[seg->lo]->wordaddress,
+                                   wi->words[seg->hi-1]->wordaddress)) == NULL) {
+            errmsg("Error allocating memory\n");
+            goto out;
+        }
+        if (pool->opts->scores)
+            printregionscores(ob, wi, shown);
+        else
+            printregions(ob, shown);
+        freeregions(shown);
+    } else if (!emitwindowlabels(ob, sink->kind, an, seg->lo, seg->hi, pool->padding))
+        goto out;
+
+    splitwords(an, job, 1, seg->lo, seg->hi, 0);
+    renderwords(job);
+    if (job->err) {
+        errmsg("Error allocating memory\n");
+        goto out;
+    }
+    if (!flushoutbuf(ob)) {
+        errmsg("Error writing file: %s\n", path);
+        goto out;
+    }
+    res = 1;
+
+out:
+    ob->len = 0;
+    if (close(sink->fd) && res) {
+        errmsg("Error writing file: %s\n", path);
+        res = 0;
+    }
+    return res;
+}
+
+/* Takes the segments one by one and writes them, until none is left */
+static void *splitworker(void *arg)
+{
+    struct splitpool *pool = arg;
+    struct sink sink;
+    struct renderjob job;
+    size_t i;
+    int ok = 1;
+
+    memset(&job, 0, sizeof(struct renderjob));
+    sink.kind = pool->opts->listing ? SINK_LISTING : SINK_ASM;
+    sink.filename = NULL;
+    sink.fd = -1;
+    sink.compact = pool->opts->compactdata && sink.kind == SINK_ASM;
+    sink.write = sinkwriters[sink.kind];
+    job.an = pool->an;
+    job.enaregs = pool->enaregs;
+    job.sinks = &sink;
+    job.nsinks = 1;
+    job.padding = pool->padding;
+    job.compact = job.allcompact = sink.compact;
+    job.ob[0] = allocoutbuf(-1);
+    job.scratch = allocoutbuf(-1);
+    job.rc = calloc(1, sizeof(struct rendercache));
+    if (!job.ob[0] || !job.scratch || !job.rc) {
+        errmsg("Error allocating memory\n");
+        ok = 0;
+    }
+
+    while (ok) {
+        pthread_mutex_lock(&pool->lock);
+        i = pool->err ? pool->count : pool->next;
+        if (i < pool->count)
+            pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i == pool->count)
+            break;
+        ok = writesegment(pool, &job, &pool->segs[i]);
+    }
+
+    if (!ok) {
+        pthread_mutex_lock(&pool->lock);
+        pool->err = 1;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if (job.ob[0])
+        freeoutbuf(job.ob[0]);
+    if (job.scratch)
+        freeoutbuf(job.scratch);
+    free(job.rc);
+    free(job.runwords);
+    free(job.runprintable);
+    return NULL;
+}
+
+/*
+ * Writes each function and each data region into a file of its own in the
+ * split directory, on a pool of threads, and an index of the files. The
+ * labels referred to from other files are declared in each file with .equ.
+ */
+static int emitsplit(struct analysis *an, struct regionstruct *enaregs, const struct options *opts)
+{
+    struct splitpool pool;
+    pthread_t *threads = NULL;
+    size_t i, n, started = 0;
+    char path[4096];
+    FILE *fp;
+    int res = 0;
+
+    memset(&pool, 0, sizeof(struct splitpool));
+    pool.an = an;
+    pool.enaregs = enaregs;
+    pool.opts = opts;
+    pool.padding = labelpadding(an->ls);
+
+    if (mkdir(opts->splitdir, 0777) && errno != EEXIST) {
+        errmsg("Error creating directory: %s\n", opts->splitdir);
+        return 0;
+    }
+    if ((pool.segs = findsegments(an, &pool.count)) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+
+    if ((n = jobcount(opts)) > pool.count)
+        n = pool.count ? pool.count : 1;
+    if ((threads = calloc(n, sizeof(pthread_t))) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto out;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+
+    /* The main thread works in the pool too */
+    for (i = 1; i < n; i++, started++)
+        if (pthread_create(&threads[i], NULL, splitworker, &pool))
+            break;
+    splitworker(&pool);
+    for (i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+    if (pool.err)
+        goto out;
+
+    snprintf(path, sizeof(path), "%s/index.txt", opts->splitdir);
+    if ((fp = fopen(path, "w")) == NULL) {
+        errmsg("Error opening file: %s\n", path);
+        goto out;
+    }
+    for (i = 0; i < pool.count; i++)
+        fprintf(fp, "%s.%s 0x%04x:0x%04x %s\n", pool.segs[i].name, opts->listing ? "lst" : "asm",
+                an->wi->words[pool.segs[i].lo]->wordaddress, an->wi->words[pool.segs[i].hi-1]->wordaddress,
+                pool.segs[i].kind);
+    if (fclose(fp)) {
+        errmsg("Error writing file: %s\n", path);
+        goto out;
+    }
+    res = 1;
+
+out:
+    free(threads);
+    free(pool.segs);
+    return res;
+}
+
+/* Buffers of a thread rendering one image after the other, kept between the images */
+struct renderbuffers {
+    struct outbuf *out;         /* Of the primary output */
+    struct outbuf *scratch;
+    struct rendercache *rc;     /* The position independent text stays valid for any image */
+    struct arena *arena;        /* Of the analysis of the image, reset for the next one */
+};
+
+struct renderbuffers *allocrenderbuffers(void)
+{
+    struct renderbuffers *rb = malloc(sizeof(struct renderbuffers));
+
+    if (!rb)
+        return NULL;
+    rb->out = allocoutbuf(-1);
+    rb->scratch = allocoutbuf(-1);
+    rb->rc = calloc(1, sizeof(struct rendercache));
+    rb->arena = allocarena();
+    if (!rb->out || !rb->scratch || !rb->rc || !rb->arena) {
+        freerenderbuffers(rb);
+        return NULL;
+    }
+    return rb;
+}
+
+void freerenderbuffers(struct renderbuffers *rb)
+{
+    if (rb->out)
+        freeoutbuf(rb->out);
+    if (rb->scratch)
+        freeoutbuf(rb->scratch);
+    free(rb->rc);
+    if (rb->arena)
+        freearena(rb->arena);
+    free(rb);
+}
+
+/*
+ * Renders the analyzed image into the sinks, the primary one first. The
+ * sinks are opened here, and closed again, when they name a file. The first
+ * chunk uses the buffers in rb instead of allocating its own, unless NULL.
+ */
+static int render(struct analysis *an, struct regionstruct *enaregs, const struct options *opts, struct sink *sinks, size_t nsinks,
+                  struct renderbuffers *rb)
+{
+    int res = 0;
+    size_t padding, n = 0, i, s, compact = 0, lo, hi;
+    struct regionstruct *shown = NULL;
+    struct outbuf *obs[MAX_SINKS] = { NULL };
+    struct renderjob *jobs = NULL;
+
+    for (s = 0; s < nsinks; s++) {
+        sinks[s].write = sinkwriters[sinks[s].kind];
+        sinks[s].compact = opts->compactdata && (sinks[s].kind == SINK_ASM || sinks[s].kind == SINK_GAS);
+        compact += sinks[s].compact;
+        if (sinks[s].filename && (sinks[s].fd = open(sinks[s].filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+            errmsg("Error opening file: %s\n", sinks[s].filename);
+            goto err_output;
+        }
+        if (rb && !s)
+            resetoutbuf(obs[s] = rb->out, sinks[s].fd);
+        else if ((obs[s] = allocoutbuf(sinks[s].fd)) == NULL) {
+            errmsg("Error allocating memory\n");
+            goto err_output;
+        }
+        obs[s]->flush = sinks[s].flush;
+        obs[s]->arg = sinks[s].arg;
+    }
+
+    /* Only the words of the window are rendered, the analysis covers the whole image */
+    findwindow(an, opts, &lo, &hi);
+
+    /*
+     * As many chunks as jobs, unless the chunks would be too small, binary
+     * records need one string table, and the record callback gets them in order
+     */
+    n = jobcount(opts);
+    if (n > (hi - lo) / MIN_CHUNK_WORDS)
+        n = (hi - lo) / MIN_CHUNK_WORDS;
+    if (n < 1 || sinks[0].kind == SINK_BIN || sinks[0].kind == SINK_RECORDS)
+        n = 1;
+
+    if ((jobs = calloc(n, sizeof(struct renderjob))) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto err_output;
+    }
+
+    /* Same padding as the whole image, so the lines of the window match its lines */
+    padding = labelpadding(an->ls);
+
+    /* A partial analysis says so before its lines, the text sinks in a comment */
+    for (s = 0; an->partial && s < nsinks; s++) {
+        if (sinks[s].kind == SINK_JSONL && an->stoppedat != UINT32_MAX)
+            obfmt(obs[s], "{\"partial\":true,\"stoppedat\":%u}\n", an->stoppedat);
+        else if (sinks[s].kind == SINK_JSONL)
+            obputs(obs[s], "{\"partial\":true,\"stoppedat\":null}\n");
+        else if (sinks[s].kind != SINK_BIN && sinks[s].kind != SINK_RECORDS && an->stoppedat != UINT32_MAX)
+            obfmt(obs[s], "; Partial analysis, the time budget ran out at 0x%04x\n", an->stoppedat);
+        else if (sinks[s].kind != SINK_BIN && sinks[s].kind != SINK_RECORDS)
+            obputs(obs[s], "; Partial analysis, the time budget ran out\n");
+    }
+
+    /* Print disabled regions in the listings, those overlapping the window */
+    for (s = 0; s < nsinks; s++) {
+        if (sinks[s].kind == SINK_LISTING) {
+            if (opts->range && !shown && (shown = windowregions(an->disregs, opts->rangebegin, opts->rangeend)) == NULL) {
+                errmsg("Error allocating memory\n");
+                goto err_output;
+            }
+            if (opts->scores)
+                printregionscores(obs[s], an->wi, shown ? shown : an->disregs);
+            else
+                printregions(obs[s], shown ? shown : an->disregs);
+        }
+        if (opts->range && (sinks[s].kind == SINK_ASM || sinks[s].kind == SINK_GAS) &&
+            !emitwindowlabels(obs[s], sinks[s].kind, an, lo, hi, padding))
+            goto err_output;
+    }
+
+    n = splitwords(an, jobs, n, lo, hi, compact > 0);
+    for (i = 0; i < n; i++) {
+        jobs[i].an = an;
+        jobs[i].enaregs = enaregs;
+        jobs[i].sinks = sinks;
+        jobs[i].nsinks = nsinks;
+        jobs[i].padding = padding;
+        for (s = 0; s < nsinks; s++)
+            if ((jobs[i].ob[s] = i ? allocoutbuf(-1) : obs[s]) == NULL)
+                jobs[i].err = 1;
+        if (rb && !i) {
+            resetoutbuf(jobs[i].scratch = rb->scratch, -1);
+            jobs[i].rc = rb->rc;
+        } else {
+            jobs[i].scratch = allocoutbuf(-1);
+            jobs[i].rc = calloc(1, sizeof(struct rendercache));
+        }
+        jobs[i].indexstep = opts->indexstep;
+        jobs[i].head = !i;
+        jobs[i].compact = compact > 0;
+        jobs[i].allcompact = compact == nsinks;
+        if (sinks[0].kind == SINK_BIN && (jobs[i].st = allocstrtab()) == NULL)
+            jobs[i].err = 1;
+        if (opts->indexfile && (jobs[i].ix = allocindex()) == NULL)
+            jobs[i].err = 1;
+        if (!jobs[i].scratch || !jobs[i].rc || jobs[i].err) {
+            errmsg("Error allocating memory\n");
+            goto err_jobs;
+        }
+    }
+
+    /* The chunks after the first one are rendered in memory by the workers */
+    for (i = 1; i < n; i++)
+        jobs[i].threaded = !pthread_create(&jobs[i].thread, NULL, renderthread, &jobs[i]);
+
+    /* Render the first chunk directly, then write the others in order */
+    if (sinks[0].kind == SINK_BIN)
+        writebinheader(obs[0]);
+    renderwords(&jobs[0]);
+    for (i = 1; i < n; i++) {
+        if (jobs[i].threaded) {
+            pthread_join(jobs[i].thread, NULL);
+            jobs[i].threaded = 0;
+        } else
+            renderwords(&jobs[i]);
+        for (s = 0; s < nsinks; s++) {
+            flushoutbuf(obs[s]);
+            if (!s)
+                jobs[i].base = obs[s]->pos;
+            jobs[i].ob[s]->fd = sinks[s].fd;
+            jobs[i].ob[s]->flush = sinks[s].flush;
+            jobs[i].ob[s]->arg = sinks[s].arg;
+            obs[s]->err |= !flushoutbuf(jobs[i].ob[s]);
+            obs[s]->pos += jobs[i].ob[s]->pos;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        if (jobs[i].err) {
+            errmsg("Error allocating memory\n");
+            goto err_jobs;
+        }
+    if (sinks[0].kind == SINK_BIN)
+        writebinfooter(obs[0], jobs[0].st, jobs[0].records);
+
+    for (s = 0; s < nsinks; s++)
+        if (!flushoutbuf(obs[s])) {
+            errmsg("Error writing output\n");
+            goto err_jobs;
+        }
+
+    /* The offsets of the chunks are known only now */
+    if (opts->indexfile) {
+        for (i = 1; i < n; i++)
+            if (!appendindex(jobs[0].ix, jobs[i].ix, jobs[i].base)) {
+                errmsg("Error allocating memory\n");
+                goto err_jobs;
+            }
+        if (!writeindex(jobs[0].ix, opts->indexstep, opts->indexfile))
+            goto err_jobs;
+    }
+
+    res = 1;    /* Success */
+
+err_jobs:
+    for (i = 0; i < n; i++) {
+        if (jobs[i].threaded)
+            pthread_join(jobs[i].thread, NULL);
+        for (s = 0; i && s < nsinks; s++)
+            if (jobs[i].ob[s])
+                freeoutbuf(jobs[i].ob[s]);
+        if (jobs[i].scratch && !(rb && !i))
+            freeoutbuf(jobs[i].scratch);
+        if (!(rb && !i))
+            free(jobs[i].rc);
+        if (jobs[i].st)
+            freestrtab(jobs[i].st);
+        if (jobs[i].ix)
+            freeindex(jobs[i].ix);
+        free(jobs[i].runwords);
+        free(jobs[i].runprintable);
+    }
+err_output:
+    free(jobs);
+    if (shown)
+        freeregions(shown);
+    for (s = 0; s < nsinks; s++) {
+        if (obs[s] && !(rb && !s))
+            freeoutbuf(obs[s]);
+        if (sinks[s].filename && sinks[s].fd >= 0 && close(sinks[s].fd) && res) {
+            errmsg("Error writing file: %s\n", sinks[s].filename);
+            res = 0;
+        }
+    }
+    return res;
+}
+
+/* Writes the outputs of opts, analyzing into the arena and rendering with the buffers of rb when not NULL */
+int emitavrasm(struct wordlist *wl, struct regionstruct *enaregs, const struct options *opts, struct renderbuffers *rb)
+{
+    int res = 0;
+    size_t nsinks = 0;
+    struct analysis *an;
+    struct sink sinks[MAX_SINKS];
+
+    if (rb)
+        resetarena(rb->arena);
+    if ((an = analyzein(wl, enaregs, opts, rb ? rb->arena : NULL)) == NULL)
+        return 0;
+
+    if (opts->callgraph && !writecallgraph(an->cg, opts->callgraph))
+        goto out;
+    if (opts->loopfile && !writeloops(an->cfg, an->lf, opts->loopfile))
+        goto out;
+
+    if (opts->splitdir) {
+        res = emitsplit(an, enaregs, opts);
+        goto out;
+    }
+
+    /* The primary output, then the others written in the same pass */
+    sinks[nsinks++] = (struct sink) { opts->format == FORMAT_JSONL ? SINK_JSONL :
+                                      opts->format == FORMAT_BIN ? SINK_BIN :
+                                      opts->listing ? SINK_LISTING : SINK_ASM, opts->output, STDOUT_FILENO };
+    if (opts->listingfile)
+        sinks[nsinks++] = (struct sink) { SINK_LISTING, opts->listingfile, -1 };
+    if (opts->gasfile)
+        sinks[nsinks++] = (struct sink) { SINK_GAS, opts->gasfile, -1 };
+
+    res = render(an, enaregs, opts, sinks, nsinks, rb);
+
+out:
+    freeanalysis(an);
+    return res;
+}
+
+/*
+ * Renders the analyzed image in the output kind of opts, passing the text to
+ * flush in big chunks, with the buffers in rb when not NULL
+ */
+int renderanalysis(struct analysis *an, struct regionstruct *enaregs, const struct options *opts,
+                   int (*flush)(void *arg, const char *buf, size_t len), void *arg, struct renderbuffers *rb)
+{
+    struct sink sink = { opts->format == FORMAT_JSONL ? SINK_JSONL :
+                         opts->format == FORMAT_BIN ? SINK_BIN :
+                         opts->listing ? SINK_LISTING : SINK_ASM, NULL, -1 };
+
+    sink.flush = flush;
+    sink.arg = arg;
+    return render(an, enaregs, opts, &sink, 1, rb);
+}
+
+/* Prints the disabled regions of the analyzed image like the listing does */
+void printanalysisregions(struct outbuf *ob, struct analysis *an)
+{
+    printregions(ob, an->disregs);
+}
+
+/* Prints the labels of the analyzed image, a word address and a label per line */
+void printlabels(struct outbuf *ob, struct analysis *an)
+{
+    size_t i;
+
+    for (i = 0; i < an->ls->labelscount; i++)
+        obfmt(ob, "0x%04x %s\n", an->ls->labels[i].wordaddress, an->ls->labels[i].label);
+}
+
+/* Finds the label of the name, returns 1 with its word address when there is one */
+int findlabelname(struct analysis *an, const char *name, uint32_t *wordaddress)
+{
+    size_t i;
+
+    for (i = 0; i < an->ls->labelscount; i++)
+        if (an->ls->labels[i].label && !strcmp(an->ls->labels[i].label, name)) {
+            *wordaddress = an->ls->labels[i].wordaddress;
+            return 1;
+        }
+    return 0;
+}
+
+/*
+ * Finds the words rendered differently in two analyses of the same image,
+ * those turned into code or data, and those labeled or unlabeled. Returns 1
+ * with their address range when there is any.
+ */
+int diffanalysis(struct analysis *a, struct analysis *b, uint32_t *begin, uint32_t *end)
+{
+    struct labelstruct *la = a->ls, *lb = b->ls;
+    size_t i, j;
+    uint32_t wordaddress;
+    int changed = 0;
+
+    for (i = 0; i < a->wi->count && i < b->wi->count; i++) {
+        if (a->code[i] == b->code[i])
+            continue;
+        wordaddress = a->wi->words[i]->wordaddress;
+        if (!changed || wordaddress < *begin)
+            *begin = wordaddress;
+        if (!changed || wordaddress > *end)
+            *end = wordaddress;
+        changed = 1;
+    }
+
+    /* Merge the sorted label addresses, the ones in one of them only are changes */
+    for (i = j = 0; i < la->labelscount || j < lb->labelscount;) {
+        if (j == lb->labelscount || (i < la->labelscount && la->labels[i].wordaddress < lb->labels[j].wordaddress))
+            wordaddress = la->labels[i++].wordaddress;
+        else if (i == la->labelscount || lb->labels[j].wordaddress < la->labels[i].wordaddress)
+            wordaddress = lb->labels[j++].wordaddress;
+        else {
+            i++;
+            j++;
+            continue;
+        }
+        if (!changed || wordaddress < *begin)
+            *begin = wordaddress;
+        if (!changed || wordaddress > *end)
+            *end = wordaddress;
+        changed = 1;
+    }
+
+    return changed;
+}
+
+/* Passes the instructions of the analyzed image to record one by one, in address order */
+int renderrecords(struct analysis *an, struct regionstruct *enaregs, const struct options *opts,
+                  int (*record)(void *arg, const struct instrrecord *ir), void *arg)
+{
+    struct sink sink = { SINK_RECORDS, NULL, -1 };
 
-    return 1;   /* Success */
+    sink.record = record;
+    sink.arg = arg;
+    return render(an, enaregs, opts, &sink, 1, NULL);
 }
@@ -13,20 +13,39 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "avrdis.h"
 
-void freewordlist(struct wordlist *wl)
+/* Where the diagnostics of the calling thread go, NULL for stderr */
+static __thread char *errbuf;
+static __thread size_t errsize;
+
+/*
+ * Reports an error like fprintf(stderr, ...), or keeps the first message in
+ * the buffer when the calling thread captures them, as the library does.
+ */
+void errmsg(const char *fmt, ...)
 {
-    struct wordlist *temp;
+    va_list ap;
 
-    while (wl) {
-        temp = wl;
-        wl = wl->next;
-        free(temp);
-    }
+    va_start(ap, fmt);
+    if (!errbuf)
+        vfprintf(stderr, fmt, ap);
+    else if (!*errbuf)
+        vsnprintf(errbuf, errsize, fmt, ap);
+    va_end(ap);
+}
+
+/* Captures the diagnostics of the calling thread into buf, until called with NULL */
+void captureerrors(char *buf, size_t size)
+{
+    errbuf = buf;
+    errsize = size;
+    if (buf && size)
+        *buf = '\0';
 }
 
 struct regionstruct *allocregions(void)
@@ -38,11 +57,21 @@ struct regionstruct *allocregions(void)
     return rs;
 }
 
+/* Allocates the regions with their nodes taken from the arena, those are released with it */
+struct regionstruct *allocarenaregions(struct arena *a)
+{
+    struct regionstruct *rs = allocregions();
+
+    if (rs)
+        rs->arena = a;
+    return rs;
+}
+
 void freeregions(struct regionstruct *rs)
 {
     struct region *r, *temp;
 
-    for (r = rs->first; r;) {
+    for (r = rs->arena ? NULL : rs->first; r;) {
         temp = r;
         r = r->next;
         free(temp);
@@ -50,9 +79,21 @@ void freeregions(struct regionstruct *rs)
     free(rs);
 }
 
+static struct region *allocregion(struct regionstruct *rs)
+{
+    return rs->arena ? arenaalloc(rs->arena, sizeof(struct region)) : malloc(sizeof(struct region));
+}
+
+/* Releases a node unlinked from the regions, the ones of an arena stay until it is released */
+void dropregion(struct regionstruct *rs, struct region *r)
+{
+    if (!rs->arena)
+        free(r);
+}
+
 int addregion(struct regionstruct *rs, uint32_t begin, uint32_t end)
 {
-    struct region *r = malloc(sizeof(struct region));
+    struct region *r = allocregion(rs);
 
     if (!r)
         return 0;
@@ -68,6 +109,80 @@ int addregion(struct regionstruct *rs, uint32_t begin, uint32_t end)
     return 1;
 }
 
+void droplastregion(struct regionstruct *rs)
+{
+    struct region *r, *prev = NULL;
+
+    if (!rs->last)
+        return;
+    for (r = rs->first; r != rs->last; r = r->next)
+        prev = r;
+    if (prev)
+        prev->next = NULL;
+    else
+        rs->first = NULL;
+    rs->last = prev;
+    dropregion(rs, r);
+}
+
+/* Copies the regions, NULL on error */
+struct regionstruct *copyregions(struct regionstruct *rs)
+{
+    struct regionstruct *copy = allocregions();
+    struct region *r;
+
+    if (!copy)
+        return NULL;
+    for (r = rs->first; r; r = r->next)
+        if (!addregion(copy, r->begin, r->end)) {
+            freeregions(copy);
+            return NULL;
+        }
+    return copy;
+}
+
+/* Removes the words between begin and end from the regions, splitting the ones covering them */
+int removeregion(struct regionstruct *rs, uint32_t begin, uint32_t end)
+{
+    struct region *r, *split, *prev = NULL, *next;
+
+    for (r = rs->first; r; r = next) {
+        next = r->next;
+        if (r->end < begin || end < r->begin) {
+            prev = r;
+            continue;
+        }
+        if (r->begin < begin && end < r->end) {
+            if ((split = allocregion(rs)) == NULL)
+                return 0;
+            split->begin = end + 1;
+            split->end = r->end;
+            split->next = r->next;
+            r->end = begin - 1;
+            r->next = split;
+            if (rs->last == r)
+                rs->last = split;
+            return 1;
+        }
+        if (r->begin < begin)
+            r->end = begin - 1;
+        else if (end < r->end)
+            r->begin = end + 1;
+        else {
+            if (prev)
+                prev->next = next;
+            else
+                rs->first = next;
+            if (rs->last == r)
+                rs->last = prev;
+            dropregion(rs, r);
+            continue;
+        }
+        prev = r;
+    }
+    return 1;
+}
+
 struct region *inregionswithprev(struct regionstruct *rs, uint32_t wordaddress, struct region **prev)
 {
     struct region *r, *pr = NULL;
@@ -88,12 +203,152 @@ struct region *inregions(struct regionstruct *rs, uint32_t wordaddress)
     return inregionswithprev(rs, wordaddress, NULL);
 }
 
-void printregions(struct regionstruct *rs)
+void printregions(struct outbuf *ob, struct regionstruct *rs)
 {
     struct region *r;
 
     for (r = rs->first; r; r = r->next)
-        printf("0x%04x:0x%04x\n", r->begin, r->end);
+        obfmt(ob, "0x%04x:0x%04x\n", r->begin, r->end);
+}
+
+struct wordindex *allocwordindex(struct wordlist *wl)
+{
+    struct wordindex *wi;
+    struct wordlist *w;
+    size_t i;
+
+    if ((wi = malloc(sizeof(struct wordindex))) == NULL)
+        return NULL;
+    memset(wi, 0, sizeof(struct wordindex));
+
+    for (w = wl; w; w = w->next)
+        wi->count++;
+
+    if (wi->count) {
+        wi->words = malloc(wi->count * sizeof(struct wordlist *));
+        if (!wi->words) {
+            free(wi);
+            return NULL;
+        }
+        for (i = 0, w = wl; w; w = w->next)
+            wi->words[i++] = w;
+    }
+    return wi;
+}
+
+void freewordindex(struct wordindex *wi)
+{
+    free(wi->words);
+    free(wi);
+}
+
+/* Returns the index of the first word at or after the address, the count when none */
+size_t wordpos(struct wordindex *wi, uint32_t wordaddress)
+{
+    size_t lo = 0, hi = wi->count, mid;
+
+    /* Binary search for the lower bound */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (wi->words[mid]->wordaddress < wordaddress)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Returns the first word at or after the given word address */
+struct wordlist *wordfrom(struct wordindex *wi, uint32_t wordaddress)
+{
+    size_t i = wordpos(wi, wordaddress);
+
+    return i < wi->count ? wi->words[i] : NULL;
+}
+
+/* Returns the word at the given word address, or NULL when not present */
+struct wordlist *wordat(struct wordindex *wi, uint32_t wordaddress)
+{
+    struct wordlist *w = wordfrom(wi, wordaddress);
+
+    if (w && w->wordaddress == wordaddress)
+        return w;
+    return NULL;
+}
+
+struct annotations *allocannotations(void)
+{
+    struct annotations *as = malloc(sizeof(struct annotations));
+
+    if (as)
+        memset(as, 0, sizeof(struct annotations));
+    return as;
+}
+
+void freeannotations(struct annotations *as)
+{
+    size_t i;
+
+    for (i = 0; i < as->count; i++)
+        free(as->items[i].text);
+    free(as->items);
+    free(as);
+}
+
+int addannotation(struct annotations *as, uint32_t wordaddress, const char *text)
+{
+    struct annotation *newitems;
+    char *t;
+
+    if (as->count >= as->size) {
+        newitems = realloc(as->items, (as->size ? 2 * as->size : 16) * sizeof(struct annotation));
+        if (!newitems)
+            return 0;
+        as->items = newitems;
+        as->size = as->size ? 2 * as->size : 16;
+    }
+
+    if ((t = malloc(strlen(text) + 1)) == NULL)
+        return 0;
+    strcpy(t, text);
+
+    as->items[as->count].wordaddress = wordaddress;
+    as->items[as->count].seq = as->count;
+    as->items[as->count++].text = t;
+    return 1;
+}
+
+static int annotationcmp(const void *lhs, const void *rhs)
+{
+    const struct annotation *l = lhs;
+    const struct annotation *r = rhs;
+
+    if (l->wordaddress != r->wordaddress)
+        return l->wordaddress < r->wordaddress ? -1 : 1;
+    return l->seq < r->seq ? -1 : l->seq > r->seq;
+}
+
+void sortannotations(struct annotations *as)
+{
+    if (as->count)
+        qsort(as->items, as->count, sizeof(struct annotation), annotationcmp);
+}
+
+/* Returns the first annotation of the word address in the sorted annotations, or NULL */
+struct annotation *findannotation(struct annotations *as, uint32_t wordaddress)
+{
+    size_t lo = 0, hi = as->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (as->items[mid].wordaddress < wordaddress)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < as->count && as->items[lo].wordaddress == wordaddress)
+        return &as->items[lo];
+    return NULL;
 }
 
 int strcmpnocase(const char *lhs, const char *rhs)
@@ -112,3 +367,101 @@ int strcmpnocase(const char *lhs, const char *rhs)
         return 1;
     return -1;
 }
+
+const char *fileextension(const char *filename)
+{
+    const char *p = filename;
+
+    while (*p) p++;
+    while (filename < p && *p != '.' && *p != '/' && *p != '\\') p--;
+    if (filename < p && *p == '.' && *(p+1) && *(p+1) != '/' && *(p+1) != '\\')
+        return p+1;
+
+    return NULL;
+}
+
+enum filetype deterfiletype(const char *filename)
+{
+    int checks;
+    const char *ext = fileextension(filename);
+
+    /* When file has an extension, determine file type by the extension */
+    if (ext) {
+        if (!strcmpnocase(ext, "hex"))
+            return FILETYPE_IHEX;
+        /* TODO: More extension types goes here below... */
+
+    }
+
+    /* Otherwise, try to infer type by its contents */
+    if ((checks = ihexfile(filename)) == -1)
+        return FILETYPE_ERROR;
+    if (checks)
+        return FILETYPE_IHEX;
+    /* TODO: More file type-checks goes here below... */
+
+    return FILETYPE_UNKNOWN;
+}
+
+/* Parses the file of any known type into the word list */
+int parsefile(const char *filename, struct arena *a, struct wordlist **wl)
+{
+    switch (deterfiletype(filename)) {
+        case FILETYPE_ERROR:
+            return 0;
+        case FILETYPE_UNKNOWN:
+            errmsg("Unknown file type %s\n", filename);
+            return 0;
+
+        case FILETYPE_IHEX:
+            return parseihexfile(filename, a, wl);
+
+        /* TODO: Other file types goes here... */
+    }
+    return 0;
+}
+
+/*
+ * Reads the regions to enable from the file, a hex word address range like
+ * the ones of -e per line. Empty lines and the ones starting with # are
+ * skipped.
+ */
+int parseregionsfile(const char *filename, struct regionstruct *rs)
+{
+    char line[256], *p;
+    uint32_t begin, end;
+    size_t n = 0;
+    FILE *fp;
+    int res = 0;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        errmsg("Failed to open file %s\n", filename);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        n++;
+        for (p = line; isspace((unsigned char) *p); p++);
+        if (!*p || *p == '#')
+            continue;
+        if (sscanf(p, "%x:%x", &begin, &end) != 2) {
+            errmsg("%s:%zu : Failed to parse a hex memory address range.\n", filename, n);
+            goto out;
+        }
+        if (begin > end) {
+            errmsg("%s:%zu : Starting address must be smaller or equal than end address.\n", filename, n);
+            goto out;
+        }
+        if (!addregion(rs, begin, end)) {
+            errmsg("Error allocating memory\n");
+            goto out;
+        }
+    }
+    res = !ferror(fp);
+    if (!res)
+        errmsg("Failed to read file %s\n", filename);
+
+out:
+    fclose(fp);
+    return res;
+}
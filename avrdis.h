@@ -15,8 +15,11 @@
 #ifndef _AVRDIS_H_
 #define _AVRDIS_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+struct arena;       /* Opaque, hands out the small blocks of a run, released in one step */
+
 struct wordlist {
     struct wordlist *next;
     uint32_t wordaddress;
@@ -32,22 +35,463 @@ struct region {
 struct regionstruct {
     struct region *first;
     struct region *last;
+    struct arena *arena;    /* Of the nodes, NULL when allocated one by one */
+};
+
+struct wordindex {
+    struct wordlist **words;    /* Words sorted by word address */
+    size_t count;
+};
+
+enum flowkind {
+    FLOW_NONE,      /* Continues with the next instruction */
+    FLOW_SKIP,      /* Conditionally skips the next instruction */
+    FLOW_BRANCH,    /* Conditional relative branch */
+    FLOW_JUMP,      /* Unconditional jump */
+    FLOW_CALL,      /* Subroutine call */
+    FLOW_RET,       /* Return from subroutine or interrupt */
+    FLOW_IJUMP,     /* Indirect jump, target unknown */
+    FLOW_ICALL      /* Indirect call, target unknown */
+};
+
+/* Register and SREG flag masks, registers in bits 0..31, flags in bits 32..39 */
+#define REG(n) ((uint64_t) 1 << (n))
+#define REGPAIR(n) (REG(n) | REG((n)+1))
+#define ALL_REGS 0x00000000ffffffffULL
+#define FLAG_C ((uint64_t) 1 << 32)
+#define FLAG_Z ((uint64_t) 1 << 33)
+#define FLAG_N ((uint64_t) 1 << 34)
+#define FLAG_V ((uint64_t) 1 << 35)
+#define FLAG_S ((uint64_t) 1 << 36)
+#define FLAG_H ((uint64_t) 1 << 37)
+#define FLAG_T ((uint64_t) 1 << 38)
+#define FLAG_I ((uint64_t) 1 << 39)
+#define ALL_FLAGS 0x000000ff00000000ULL
+
+struct instrinfo {
+    uint32_t wordaddress;
+    uint32_t target;    /* Only for FLOW_BRANCH, FLOW_JUMP and FLOW_CALL */
+    uint64_t def;       /* Registers and flags written */
+    uint64_t use;       /* Registers and flags read */
+    uint16_t word;
+    uint8_t size;       /* Instruction size in words */
+    uint8_t flow;       /* One of enum flowkind */
+};
+
+#define CFG_NONE ((size_t) -1)
+
+struct basicblock {
+    uint32_t begin;     /* Word address of the first instruction */
+    uint32_t end;       /* Word address of the last word */
+    size_t first;       /* Index of the first instruction */
+    size_t count;       /* Number of instructions */
+    size_t func;        /* Index of the owning function, CFG_NONE when none */
+};
+
+struct cfg {
+    struct instrinfo *instrs;   /* Decoded code instructions in address order */
+    size_t instrcount;
+    size_t *blockof;            /* Basic block index of each instruction */
+    struct basicblock *blocks;
+    size_t blockcount;
+    size_t *succoff;            /* Successors of block b: succ[succoff[b]] .. succ[succoff[b+1]-1] */
+    size_t *succ;
+    size_t *predoff;            /* Predecessors of block b: pred[predoff[b]] .. pred[predoff[b+1]-1] */
+    size_t *pred;
+};
+
+struct dfproblem {
+    int backward;       /* Flows from the successors instead of the predecessors */
+    int intersect;      /* Meet is intersection instead of union */
+    size_t nwords;      /* Width of the lattice values in 64-bit words */
+    size_t count;       /* Number of the blocks taking part */
+    size_t *blocks;     /* Blocks taking part, by local index */
+    size_t *local;      /* Local index of each block, CFG_NONE when not taking part */
+    size_t entry;       /* Local index of the entry block, CFG_NONE when none */
+    uint64_t *boundary; /* Value flowing in at the entry and at the blocks without neighbours */
+    uint64_t *exits;    /* Value flowing in at each local block without neighbours instead, NULL when none */
+    uint64_t *gen;      /* Transfer function of local block l: gen | (x & ~kill) */
+    uint64_t *kill;
+    uint64_t *in;       /* Values at the entry and the exit of the local blocks */
+    uint64_t *out;
+};
+
+struct regdef {
+    size_t instr;       /* Defining instruction, CFG_NONE when defined at the entry */
+    int reg;
+};
+
+struct reachingdefs {
+    struct dfproblem *p;
+    struct regdef *defs;    /* Definitions, the entry definitions of r0..r31 first */
+    size_t defcount;
+    size_t *firstdef;       /* First definition in each local block */
+    uint64_t *regdefs;      /* Bit set of the definitions of each register */
+};
+
+struct annotation {
+    uint32_t wordaddress;
+    size_t seq;         /* Keeps the order of the annotations of the same address */
+    char *text;
+};
+
+struct annotations {
+    struct annotation *items;
+    size_t count;
+    size_t size;
+};
+
+/* A text of the session attached to a word address */
+struct sessiontext {
+    uint32_t wordaddress;
+    const char *text;
+    int owned;          /* Allocated, otherwise in the mapped session file */
+};
+
+struct sessiontexts {
+    struct sessiontext *items;  /* Sorted by word address */
+    size_t count;
+    size_t size;
+};
+
+/* A walk of the label collection, of the whole image or of a disabled region cut at a label found */
+struct walkframe {
+    uint32_t next;                  /* Word address of the next word to walk, past end when finished */
+    uint32_t prev;                  /* Of the first word of the last instruction walked */
+    uint32_t begin;                 /* Of the region not reached by the code, when skip is set */
+    uint32_t end;                   /* Of the words walked */
+    int skip;
+};
+
+/* The walk of the label collection stopped by the time budget, resumed by the next analysis */
+struct walkstate {
+    struct walkframe image;         /* The walk of the whole image */
+    struct walkframe *frames;       /* The walks of the cut regions stopped within it, innermost first */
+    size_t framescount;
+    uint64_t digest;                /* Of the image, the enabled regions and the entry points walked */
+    uint32_t *labels;               /* Collected so far */
+    size_t labelscount;
+    struct regionstruct *disregs;   /* Collected so far */
+};
+
+/* The state of the exploration of an image, kept in a session file */
+struct session {
+    uint64_t imagehash;             /* Of the words of the image */
+    struct regionstruct *enaregs;   /* Enabled regions */
+    struct regionstruct *dataregs;  /* Regions confirmed to be data */
+    uint32_t *entries;              /* Entry points collected like call targets, sorted */
+    size_t entriescount;
+    size_t entriessize;
+    struct sessiontexts labels;     /* Names given to the labels */
+    struct sessiontexts comments;
+    struct walkstate *walk;         /* Stopped by the time budget, NULL when none */
+    void *map;                      /* The mapped session file the texts point into, NULL when none */
+    size_t mapsize;
+};
+
+/* A symbol of an earlier build, from avr-nm output or a linker map file */
+struct symbol {
+    uint32_t wordaddress;
+    const char *name;   /* NULL for a free slot */
+    int code;           /* Of a function, collected like a call target */
+};
+
+struct symbols {
+    struct symbol *slots;           /* Hashed by word address, open addressing */
+    size_t size;                    /* Power of two */
+    size_t count;
+    uint32_t *entries;              /* Word addresses of the code symbols, sorted */
+    size_t entriescount;
+    struct regionstruct *dataregs;  /* Of the data symbols of known size */
+    struct arena *arena;            /* Of the names */
+};
+
+#define FUNCTION_LABEL_FMT "F_%04x"
+
+struct function {
+    uint32_t entry;     /* Word address of the entry point */
+    size_t block;       /* Index of the entry basic block */
+    size_t words;       /* Size of the owned basic blocks in words */
+    int shared;         /* Reaches basic blocks owned by an other function */
 };
 
-void freewordlist(struct wordlist *wl);
+struct callgraph {
+    struct function *funcs;     /* Functions in entry address order */
+    size_t funccount;
+    size_t *calleeoff;          /* Callees of function f: callee[calleeoff[f]] .. callee[calleeoff[f+1]-1] */
+    size_t *callee;
+    uint8_t *tailcall;          /* Set when the edge is a tail call only */
+};
+
+struct loop {
+    size_t header;      /* Header basic block */
+    size_t latch;       /* Source block of the back edge, CFG_NONE when more */
+    size_t parent;      /* Index of the enclosing loop, CFG_NONE when outermost */
+    size_t depth;       /* Nesting depth, 1 for the outermost loops */
+    size_t *blocks;     /* Body blocks in address order, header included */
+    size_t blockcount;
+    long tripcount;     /* Estimated iterations, -1 when unknown */
+    int polling;        /* Busy waits on an I/O bit */
+};
+
+struct loopforest {
+    size_t *idom;       /* Immediate dominator of each block, CFG_NONE for the roots */
+    struct loop *loops; /* Loops in header address order */
+    size_t loopcount;
+};
+
+struct outbuf {
+    int fd;             /* File descriptor written when flushing, negative to grow instead */
+    int err;            /* Set when a write has failed */
+    char *buf;
+    size_t len;
+    size_t size;
+    uint64_t pos;       /* Bytes written out before the buffered ones */
+    int (*flush)(void *arg, const char *buf, size_t len);  /* Called instead of writing fd, NULL when off */
+    void *arg;
+};
+
+enum outformat {
+    FORMAT_ASM,         /* Assembly source or listing */
+    FORMAT_JSONL,       /* JSON object per instruction per line */
+    FORMAT_BIN          /* Fixed size binary records and a string table */
+};
+
+enum regionstate {
+    REGION_CODE,        /* Code found by the label collection */
+    REGION_ENABLED,     /* Enabled by an -e region */
+    REGION_DATA         /* In a disabled region */
+};
+
+struct instrrecord {
+    uint32_t wordaddress;
+    uint32_t target;    /* Only when hastarget is set */
+    uint16_t words[2];
+    uint8_t size;       /* Instruction size in words */
+    uint8_t region;     /* One of enum regionstate */
+    uint8_t flow;       /* One of enum flowkind */
+    int hastarget;
+    const char *text;   /* Rendered mnemonic and operands, not terminated */
+    size_t textlen;
+    const char *label;  /* NULL when none */
+};
+
+#define STRTAB_NONE 0xffffffffu
+
+struct strtab {
+    char *buf;          /* Zero terminated strings, the empty one first */
+    size_t len;
+    size_t size;
+    uint32_t *slots;    /* Open addressing hash of the string offsets */
+    size_t slotcount;
+    size_t used;
+};
+
+struct indexentry {
+    uint32_t wordaddress;
+    const char *label;      /* Label defined on the line, NULL when none */
+    uint64_t offset;        /* Byte offset of the line in the output */
+};
+
+struct outindex {
+    struct indexentry *entries;
+    size_t count;
+    size_t size;
+};
+
+#define BIN_HEADER_MAGIC "AVRDISB\0"
+#define BIN_FOOTER_MAGIC "AVRDISE\0"
+#define BIN_VERSION 1
+#define BIN_HEADER_SIZE 16
+#define BIN_RECORD_SIZE 32
+
+enum filetype {
+    FILETYPE_ERROR = -1,
+    FILETYPE_UNKNOWN,
+    FILETYPE_IHEX
+};
+
+struct options {
+    const char *output;     /* Output file, NULL for stdout */
+    int listing;            /* Listing mode */
+    const char *listingfile; /* File to write a listing to besides the output, NULL when off */
+    const char *gasfile;    /* File to write GNU as source to besides the output, NULL when off */
+    int jobs;               /* Rendering threads, 0 for one per processor */
+    int format;             /* One of enum outformat */
+    int scores;             /* Print code-probability scores of disabled regions */
+    int enablethreshold;    /* Auto-enable disabled regions scoring at least this, -1 when off */
+    int functions;          /* Name function entry points with function labels */
+    const char *callgraph;  /* File to export the call graph to, NULL when off */
+    int deadstores;         /* Annotate the instructions writing registers never read */
+    int autoenable;         /* Enable the likely code regions iteratively up to a fixpoint */
+    int loops;              /* Annotate the loop headers */
+    const char *loopfile;   /* File to export the loops to, NULL when off */
+    int range;              /* Render the words between rangebegin and rangeend only */
+    uint32_t rangebegin;
+    uint32_t rangeend;
+    const char *indexfile;  /* File to write the index of the output to, NULL when off */
+    unsigned int indexstep; /* Word addresses between the sampled index entries */
+    int compactdata;        /* Write the data words as strings, fills and rows in the sources */
+    const char *splitdir;   /* Directory to write each function and data region to a file of, NULL when off */
+    int batch;              /* Disassemble each of many files into a file of its own */
+    const char *socket;     /* Unix domain socket to serve the requests on, NULL when off */
+    int interactive;        /* Read commands exploring the image from stdin */
+    const char *regionsfile; /* File of the regions to enable, NULL when none */
+    int watch;              /* Write the outputs again whenever the input or the regions file changes */
+    const char *sessionfile; /* File of the session, NULL when none */
+    const struct session *session; /* Loaded from the session file, NULL when none */
+    int timebudget;         /* Milliseconds the analysis may take, -1 when unlimited */
+    struct session *resume; /* Takes the walk stopped by the time budget, NULL when not kept */
+    const char *symbolsfile; /* File of the symbols of an earlier build, NULL when none */
+    const struct symbols *symbols; /* Loaded from the symbols file, NULL when none */
+};
+
+void errmsg(const char *fmt, ...);
+void captureerrors(char *buf, size_t size);
+
+struct arena *allocarena(void);
+void freearena(struct arena *a);
+void resetarena(struct arena *a);
+void *arenaalloc(struct arena *a, size_t size);
+char *arenastrdup(struct arena *a, const char *s);
 
 struct regionstruct *allocregions(void);
+struct regionstruct *allocarenaregions(struct arena *a);
 void freeregions(struct regionstruct *rs);
 int addregion(struct regionstruct *rs, uint32_t begin, uint32_t end);
+void droplastregion(struct regionstruct *rs);
+void dropregion(struct regionstruct *rs, struct region *r);
+struct regionstruct *copyregions(struct regionstruct *rs);
+int removeregion(struct regionstruct *rs, uint32_t begin, uint32_t end);
 struct region *inregionswithprev(struct regionstruct *rs, uint32_t wordaddress, struct region **prev);
 struct region *inregions(struct regionstruct *rs, uint32_t wordaddress);
-void printregions(struct regionstruct *rs);
+void printregions(struct outbuf *ob, struct regionstruct *rs);
+
+struct wordindex *allocwordindex(struct wordlist *wl);
+void freewordindex(struct wordindex *wi);
+size_t wordpos(struct wordindex *wi, uint32_t wordaddress);
+struct wordlist *wordfrom(struct wordindex *wi, uint32_t wordaddress);
+struct wordlist *wordat(struct wordindex *wi, uint32_t wordaddress);
+
+struct annotations *allocannotations(void);
+void freeannotations(struct annotations *as);
+int addannotation(struct annotations *as, uint32_t wordaddress, const char *text);
+void sortannotations(struct annotations *as);
+struct annotation *findannotation(struct annotations *as, uint32_t wordaddress);
+
+struct outbuf *allocoutbuf(int fd);
+void freeoutbuf(struct outbuf *ob);
+void resetoutbuf(struct outbuf *ob, int fd);
+void shrinkoutbuf(struct outbuf *ob);
+int flushoutbuf(struct outbuf *ob);
+size_t obreserve(struct outbuf *ob, size_t n);
+void obwrite(struct outbuf *ob, const char *s, size_t n);
+void obputs(struct outbuf *ob, const char *s);
+void obputc(struct outbuf *ob, char c);
+void obpad(struct outbuf *ob, size_t n);
+void obhex(struct outbuf *ob, unsigned int v, int width);
+void obfmt(struct outbuf *ob, const char *fmt, ...);
+
+void writejsonrecord(struct outbuf *ob, const struct instrrecord *ir);
+struct strtab *allocstrtab(void);
+void freestrtab(struct strtab *st);
+uint32_t addstring(struct strtab *st, const char *s, size_t n);
+void writebinheader(struct outbuf *ob);
+int writebinrecord(struct outbuf *ob, struct strtab *st, const struct instrrecord *ir);
+void writebinfooter(struct outbuf *ob, struct strtab *st, uint64_t records);
+
+struct outindex *allocindex(void);
+void freeindex(struct outindex *ix);
+int addindexentry(struct outindex *ix, uint32_t wordaddress, const char *label, uint64_t offset);
+int appendindex(struct outindex *dst, struct outindex *src, uint64_t base);
+int writeindex(struct outindex *ix, unsigned int step, const char *filename);
 
 int strcmpnocase(const char *lhs, const char *rhs);
+const char *fileextension(const char *filename);
+enum filetype deterfiletype(const char *filename);
+int parsefile(const char *filename, struct arena *a, struct wordlist **wl);
+int parseregionsfile(const char *filename, struct regionstruct *rs);
 
 int ihexfile(const char *filename);
-int parseihexfile(const char *filename, struct wordlist **wl);
+int parseihexfile(const char *filename, struct arena *a, struct wordlist **wl);
+int parseihexbuffer(const char *buf, size_t len, const char *name, struct arena *a, struct wordlist **wl);
+
+int decodeinstr(struct wordlist *wl, struct instrinfo *ii);
+int collectregions(struct wordlist *wl, struct regionstruct *enaregs, struct regionstruct *disregs);
+struct analysis;    /* Opaque, the results of the analyses the rendering needs */
+
+struct renderbuffers;   /* Opaque, kept by a thread rendering many images */
+
+size_t jobcount(const struct options *opts);
+struct renderbuffers *allocrenderbuffers(void);
+void freerenderbuffers(struct renderbuffers *rb);
+int emitavrasm(struct wordlist *wl, struct regionstruct *enaregs, const struct options *opts, struct renderbuffers *rb);
+struct analysis *allocanalysis(struct wordlist *wl, struct regionstruct *enaregs, const struct options *opts);
+void freeanalysis(struct analysis *an);
+int renderanalysis(struct analysis *an, struct regionstruct *enaregs, const struct options *opts,
+                   int (*flush)(void *arg, const char *buf, size_t len), void *arg, struct renderbuffers *rb);
+int renderrecords(struct analysis *an, struct regionstruct *enaregs, const struct options *opts,
+                  int (*record)(void *arg, const struct instrrecord *ir), void *arg);
+void printanalysisregions(struct outbuf *ob, struct analysis *an);
+void printlabels(struct outbuf *ob, struct analysis *an);
+int findlabelname(struct analysis *an, const char *name, uint32_t *wordaddress);
+int diffanalysis(struct analysis *a, struct analysis *b, uint32_t *begin, uint32_t *end);
+
+struct cfg *alloccfg(void);
+void freecfg(struct cfg *g);
+int buildcfg(struct wordlist *wl, struct regionstruct *enaregs, struct regionstruct *disregs, struct cfg *g);
+size_t findinstr(struct cfg *g, uint32_t wordaddress);
+size_t findblock(struct cfg *g, uint32_t wordaddress);
+
+struct dfproblem *allocdataflow(struct cfg *g, const size_t *blocks, size_t count, size_t nwords);
+void freedataflow(struct dfproblem *p);
+int solvedataflow(struct cfg *g, struct dfproblem *p);
+struct dfproblem *liveness(struct cfg *g);
+uint64_t liveafter(struct cfg *g, struct dfproblem *live, size_t instr);
+struct reachingdefs *reachingdefs(struct cfg *g, const size_t *blocks, size_t count, size_t entry);
+void freereachingdefs(struct reachingdefs *rd);
+size_t reachingdefsof(struct cfg *g, struct reachingdefs *rd, size_t instr, int reg, struct regdef *defs, size_t max);
+int annotatedeadstores(struct cfg *g, struct annotations *as);
+
+struct loopforest *allocloops(void);
+void freeloops(struct loopforest *lf);
+int findloops(struct cfg *g, struct callgraph *cg, struct loopforest *lf);
+int dominates(struct loopforest *lf, size_t a, size_t b);
+int inloop(struct loop *lp, size_t block);
+int annotateloops(struct cfg *g, struct loopforest *lf, struct annotations *as);
+int writeloops(struct cfg *g, struct loopforest *lf, const char *filename);
+
+struct callgraph *alloccallgraph(void);
+void freecallgraph(struct callgraph *cg);
+int findfunctions(struct cfg *g, struct callgraph *cg);
+size_t findfunction(struct callgraph *cg, uint32_t entry);
+int writecallgraph(struct callgraph *cg, const char *filename);
+
+int regionscore(struct wordindex *wi, uint32_t begin, uint32_t end);
+void printregionscores(struct outbuf *ob, struct wordindex *wi, struct regionstruct *rs);
+int enablescoredregions(struct wordindex *wi, struct regionstruct *disregs, struct regionstruct *enaregs, int threshold);
+
+int runbatch(char **filenames, size_t count, struct regionstruct *enaregs, const struct options *opts);
+int runserver(const char *path, struct regionstruct *enaregs, const struct options *opts);
+int runrepl(struct wordlist *wl, struct regionstruct *enaregs, struct session *session, const struct options *opts);
+int runwatch(const char *filename, struct regionstruct *enaregs, const struct options *opts);
+
+uint64_t wordlisthash(struct wordlist *wl);
+uint64_t walkdigest(const struct session *s, struct regionstruct *enaregs, const uint32_t *entries, size_t entriescount);
+struct session *allocsession(void);
+void freesession(struct session *s);
+void freewalk(struct walkstate *ws);
+int loadsession(const char *filename, struct session *s);
+int storesession(const char *filename, struct session *s);
+struct session *opensession(const char *filename, struct wordlist *wl, int create);
+int settext(struct sessiontexts *t, uint32_t wordaddress, const char *text);
+const char *findtext(const struct sessiontexts *t, uint32_t wordaddress);
+int addentry(struct session *s, uint32_t wordaddress);
+
+struct symbols *loadsymbols(const char *filename);
+void freesymbols(struct symbols *st);
+const char *findsymbol(const struct symbols *st, uint32_t wordaddress);
 
-int emitavrasm(struct wordlist *wl, struct regionstruct *enaregs, int listing);
+int autoenableregions(struct wordlist *wl, struct wordindex *wi, struct regionstruct *enaregs);
 
 #endif /* _AVRDIS_H_ */
@@ -0,0 +1,206 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Batch module for the avrdis project, disassembles many images in one
+ *     process on a pool of threads, each image into a file of its own next
+ *     to the input, and prints the status of every file at the end.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "avrdis.h"
+
+#define BATCH_MESSAGE_SIZE 256
+#define DEFAULT_BATCH_FILES 256
+
+struct batchfile {
+    char *input;
+    char *output;
+    int ok;
+    char message[BATCH_MESSAGE_SIZE];   /* The first diagnostic when failed */
+};
+
+/* Files shared by the threads processing them */
+struct batchpool {
+    struct batchfile *files;
+    size_t count;
+    size_t next;            /* Next file to process */
+    pthread_mutex_t lock;
+    struct regionstruct *enaregs;
+    const struct options *opts;
+};
+
+/* The output of the input file, its extension replaced by the one of the format */
+static char *outputname(const char *input, const struct options *opts)
+{
+    const char *ext = fileextension(input);
+    const char *outext = opts->format == FORMAT_JSONL ? "jsonl" : opts->format == FORMAT_BIN ? "bin" :
+                         opts->listing ? "lst" : "asm";
+    size_t len = ext ? (size_t) (ext - input) - 1 : strlen(input);
+    char *output = malloc(len + strlen(outext) + 2);
+
+    if (output)
+        sprintf(output, "%.*s.%s", (int) len, input, outext);
+    return output;
+}
+
+static int processfile(struct batchpool *pool, struct batchfile *f, struct arena *a, struct renderbuffers *rb)
+{
+    struct wordlist *wl = NULL;
+    struct regionstruct *enaregs;
+    struct options opts = *pool->opts;
+    int res = 0;
+
+    /* One thread per image, the images are processed in parallel instead */
+    opts.output = f->output;
+    opts.jobs = 1;
+
+    /* The -e regions are copied for each image, as the analysis may enable more */
+    if ((enaregs = copyregions(pool->enaregs)) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+    if (parsefile(f->input, a, &wl))
+        res = emitavrasm(wl, enaregs, &opts, rb);
+
+    resetarena(a);
+    freeregions(enaregs);
+    return res;
+}
+
+/* Takes the files one by one until none is left, keeping the arena of the words and the render buffers between them */
+static void *batchworker(void *arg)
+{
+    struct batchpool *pool = arg;
+    struct arena *a = allocarena();
+    struct renderbuffers *rb = allocrenderbuffers();
+    struct batchfile *f;
+    size_t i;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        i = pool->next < pool->count ? pool->next++ : pool->count;
+        pthread_mutex_unlock(&pool->lock);
+        if (i == pool->count)
+            break;
+
+        f = &pool->files[i];
+        captureerrors(f->message, sizeof(f->message));
+        if (!a || !rb)
+            errmsg("Error allocating memory\n");
+        else
+            f->ok = processfile(pool, f, a, rb);
+        captureerrors(NULL, 0);
+    }
+
+    if (rb)
+        freerenderbuffers(rb);
+    if (a)
+        freearena(a);
+    return NULL;
+}
+
+/* Reads the names of the files from the lines of the manifest, skipping the empty ones */
+static int readmanifest(FILE *fp, struct batchpool *pool)
+{
+    char line[4096];
+    size_t len, size = 0;
+    struct batchfile *files;
+
+    while (fgets(line, sizeof(line), fp)) {
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (!len)
+            continue;
+        if (pool->count == size) {
+            size = size ? 2 * size : DEFAULT_BATCH_FILES;
+            if ((files = realloc(pool->files, size * sizeof(struct batchfile))) == NULL)
+                return 0;
+            pool->files = files;
+        }
+        memset(&pool->files[pool->count], 0, sizeof(struct batchfile));
+        if ((pool->files[pool->count++].input = strdup(line)) == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Disassembles the files given, or those listed on the standard input when
+ * none, with the same options. Prints the status of each file to stdout,
+ * returns 0 when any of them has failed.
+ */
+int runbatch(char **filenames, size_t count, struct regionstruct *enaregs, const struct options *opts)
+{
+    struct batchpool pool;
+    pthread_t *threads = NULL;
+    size_t i, n, started = 0, failed = 0;
+    int res = 0;
+
+    memset(&pool, 0, sizeof(struct batchpool));
+    pool.enaregs = enaregs;
+    pool.opts = opts;
+
+    if (count) {
+        if ((pool.files = calloc(count, sizeof(struct batchfile))) == NULL)
+            goto err_alloc;
+        for (pool.count = 0; pool.count < count; pool.count++)
+            if ((pool.files[pool.count].input = strdup(filenames[pool.count])) == NULL)
+                goto err_alloc;
+    } else if (!readmanifest(stdin, &pool))
+        goto err_alloc;
+
+    for (i = 0; i < pool.count; i++)
+        if ((pool.files[i].output = outputname(pool.files[i].input, opts)) == NULL)
+            goto err_alloc;
+
+    if ((n = jobcount(opts)) > pool.count)
+        n = pool.count ? pool.count : 1;
+    if ((threads = calloc(n, sizeof(pthread_t))) == NULL)
+        goto err_alloc;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    /* The main thread works in the pool too */
+    for (i = 1; i < n; i++, started++)
+        if (pthread_create(&threads[i], NULL, batchworker, &pool))
+            break;
+    batchworker(&pool);
+    for (i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+
+    for (i = 0; i < pool.count; i++) {
+        if (pool.files[i].ok)
+            printf("ok     %s -> %s\n", pool.files[i].input, pool.files[i].output);
+        else {
+            printf("failed %s: %s", pool.files[i].input, pool.files[i].message);
+            if (!*pool.files[i].message || pool.files[i].message[strlen(pool.files[i].message)-1] != '\n')
+                printf("\n");
+            failed++;
+        }
+    }
+    printf("%zu files, %zu failed\n", pool.count, failed);
+    res = !failed;
+    goto out;
+
+err_alloc:
+    errmsg("Error allocating memory\n");
+out:
+    free(threads);
+    for (i = 0; i < pool.count; i++) {
+        free(pool.files[i].input);
+        free(pool.files[i].output);
+    }
+    free(pool.files);
+    return res;
+}
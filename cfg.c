@@ -0,0 +1,226 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Control flow graph module for the avrdis project, decodes the code
+ *     words of the image into an instruction array and splits it into basic
+ *     blocks connected by their intra-procedural successor edges.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "avrdis.h"
+
+struct cfg *alloccfg(void)
+{
+    struct cfg *g = malloc(sizeof(struct cfg));
+
+    if (g)
+        memset(g, 0, sizeof(struct cfg));
+    return g;
+}
+
+void freecfg(struct cfg *g)
+{
+    free(g->instrs);
+    free(g->blockof);
+    free(g->blocks);
+    free(g->succoff);
+    free(g->succ);
+    free(g->predoff);
+    free(g->pred);
+    free(g);
+}
+
+/* Returns the index of the instruction starting at the word address, or CFG_NONE */
+size_t findinstr(struct cfg *g, uint32_t wordaddress)
+{
+    size_t lo = 0, hi = g->instrcount, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (g->instrs[mid].wordaddress < wordaddress)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < g->instrcount && g->instrs[lo].wordaddress == wordaddress)
+        return lo;
+    return CFG_NONE;
+}
+
+/* Returns the index of the basic block starting at the word address, or CFG_NONE */
+size_t findblock(struct cfg *g, uint32_t wordaddress)
+{
+    size_t i = findinstr(g, wordaddress);
+
+    if (i == CFG_NONE || g->blocks[g->blockof[i]].first != i)
+        return CFG_NONE;
+    return g->blockof[i];
+}
+
+/* Tells if the instruction i+1 follows the instruction i without a gap */
+static int contiguous(struct cfg *g, size_t i)
+{
+    return i+1 < g->instrcount &&
+           g->instrs[i].wordaddress + g->instrs[i].size == g->instrs[i+1].wordaddress;
+}
+
+static int hastarget(struct instrinfo *ii)
+{
+    return ii->flow == FLOW_BRANCH || ii->flow == FLOW_JUMP || ii->flow == FLOW_CALL;
+}
+
+static size_t blocksuccessors(struct cfg *g, size_t b, size_t *succ)
+{
+    struct basicblock *bb = &g->blocks[b];
+    size_t last = bb->first + bb->count - 1, n = 0, t;
+    struct instrinfo *ii = &g->instrs[last];
+
+    /* Target of the branch or jump */
+    if (ii->flow == FLOW_BRANCH || ii->flow == FLOW_JUMP)
+        if ((t = findinstr(g, ii->target)) != CFG_NONE)
+            succ[n++] = g->blockof[t];
+
+    /* Fall through */
+    if (ii->flow != FLOW_JUMP && ii->flow != FLOW_RET && ii->flow != FLOW_IJUMP &&
+        contiguous(g, last)) {
+        if (!n || succ[0] != g->blockof[last+1])
+            succ[n++] = g->blockof[last+1];
+
+        /* Skipping the next instruction */
+        if (ii->flow == FLOW_SKIP && contiguous(g, last+1))
+            succ[n++] = g->blockof[last+2];
+    }
+
+    return n;
+}
+
+static int buildedges(struct cfg *g)
+{
+    size_t b, i, n, total = 0, succ[2], *pos;
+
+    g->succoff = calloc(g->blockcount + 1, sizeof(size_t));
+    g->predoff = calloc(g->blockcount + 1, sizeof(size_t));
+    g->succ = malloc((2 * g->blockcount + 1) * sizeof(size_t));
+    g->pred = malloc((2 * g->blockcount + 1) * sizeof(size_t));
+    if (!g->succoff || !g->predoff || !g->succ || !g->pred)
+        return 0;
+
+    /* Successors in compressed rows, counting the predecessors on the way */
+    for (b = 0; b < g->blockcount; b++) {
+        g->succoff[b] = total;
+        n = blocksuccessors(g, b, succ);
+        for (i = 0; i < n; i++) {
+            g->succ[total++] = succ[i];
+            g->predoff[succ[i]+1]++;
+        }
+    }
+    g->succoff[g->blockcount] = total;
+
+    /* Predecessors in compressed rows */
+    for (b = 0; b < g->blockcount; b++)
+        g->predoff[b+1] += g->predoff[b];
+    if ((pos = malloc(g->blockcount * sizeof(size_t))) == NULL)
+        return 0;
+    memcpy(pos, g->predoff, g->blockcount * sizeof(size_t));
+    for (b = 0; b < g->blockcount; b++)
+        for (i = g->succoff[b]; i < g->succoff[b+1]; i++)
+            g->pred[pos[g->succ[i]]++] = b;
+    free(pos);
+
+    return 1;
+}
+
+/*
+ * Builds the control flow graph of the code words, those are the words
+ * either enabled or not in a disabled region. Words which are not valid
+ * opcodes break the flow, just like the gaps in the image.
+ */
+int buildcfg(struct wordlist *wl, struct regionstruct *enaregs, struct regionstruct *disregs, struct cfg *g)
+{
+    struct wordlist *w;
+    struct instrinfo *ii;
+    size_t words = 0, i, t;
+    uint8_t *leader;
+    int secondword = 0;
+
+    for (w = wl; w; w = w->next)
+        words++;
+    if (!words)
+        return 1;
+
+    if ((g->instrs = malloc(words * sizeof(struct instrinfo))) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+
+    /* Decode the code words in the same way as the generator does */
+    for (w = wl; w; w = w->next) {
+        if (secondword) {
+            secondword = 0;
+            continue;
+        }
+        if (!inregions(enaregs, w->wordaddress) && inregions(disregs, w->wordaddress))
+            continue;
+        if (!decodeinstr(w, &g->instrs[g->instrcount]))
+            continue;
+        secondword = g->instrs[g->instrcount++].size == 2;
+    }
+
+    if (!g->instrcount)
+        return 1;
+
+    leader = calloc(g->instrcount, 1);
+    g->blockof = malloc(g->instrcount * sizeof(size_t));
+    g->blocks = malloc(g->instrcount * sizeof(struct basicblock));
+    if (!leader || !g->blockof || !g->blocks) {
+        free(leader);
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+
+    /* Mark the leaders */
+    leader[0] = 1;
+    for (i = 0; i < g->instrcount; i++) {
+        ii = &g->instrs[i];
+        if (hastarget(ii) && (t = findinstr(g, ii->target)) != CFG_NONE)
+            leader[t] = 1;
+        if (i+1 < g->instrcount && (!contiguous(g, i) ||
+            (ii->flow != FLOW_NONE && ii->flow != FLOW_CALL && ii->flow != FLOW_ICALL)))
+            leader[i+1] = 1;
+        if (ii->flow == FLOW_SKIP && i+2 < g->instrcount)
+            leader[i+2] = 1;
+    }
+
+    /* Split into basic blocks */
+    for (i = 0; i < g->instrcount; i++) {
+        if (leader[i]) {
+            memset(&g->blocks[g->blockcount], 0, sizeof(struct basicblock));
+            g->blocks[g->blockcount].begin = g->instrs[i].wordaddress;
+            g->blocks[g->blockcount].first = i;
+            g->blocks[g->blockcount].func = CFG_NONE;
+            g->blockcount++;
+        }
+        g->blocks[g->blockcount-1].count++;
+        g->blocks[g->blockcount-1].end = g->instrs[i].wordaddress + g->instrs[i].size - 1;
+        g->blockof[i] = g->blockcount-1;
+    }
+    free(leader);
+
+    if (!buildedges(g)) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+
+    return 1;
+}
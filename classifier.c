@@ -0,0 +1,131 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Classifier module for the avrdis project, estimates how likely the
+ *     disabled regions left by the label collection are code rather than
+ *     data, and optionally enables the regions those are likely code.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "avrdis.h"
+
+#define MIN_ASCII_RUN 4
+
+static int printable(uint8_t b)
+{
+    return b >= 0x20 && b < 0x7f;
+}
+
+/*
+ * Scores the word address range begin:end in a single pass and returns the
+ * estimated probability in percents that the range is code.
+ *
+ * The evidence used:
+ *  - density of valid opcodes,
+ *  - branch, jump and call targets pointing into the image,
+ *  - erased flash fill (0xffff words),
+ *  - runs of printable ASCII characters.
+ */
+int regionscore(struct wordindex *wi, uint32_t begin, uint32_t end)
+{
+    struct wordlist *w;
+    struct instrinfo ii;
+    size_t words = 0, valid = 0, fill = 0, ascii = 0, run = 0;
+    size_t branches = 0, badbranches = 0;
+    int i, secondword = 0;
+    uint8_t b;
+    double score;
+
+    for (w = wordfrom(wi, begin); w && w->wordaddress <= end; w = w->next) {
+
+        words++;
+
+        if (w->word == 0xffff)
+            fill++;
+
+        /* Count bytes in runs of printable characters, low byte first */
+        for (i = 0; i < 2; i++) {
+            b = i ? w->word >> 8 : w->word & 0xff;
+            if (printable(b))
+                run++;
+            else {
+                if (run >= MIN_ASCII_RUN)
+                    ascii += run;
+                run = 0;
+            }
+        }
+
+        /* 2nd word of a 32-bit opcode has already been accounted */
+        if (secondword) {
+            secondword = 0;
+            valid++;
+            continue;
+        }
+
+        if (!decodeinstr(w, &ii))
+            continue;
+
+        valid++;
+        secondword = ii.size == 2;
+
+        if (ii.flow == FLOW_BRANCH || ii.flow == FLOW_JUMP || ii.flow == FLOW_CALL) {
+            branches++;
+            if (!wordat(wi, ii.target))
+                badbranches++;
+        }
+    }
+
+    if (run >= MIN_ASCII_RUN)
+        ascii += run;
+
+    if (!words)
+        return 0;
+
+    score = (double) valid / words;
+    score *= (double) (words - fill) / words;
+    score *= 1.0 - 0.75 * ascii / (2 * words);
+    if (branches)
+        score *= (double) (branches - badbranches) / branches;
+
+    return (int) (100 * score + 0.5);
+}
+
+void printregionscores(struct outbuf *ob, struct wordindex *wi, struct regionstruct *rs)
+{
+    struct region *r;
+
+    for (r = rs->first; r; r = r->next)
+        obfmt(ob, "0x%04x:0x%04x %d%%\n", r->begin, r->end, regionscore(wi, r->begin, r->end));
+}
+
+/*
+ * Adds the disabled regions scoring at least threshold percents to the
+ * enabled regions. Returns the number of regions added or -1 on error.
+ */
+int enablescoredregions(struct wordindex *wi, struct regionstruct *disregs, struct regionstruct *enaregs, int threshold)
+{
+    struct region *r;
+    int added = 0;
+
+    for (r = disregs->first; r; r = r->next) {
+        if (inregions(enaregs, r->begin) || regionscore(wi, r->begin, r->end) < threshold)
+            continue;
+        if (!addregion(enaregs, r->begin, r->end)) {
+            errmsg("Error allocating memory\n");
+            return -1;
+        }
+        added++;
+    }
+
+    return added;
+}
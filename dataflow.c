@@ -0,0 +1,415 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Dataflow module for the avrdis project, solves bit vector dataflow
+ *     problems over the basic blocks of the control flow graph, and provides
+ *     register liveness and reaching definitions on top of that.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "avrdis.h"
+
+#define BITWORDS(n) (((n) + 63) / 64)
+
+/*
+ * Allocates a problem over the given blocks of the control flow graph, or
+ * over all the blocks when blocks is NULL. The lattice values are nwords
+ * wide, gen and kill are zeroed.
+ */
+struct dfproblem *allocdataflow(struct cfg *g, const size_t *blocks, size_t count, size_t nwords)
+{
+    struct dfproblem *p;
+    size_t i;
+
+    if ((p = malloc(sizeof(struct dfproblem))) == NULL)
+        return NULL;
+    memset(p, 0, sizeof(struct dfproblem));
+
+    if (!blocks)
+        count = g->blockcount;
+    p->count = count;
+    p->nwords = nwords;
+    p->entry = CFG_NONE;
+
+    p->blocks = malloc((count + 1) * sizeof(size_t));
+    p->local = malloc((g->blockcount + 1) * sizeof(size_t));
+    p->gen = calloc(count * nwords + 1, sizeof(uint64_t));
+    p->kill = calloc(count * nwords + 1, sizeof(uint64_t));
+    p->in = calloc(count * nwords + 1, sizeof(uint64_t));
+    p->out = calloc(count * nwords + 1, sizeof(uint64_t));
+    p->boundary = calloc(nwords + 1, sizeof(uint64_t));
+    if (!p->blocks || !p->local || !p->gen || !p->kill || !p->in || !p->out || !p->boundary) {
+        freedataflow(p);
+        return NULL;
+    }
+
+    for (i = 0; i < g->blockcount; i++)
+        p->local[i] = blocks ? CFG_NONE : i;
+    for (i = 0; i < count; i++) {
+        p->blocks[i] = blocks ? blocks[i] : i;
+        p->local[p->blocks[i]] = i;
+    }
+
+    return p;
+}
+
+void freedataflow(struct dfproblem *p)
+{
+    free(p->blocks);
+    free(p->local);
+    free(p->gen);
+    free(p->kill);
+    free(p->in);
+    free(p->out);
+    free(p->boundary);
+    free(p->exits);
+    free(p);
+}
+
+/*
+ * Solves the problem to a fixpoint with a worklist over the basic blocks.
+ * The transfer function of a block is f(x) = gen | (x & ~kill), the meet
+ * is union or intersection. Forward problems flow from the predecessors
+ * into in and out of a block, backward ones from the successors into out
+ * and in. The boundary value flows into the entry block of forward problems
+ * and into the blocks without neighbours in the direction of the flow, the
+ * value of the block in exits instead when given.
+ */
+int solvedataflow(struct cfg *g, struct dfproblem *p)
+{
+    size_t *worklist, *edgeoff, *edges, *nextoff, *next;
+    size_t head = 0, tail = 0, queued, b, l, e, w, i, n = p->nwords;
+    uint64_t *meet, *result, *from, v;
+    uint8_t *inlist;
+    int changed, neighbours;
+
+    worklist = malloc((p->count + 1) * sizeof(size_t));
+    inlist = malloc(p->count + 1);
+    if (!worklist || !inlist) {
+        free(worklist);
+        free(inlist);
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+
+    /* Meet from the predecessors for forward, from the successors for backward problems */
+    edgeoff = p->backward ? g->succoff : g->predoff;
+    edges = p->backward ? g->succ : g->pred;
+    nextoff = p->backward ? g->predoff : g->succoff;
+    next = p->backward ? g->pred : g->succ;
+
+    /* Initial values: top for the intersection, bottom for the union */
+    for (l = 0; l < p->count * n; l++) {
+        p->in[l] = p->intersect ? ~(uint64_t) 0 : 0;
+        p->out[l] = p->intersect ? ~(uint64_t) 0 : 0;
+    }
+
+    /* Queue all the blocks in the direction of the flow */
+    for (i = 0; i < p->count; i++) {
+        worklist[i] = p->backward ? p->count - 1 - i : i;
+        inlist[i] = 1;
+    }
+    queued = tail = p->count;
+
+    while (queued) {
+        l = worklist[head];
+        head = (head + 1) % (p->count + 1);
+        queued--;
+        inlist[l] = 0;
+        b = p->blocks[l];
+
+        meet = p->backward ? &p->out[l*n] : &p->in[l*n];
+        result = p->backward ? &p->in[l*n] : &p->out[l*n];
+
+        /* Meet over the neighbours taking part in the problem */
+        for (w = 0; w < n; w++)
+            meet[w] = p->intersect ? ~(uint64_t) 0 : 0;
+        neighbours = 0;
+        for (e = edgeoff[b]; e < edgeoff[b+1]; e++) {
+            if (p->local[edges[e]] == CFG_NONE)
+                continue;
+            from = p->backward ? &p->in[p->local[edges[e]]*n] : &p->out[p->local[edges[e]]*n];
+            for (w = 0; w < n; w++)
+                meet[w] = p->intersect ? meet[w] & from[w] : meet[w] | from[w];
+            neighbours++;
+        }
+
+        /* The boundary value flows in at the entry, and where there are no neighbours */
+        if (!neighbours)
+            memcpy(meet, p->exits ? &p->exits[l*n] : p->boundary, n * sizeof(uint64_t));
+        else if (!p->backward && l == p->entry)
+            for (w = 0; w < n; w++)
+                meet[w] = p->intersect ? meet[w] & p->boundary[w] : meet[w] | p->boundary[w];
+
+        /* Apply the transfer function */
+        changed = 0;
+        for (w = 0; w < n; w++) {
+            v = p->gen[l*n+w] | (meet[w] & ~p->kill[l*n+w]);
+            if (v != result[w]) {
+                result[w] = v;
+                changed = 1;
+            }
+        }
+
+        /* Requeue the dependent blocks */
+        if (changed)
+            for (e = nextoff[b]; e < nextoff[b+1]; e++) {
+                if ((i = p->local[next[e]]) == CFG_NONE || inlist[i])
+                    continue;
+                worklist[tail] = i;
+                tail = (tail + 1) % (p->count + 1);
+                queued++;
+                inlist[i] = 1;
+            }
+    }
+
+    free(inlist);
+    free(worklist);
+    return 1;
+}
+
+/*
+ * Register and flag liveness over the whole control flow graph. Nothing is
+ * live after a return, but everything is where the flow leaves the graph
+ * otherwise: a jump out of the image or into a disabled region, an indirect
+ * jump, or falling through into data or a gap.
+ */
+struct dfproblem *liveness(struct cfg *g)
+{
+    struct dfproblem *p;
+    struct basicblock *bb;
+    size_t b, i;
+
+    if ((p = allocdataflow(g, NULL, 0, 1)) == NULL || (p->exits = calloc(g->blockcount + 1, sizeof(uint64_t))) == NULL) {
+        if (p)
+            freedataflow(p);
+        errmsg("Error allocating memory\n");
+        return NULL;
+    }
+    p->backward = 1;
+
+    /* Upward exposed uses and the definitions of each block */
+    for (b = 0; b < g->blockcount; b++) {
+        bb = &g->blocks[b];
+        for (i = bb->first + bb->count; i-- > bb->first;) {
+            p->gen[b] = g->instrs[i].use | (p->gen[b] & ~g->instrs[i].def);
+            p->kill[b] |= g->instrs[i].def;
+        }
+        if (!bb->count || g->instrs[bb->first + bb->count - 1].flow != FLOW_RET)
+            p->exits[b] = ALL_REGS | ALL_FLAGS;
+    }
+
+    if (!solvedataflow(g, p)) {
+        freedataflow(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* Returns the registers and flags live right after the instruction */
+uint64_t liveafter(struct cfg *g, struct dfproblem *live, size_t instr)
+{
+    struct basicblock *bb = &g->blocks[g->blockof[instr]];
+    uint64_t v = live->out[g->blockof[instr]];
+    size_t i;
+
+    for (i = bb->first + bb->count - 1; i > instr; i--)
+        v = g->instrs[i].use | (v & ~g->instrs[i].def);
+    return v;
+}
+
+static size_t popcount(uint64_t v)
+{
+    size_t n = 0;
+
+    for (; v; v &= v - 1)
+        n++;
+    return n;
+}
+
+static void setbit(uint64_t *v, size_t bit)
+{
+    v[bit / 64] |= (uint64_t) 1 << (bit % 64);
+}
+
+/*
+ * Reaching definitions of the registers over the given blocks, or over all
+ * the blocks when blocks is NULL, entered at the block entry. A definition
+ * is an instruction writing a register, each register written makes a
+ * separate definition. All the registers are also defined at the entry,
+ * those definitions have no instruction.
+ */
+struct reachingdefs *reachingdefs(struct cfg *g, const size_t *blocks, size_t count, size_t entry)
+{
+    struct reachingdefs *rd;
+    struct dfproblem *p;
+    struct basicblock *bb;
+    size_t l, i, r, w, n, ndefs;
+
+    if ((rd = malloc(sizeof(struct reachingdefs))) == NULL) {
+        errmsg("Error allocating memory\n");
+        return NULL;
+    }
+    memset(rd, 0, sizeof(struct reachingdefs));
+
+    if (!blocks)
+        count = g->blockcount;
+
+    /* Count the definitions, the entry definitions come first */
+    for (ndefs = 32, l = 0; l < count; l++) {
+        bb = &g->blocks[blocks ? blocks[l] : l];
+        for (i = bb->first; i < bb->first + bb->count; i++)
+            ndefs += popcount(g->instrs[i].def & ALL_REGS);
+    }
+    n = BITWORDS(ndefs);
+
+    if ((rd->p = p = allocdataflow(g, blocks, count, n)) == NULL)
+        goto err_alloc;
+
+    rd->defs = malloc(ndefs * sizeof(struct regdef));
+    rd->firstdef = malloc((p->count + 1) * sizeof(size_t));
+    rd->regdefs = calloc(32 * n, sizeof(uint64_t));
+    if (!rd->defs || !rd->firstdef || !rd->regdefs)
+        goto err_alloc;
+
+    /* Number the definitions and collect them per register */
+    for (r = 0; r < 32; r++) {
+        rd->defs[r].instr = CFG_NONE;
+        rd->defs[r].reg = r;
+        setbit(&rd->regdefs[r*n], r);
+        setbit(p->boundary, r);
+    }
+    rd->defcount = 32;
+    for (l = 0; l < p->count; l++) {
+        rd->firstdef[l] = rd->defcount;
+        bb = &g->blocks[p->blocks[l]];
+        for (i = bb->first; i < bb->first + bb->count; i++)
+            for (r = 0; r < 32; r++)
+                if (g->instrs[i].def & REG(r)) {
+                    rd->defs[rd->defcount].instr = i;
+                    rd->defs[rd->defcount].reg = r;
+                    setbit(&rd->regdefs[r*n], rd->defcount++);
+                }
+    }
+
+    /* A definition generates itself and kills the other definitions of its register */
+    for (l = 0; l < p->count; l++)
+        for (i = rd->firstdef[l]; i < (l+1 < p->count ? rd->firstdef[l+1] : rd->defcount); i++) {
+            r = rd->defs[i].reg;
+            for (w = 0; w < n; w++) {
+                p->gen[l*n+w] &= ~rd->regdefs[r*n+w];
+                p->kill[l*n+w] |= rd->regdefs[r*n+w];
+            }
+            setbit(&p->gen[l*n], i);
+        }
+
+    p->entry = p->local[entry];
+    if (!solvedataflow(g, p))
+        goto err_free;
+
+    return rd;
+
+err_alloc:
+    errmsg("Error allocating memory\n");
+err_free:
+    freereachingdefs(rd);
+    return NULL;
+}
+
+void freereachingdefs(struct reachingdefs *rd)
+{
+    if (rd->p)
+        freedataflow(rd->p);
+    free(rd->defs);
+    free(rd->firstdef);
+    free(rd->regdefs);
+    free(rd);
+}
+
+/*
+ * Collects the definitions of register reg reaching the instruction, at most
+ * max of them. Returns the number of the reaching definitions, or CFG_NONE
+ * when the instruction is not in the blocks of the problem.
+ */
+size_t reachingdefsof(struct cfg *g, struct reachingdefs *rd, size_t instr, int reg, struct regdef *defs, size_t max)
+{
+    struct dfproblem *p = rd->p;
+    size_t l = p->local[g->blockof[instr]], n = p->nwords, w, d, found = 0;
+    uint64_t *v;
+
+    if (l == CFG_NONE)
+        return CFG_NONE;
+
+    if ((v = malloc(n * sizeof(uint64_t))) == NULL) {
+        errmsg("Error allocating memory\n");
+        return CFG_NONE;
+    }
+    memcpy(v, &p->in[l*n], n * sizeof(uint64_t));
+
+    /* Apply the definitions in the block up to the instruction */
+    for (d = rd->firstdef[l]; d < rd->defcount && rd->defs[d].instr < instr &&
+         g->blockof[rd->defs[d].instr] == p->blocks[l]; d++) {
+        for (w = 0; w < n; w++)
+            v[w] &= ~rd->regdefs[rd->defs[d].reg*n+w];
+        setbit(v, d);
+    }
+
+    for (d = 0; d < rd->defcount; d++)
+        if (rd->defs[d].reg == reg && (v[d / 64] >> (d % 64)) & 1) {
+            if (found < max)
+                defs[found] = rd->defs[d];
+            found++;
+        }
+
+    free(v);
+    return found;
+}
+
+/* Annotates the instructions writing registers those are never read afterwards */
+int annotatedeadstores(struct cfg *g, struct annotations *as)
+{
+    struct dfproblem *live;
+    uint64_t dead;
+    size_t i;
+    int r, res = 0;
+    char text[160], *p;
+    const char *sep;
+
+    if ((live = liveness(g)) == NULL)
+        return 0;
+
+    for (i = 0; i < g->instrcount; i++) {
+        /* Calls and alike are opaque, writing every register */
+        if ((g->instrs[i].def & ALL_REGS) == ALL_REGS)
+            continue;
+        if (!(dead = g->instrs[i].def & ALL_REGS & ~liveafter(g, live, i)))
+            continue;
+
+        p = text + sprintf(text, "dead store");
+        for (sep = " ", r = 0; r < 32; r++)
+            if (dead & REG(r)) {
+                p += sprintf(p, "%sr%d", sep, r);
+                sep = ", ";
+            }
+        if (!addannotation(as, g->instrs[i].wordaddress, text)) {
+            errmsg("Error allocating memory\n");
+            goto out;
+        }
+    }
+
+    res = 1;
+out:
+    freedataflow(live);
+    return res;
+}
@@ -0,0 +1,295 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Exploration module for the avrdis project, repeats the manual cycle of
+ *     enabling a disabled region and collecting again in-process, until no
+ *     more regions can be enabled safely.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "avrdis.h"
+
+#define AUTO_MIN_SCORE 50
+
+static int terminator(struct instrinfo *ii)
+{
+    return ii->flow == FLOW_JUMP || ii->flow == FLOW_RET || ii->flow == FLOW_IJUMP;
+}
+
+/*
+ * Finds the candidate range at the beginning of the disabled region r: up to
+ * the first unconditional jump or return not preceded by a skip, or the whole
+ * region when it falls through to the code following it. Returns 0 when
+ * there is no candidate, ie. an invalid opcode or a gap comes first, or the
+ * region runs off the end of the image.
+ */
+static int candidaterange(struct wordindex *wi, struct region *r, uint32_t *end)
+{
+    struct wordlist *w;
+    struct instrinfo ii;
+    int skipped = 0;
+
+    for (w = wordat(wi, r->begin); w && w->wordaddress <= r->end; w = w->next) {
+        if (!decodeinstr(w, &ii))
+            return 0;
+        if (ii.size == 2)
+            w = w->next;    /* 32-bit opcode */
+        if (terminator(&ii) && !skipped) {
+            *end = w->wordaddress;
+            return 1;
+        }
+        skipped = ii.flow == FLOW_SKIP;
+        if (!w->next || w->next->wordaddress != w->wordaddress + 1)
+            return 0;
+    }
+
+    /* Falls through to the code following the region */
+    if (w && w->wordaddress == r->end + 1) {
+        *end = r->end;
+        return 1;
+    }
+    return 0;
+}
+
+static int regioncmp(const void *lhs, const void *rhs)
+{
+    const struct region *l = lhs;
+    const struct region *r = rhs;
+
+    return l->begin < r->begin ? -1 : l->begin > r->begin;
+}
+
+/* Sorted copy of the regions, the overlapping and adjacent ones merged, NULL on error */
+static struct region *mergeregions(struct regionstruct *rs, size_t *n)
+{
+    struct region *r, *regs;
+    size_t i, m = 0;
+
+    for (*n = 0, r = rs->first; r; r = r->next)
+        (*n)++;
+    if ((regs = malloc((*n ? *n : 1) * sizeof(struct region))) == NULL)
+        return NULL;
+    for (i = 0, r = rs->first; r; r = r->next)
+        regs[i++] = *r;
+    qsort(regs, *n, sizeof(struct region), regioncmp);
+
+    for (i = 0; i < *n; i++) {
+        if (m && regs[i].begin <= regs[m-1].end + 1) {
+            if (regs[i].end > regs[m-1].end)
+                regs[m-1].end = regs[i].end;
+        } else
+            regs[m++] = regs[i];
+    }
+    *n = m;
+    return regs;
+}
+
+/* Index of the first of the merged regions ending at or after the word address */
+static size_t regionfrom(const struct region *regs, size_t n, uint32_t wordaddress)
+{
+    size_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (regs[mid].end < wordaddress)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Checks the words of the old disabled regions those turned into code: all
+ * of them must be valid opcodes with their targets inside the image. The
+ * words still disabled are stepped over a region at a time. Returns -1 on
+ * error.
+ */
+static int validcode(struct wordindex *wi, struct regionstruct *olddis, struct regionstruct *newdis, struct regionstruct *enaregs)
+{
+    struct region *r, *dis = NULL, *ena = NULL;
+    struct wordlist *w;
+    struct instrinfo ii;
+    size_t i, j, k, ndis, nena;
+    uint32_t skipto;
+    int res = 0;
+
+    if ((dis = mergeregions(newdis, &ndis)) == NULL || (ena = mergeregions(enaregs, &nena)) == NULL) {
+        res = -1;
+        goto out;
+    }
+
+    for (r = olddis->first; r; r = r->next) {
+        j = regionfrom(dis, ndis, r->begin);
+        k = regionfrom(ena, nena, r->begin);
+        for (i = wordpos(wi, r->begin); i < wi->count && wi->words[i]->wordaddress <= r->end; i++) {
+            w = wi->words[i];
+            while (j < ndis && dis[j].end < w->wordaddress)
+                j++;
+            while (k < nena && ena[k].end < w->wordaddress)
+                k++;
+
+            /* Still disabled up to the end of either region, or the next enabled word */
+            if (!(k < nena && ena[k].begin <= w->wordaddress) && j < ndis && dis[j].begin <= w->wordaddress) {
+                skipto = dis[j].end < r->end ? dis[j].end : r->end;
+                if (k < nena && ena[k].begin <= skipto)
+                    skipto = ena[k].begin - 1;
+                i = wordpos(wi, skipto + 1) - 1;
+                continue;
+            }
+
+            if (!decodeinstr(w, &ii))
+                goto out;
+            if ((ii.flow == FLOW_BRANCH || ii.flow == FLOW_JUMP || ii.flow == FLOW_CALL) &&
+                !wordat(wi, ii.target))
+                goto out;
+            if (ii.size == 2)
+                i++;    /* 32-bit opcode */
+        }
+    }
+    res = 1;
+
+out:
+    free(dis);
+    free(ena);
+    return res;
+}
+
+/* Prints the enabled regions as -e options, sorted and merged */
+static int printenaregs(struct regionstruct *enaregs)
+{
+    struct region *r, *regs;
+    size_t i, n = 0;
+    uint32_t begin, end;
+
+    for (r = enaregs->first; r; r = r->next)
+        n++;
+    if (!n)
+        return 1;
+
+    if ((regs = malloc(n * sizeof(struct region))) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+    for (i = 0, r = enaregs->first; r; r = r->next)
+        regs[i++] = *r;
+    qsort(regs, n, sizeof(struct region), regioncmp);
+
+    begin = regs[0].begin;
+    end = regs[0].end;
+    for (i = 1; i <= n; i++) {
+        if (i < n && regs[i].begin <= end + 1) {
+            if (regs[i].end > end)
+                end = regs[i].end;
+            continue;
+        }
+        fprintf(stderr, "%s-e %x:%x", begin == regs[0].begin ? "" : " ", begin, end);
+        if (i < n) {
+            begin = regs[i].begin;
+            end = regs[i].end;
+        }
+    }
+    fprintf(stderr, "\n");
+
+    free(regs);
+    return 1;
+}
+
+/* The disabled region beginning first at or after the word address, not rejected yet, NULL when none */
+static struct region *nextcandidate(struct regionstruct *disregs, const uint8_t *rejected, uint32_t base, uint32_t wordaddress)
+{
+    struct region *r, *next = NULL;
+    uint32_t bit;
+
+    for (r = disregs->first; r; r = r->next) {
+        bit = r->begin - base;
+        if (r->begin >= wordaddress && !(rejected[bit >> 3] >> (bit & 7) & 1) && (!next || r->begin < next->begin))
+            next = r;
+    }
+    return next;
+}
+
+/*
+ * Enables the disabled regions one candidate range at a time in address
+ * order, collecting again after each one. A candidate is kept only if every
+ * word it turns into code is a valid opcode and every target stays inside
+ * the image. The scan goes on after a kept candidate, and is repeated while
+ * candidates were kept, for the regions those changed. Prints the final
+ * enabled regions as -e options. Returns the number of regions added or -1
+ * on error.
+ */
+int autoenableregions(struct wordlist *wl, struct wordindex *wi, struct regionstruct *enaregs)
+{
+    struct regionstruct *disregs = NULL, *newdis = NULL;
+    struct region *r;
+    uint8_t *rejected = NULL;
+    uint32_t base, begin, end, bit;
+    int added = 0, progress, valid, res = -1;
+
+    if (!wi->count)
+        return printenaregs(enaregs) ? 0 : -1;
+    base = wi->words[0]->wordaddress;
+    if ((rejected = calloc((wi->words[wi->count - 1]->wordaddress - base) / 8 + 1, 1)) == NULL ||
+        (disregs = allocregions()) == NULL)
+        goto err_alloc;
+    if (!collectregions(wl, enaregs, disregs))
+        goto out;
+
+    do {
+        progress = 0;
+
+        for (begin = base; (r = nextcandidate(disregs, rejected, base, begin)) != NULL; begin++) {
+            begin = r->begin;
+
+            /* Tentatively enable the candidate and collect again */
+            if (candidaterange(wi, r, &end) && regionscore(wi, r->begin, end) >= AUTO_MIN_SCORE) {
+                if (!addregion(enaregs, r->begin, end) || (newdis = allocregions()) == NULL)
+                    goto err_alloc;
+                if (!collectregions(wl, enaregs, newdis))
+                    goto out;
+                if ((valid = validcode(wi, disregs, newdis, enaregs)) < 0)
+                    goto err_alloc;
+
+                if (valid) {
+                    freeregions(disregs);
+                    disregs = newdis;
+                    newdis = NULL;
+                    added++;
+                    progress = 1;
+                    continue;
+                }
+
+                freeregions(newdis);
+                newdis = NULL;
+                droplastregion(enaregs);
+            }
+
+            bit = begin - base;
+            rejected[bit >> 3] |= 1 << (bit & 7);
+        }
+    } while (progress);
+
+    if (printenaregs(enaregs))
+        res = added;
+    goto out;
+
+err_alloc:
+    errmsg("Error allocating memory\n");
+out:
+    if (newdis)
+        freeregions(newdis);
+    if (disregs)
+        freeregions(disregs);
+    free(rejected);
+    return res;
+}
@@ -0,0 +1,260 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Function detection module for the avrdis project, identifies the
+ *     functions by their entry points, finds their extents in the control
+ *     flow graph and builds the call graph between them.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "avrdis.h"
+
+struct calledge {
+    size_t caller;
+    size_t callee;
+    int tailcall;
+};
+
+struct callgraph *alloccallgraph(void)
+{
+    struct callgraph *cg = malloc(sizeof(struct callgraph));
+
+    if (cg)
+        memset(cg, 0, sizeof(struct callgraph));
+    return cg;
+}
+
+void freecallgraph(struct callgraph *cg)
+{
+    free(cg->funcs);
+    free(cg->calleeoff);
+    free(cg->callee);
+    free(cg->tailcall);
+    free(cg);
+}
+
+/* Returns the index of the function with the given entry point, or CFG_NONE */
+size_t findfunction(struct callgraph *cg, uint32_t entry)
+{
+    size_t lo = 0, hi = cg->funccount, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (cg->funcs[mid].entry < entry)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < cg->funccount && cg->funcs[lo].entry == entry)
+        return lo;
+    return CFG_NONE;
+}
+
+static int addrcmp(const void *lhs, const void *rhs)
+{
+    uint32_t l = *(const uint32_t *) lhs;
+    uint32_t r = *(const uint32_t *) rhs;
+
+    return l < r ? -1 : l > r;
+}
+
+static int edgecmp(const void *lhs, const void *rhs)
+{
+    const struct calledge *l = lhs;
+    const struct calledge *r = rhs;
+
+    if (l->caller != r->caller)
+        return l->caller < r->caller ? -1 : 1;
+    if (l->callee != r->callee)
+        return l->callee < r->callee ? -1 : 1;
+    return l->tailcall - r->tailcall;
+}
+
+/*
+ * Collects the entry points: the targets of the jump table at the reset
+ * address (the reset and interrupt vectors) or the reset address itself
+ * when there is no jump table, and the call targets. Returns the number of
+ * the unique entry points found.
+ */
+static size_t collectentries(struct cfg *g, uint32_t *entries)
+{
+    size_t i, n = 0, unique;
+
+    if (g->instrs[0].flow != FLOW_JUMP)
+        entries[n++] = g->instrs[0].wordaddress;
+
+    for (i = 0; i < g->instrcount && g->instrs[i].flow == FLOW_JUMP; i++) {
+        if (findinstr(g, g->instrs[i].target) != CFG_NONE)
+            entries[n++] = g->instrs[i].target;
+        if (i+1 < g->instrcount &&
+            g->instrs[i].wordaddress + g->instrs[i].size != g->instrs[i+1].wordaddress)
+            break;
+    }
+
+    for (i = 0; i < g->instrcount; i++)
+        if (g->instrs[i].flow == FLOW_CALL && findinstr(g, g->instrs[i].target) != CFG_NONE)
+            entries[n++] = g->instrs[i].target;
+
+    qsort(entries, n, sizeof(uint32_t), addrcmp);
+    for (i = 0, unique = 0; i < n; i++)
+        if (!unique || entries[unique-1] != entries[i])
+            entries[unique++] = entries[i];
+
+    return unique;
+}
+
+/*
+ * Claims the basic blocks reachable from the entry of function f without
+ * entering other functions. Reaching the entry of an other function counts
+ * as a tail call, reaching a block claimed by an other function marks a
+ * shared epilogue. Returns the number of edges added.
+ */
+static size_t claimblocks(struct cfg *g, struct callgraph *cg, size_t f, size_t *stack, struct calledge *edges)
+{
+    size_t sp = 0, b, s, i, callee, n = 0;
+    struct function *fn = &cg->funcs[f];
+
+    stack[sp++] = fn->block;
+    g->blocks[fn->block].func = f;
+
+    while (sp) {
+        b = stack[--sp];
+        fn->words += g->blocks[b].end - g->blocks[b].begin + 1;
+
+        for (i = g->succoff[b]; i < g->succoff[b+1]; i++) {
+            s = g->succ[i];
+            if (g->blocks[s].func == f)
+                continue;
+            if ((callee = findfunction(cg, g->blocks[s].begin)) != CFG_NONE &&
+                cg->funcs[callee].block == s) {
+                edges[n].caller = f;
+                edges[n].callee = callee;
+                edges[n++].tailcall = 1;
+            } else if (g->blocks[s].func != CFG_NONE)
+                fn->shared = 1;
+            else {
+                g->blocks[s].func = f;
+                stack[sp++] = s;
+            }
+        }
+    }
+
+    return n;
+}
+
+/* Identifies the functions in the control flow graph and builds the call graph */
+int findfunctions(struct cfg *g, struct callgraph *cg)
+{
+    int res = 0;    /* Default to error */
+    uint32_t *entries = NULL;
+    size_t *stack = NULL;
+    struct calledge *edges = NULL;
+    size_t f, i, n, callee, edgecount = 0;
+
+    if (!g->instrcount)
+        return 1;
+
+    entries = malloc((2 * g->instrcount + 1) * sizeof(uint32_t));
+    stack = malloc(g->blockcount * sizeof(size_t));
+    edges = malloc((g->instrcount + g->succoff[g->blockcount]) * sizeof(struct calledge));
+    if (!entries || !stack || !edges)
+        goto err_alloc;
+
+    n = collectentries(g, entries);
+    if ((cg->funcs = calloc(n + 1, sizeof(struct function))) == NULL)
+        goto err_alloc;
+    for (f = 0; f < n; f++) {
+        cg->funcs[f].entry = entries[f];
+        cg->funcs[f].block = g->blockof[findinstr(g, entries[f])];
+    }
+    cg->funccount = n;
+
+    /* Claim the blocks of the functions in entry address order */
+    for (f = 0; f < cg->funccount; f++)
+        edgecount += claimblocks(g, cg, f, stack, edges + edgecount);
+
+    /* Call edges from the calls in the claimed blocks */
+    for (i = 0; i < g->instrcount; i++) {
+        f = g->blocks[g->blockof[i]].func;
+        if (f == CFG_NONE || g->instrs[i].flow != FLOW_CALL)
+            continue;
+        if ((callee = findfunction(cg, g->instrs[i].target)) == CFG_NONE)
+            continue;
+        edges[edgecount].caller = f;
+        edges[edgecount].callee = callee;
+        edges[edgecount++].tailcall = 0;
+    }
+
+    /* Unique edges in compressed rows, a call supersedes a tail call */
+    qsort(edges, edgecount, sizeof(struct calledge), edgecmp);
+    for (i = 0, n = 0; i < edgecount; i++)
+        if (!n || edges[n-1].caller != edges[i].caller || edges[n-1].callee != edges[i].callee)
+            edges[n++] = edges[i];
+
+    cg->calleeoff = calloc(cg->funccount + 1, sizeof(size_t));
+    cg->callee = malloc((n + 1) * sizeof(size_t));
+    cg->tailcall = malloc(n + 1);
+    if (!cg->calleeoff || !cg->callee || !cg->tailcall)
+        goto err_alloc;
+
+    for (i = 0; i < n; i++) {
+        cg->calleeoff[edges[i].caller+1]++;
+        cg->callee[i] = edges[i].callee;
+        cg->tailcall[i] = edges[i].tailcall;
+    }
+    for (f = 0; f < cg->funccount; f++)
+        cg->calleeoff[f+1] += cg->calleeoff[f];
+
+    res = 1;    /* Success */
+    goto out;
+
+err_alloc:
+    errmsg("Error allocating memory\n");
+out:
+    free(edges);
+    free(stack);
+    free(entries);
+    return res;
+}
+
+/* Writes the call graph in Graphviz DOT format */
+int writecallgraph(struct callgraph *cg, const char *filename)
+{
+    FILE *fp;
+    size_t f, i;
+
+    fp = fopen(filename, "w");
+    if (!fp) {
+        errmsg("Error opening file: %s\n", filename);
+        return 0;
+    }
+
+    fprintf(fp, "digraph callgraph {\n");
+    for (f = 0; f < cg->funccount; f++)
+        fprintf(fp, "    " FUNCTION_LABEL_FMT " [label=\"" FUNCTION_LABEL_FMT "\\n%zu words%s\"];\n",
+                cg->funcs[f].entry, cg->funcs[f].entry, cg->funcs[f].words,
+                cg->funcs[f].shared ? ", shared" : "");
+    for (f = 0; f < cg->funccount; f++)
+        for (i = cg->calleeoff[f]; i < cg->calleeoff[f+1]; i++)
+            fprintf(fp, "    " FUNCTION_LABEL_FMT " -> " FUNCTION_LABEL_FMT "%s;\n",
+                    cg->funcs[f].entry, cg->funcs[cg->callee[i]].entry,
+                    cg->tailcall[i] ? " [style=dashed]" : "");
+    fprintf(fp, "}\n");
+
+    if (fclose(fp)) {
+        errmsg("Error writing file: %s\n", filename);
+        return 0;
+    }
+    return 1;
+}
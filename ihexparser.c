@@ -3,7 +3,8 @@
  * Description:
  *     Ihex parser module for the avrdis project, parses the record structure
  *     found in the ihex file and produces the data structure with the parsed
- *     data for further processing.
+ *     data for further processing. A pipe or a big file is read by a thread
+ *     of its own, so the parsing overlaps the reading of the slow inputs.
  * 
  * Author:
  *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
@@ -18,23 +19,84 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "avrdis.h"
 
+#define READ_CHUNK_SIZE (64 * 1024)
+#define READ_CHUNKS 8
+#define THREADED_READ_SIZE (1024 * 1024)   /* The files from it are read on a thread, the small ones are waited for */
+
+/*
+ * Ring of the chunks read, passed from the reading thread to the parser.
+ * Each side moves its own index only, under the lock, and waits for the
+ * other one on an empty or a full ring only.
+ */
+struct readqueue {
+    int fd;
+    char *bufs;                 /* READ_CHUNKS chunks of READ_CHUNK_SIZE */
+    ssize_t lens[READ_CHUNKS];  /* 0 at the end of the input, negative when the read failed */
+    size_t head;                /* Next chunk to fill, by the reader */
+    size_t tail;                /* Chunk being parsed */
+    size_t pos;                 /* In the chunk being parsed */
+    int taken;                  /* The chunk at tail is being parsed */
+    int done;                   /* The end of the input or a failed read has been taken */
+    int err;                    /* A read has failed */
+    int stop;                   /* The parser has stopped, the reader returns */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     /* A chunk was filled or freed, or the parser stopped */
+    pthread_t reader;
+};
+
+/* The characters of a file, or of the chunks read on a thread when fp is NULL */
+struct ihexinput {
+    FILE *fp;
+    struct readqueue *q;
+    int back;                   /* The character given back, EOF when none */
+};
+
 enum recordtype {
     RECORDTYPE_IHEX_DATA_RECORD         = 0x00,
     RECORDTYPE_IHEX_EOF_RECORD          = 0x01,
     RECORDTYPE_IHEX_EXT_SEG_ADDR_RECORD = 0x02
 };
 
-static int parsehexbyte(FILE *fp, uint8_t *b)
+static int takechar(struct readqueue *q);
+
+static int nextchar(struct ihexinput *in)
+{
+    int c;
+
+    if (in->fp)
+        return fgetc(in->fp);
+    if ((c = in->back) != EOF) {
+        in->back = EOF;
+        return c;
+    }
+    return takechar(in->q);
+}
+
+/* Gives back the character read last, to be read again */
+static void giveback(struct ihexinput *in, int c)
+{
+    if (in->fp)
+        ungetc(c, in->fp);
+    else
+        in->back = c;
+}
+
+static int parsehexbyte(struct ihexinput *in, uint8_t *b)
 {
     int i, c;
     char buf[] = {'\0', '\0', '\0'};
 
     for (i = 0; i < 2; i++) {
-        if (!isxdigit(c = fgetc(fp))) {
-            ungetc(c, fp);
+        if (!isxdigit(c = nextchar(in))) {
+            giveback(in, c);
             return 0;
         }
         buf[i] = c;
@@ -53,7 +115,7 @@ int ihexfile(const char *filename)
 
     fp = fopen(filename, "r");
     if (!fp) {
-        fprintf(stderr, "Error opening file: %s\n", filename);
+        errmsg("Error opening file: %s\n", filename);
         return -1;
     }
 
@@ -70,7 +132,12 @@ int ihexfile(const char *filename)
     return res;
 }
 
-int parseihexfile(const char *filename, struct wordlist **wl)
+/*
+ * Parses the records of in into the word list, its nodes taken from the
+ * arena, filename names the input in the messages. On error, the nodes
+ * parsed so far stay there until the arena is reset.
+ */
+static int parseihex(struct ihexinput *in, const char *filename, struct arena *a, struct wordlist **wl)
 {
     int res = 0;    /* Default to error */
     int c, lineno = 1, eofr = 0, recparsed = 0;
@@ -80,26 +147,19 @@ int parseihexfile(const char *filename, struct wordlist **wl)
     uint32_t wordaddress;
     struct wordlist *newword, *drwl, *firstdrw, *lastdrw;
     struct wordlist *firstword = NULL, *lastword = NULL;
-    FILE *fp;
-
-    fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Error opening file: %s\n", filename);
-        goto err_file;
-    }
 
     /* Main parser loop */
     for (;;) {
 
         /* Position after the record start ':' */
-        while ((c = fgetc(fp)) != EOF && c != ':')
+        while ((c = nextchar(in)) != EOF && c != ':')
             ;
         if (c == EOF)
             break;
 
         /* When yet another record after the "End Of File" record was found, signal an error */
         if (eofr) {
-            fprintf(stderr, 
+            errmsg(
                     "Record after \"End Of File\" record found at line %d in file %s.\n", 
                     lineno, filename);
             goto err_process;
@@ -108,32 +168,32 @@ int parseihexfile(const char *filename, struct wordlist **wl)
         /* Parse record fields */
 
         /* Byte count */
-        if (!parsehexbyte(fp, &bytecount)) {
-            fprintf(stderr, 
+        if (!parsehexbyte(in, &bytecount)) {
+            errmsg(
                     "Error parsing \"byte count\" in record at line %d in file %s.\n", 
                     lineno, filename);
             goto err_process;
         }
 
         /* Address high byte */
-        if (!parsehexbyte(fp, &addrh)) {
-            fprintf(stderr, 
+        if (!parsehexbyte(in, &addrh)) {
+            errmsg(
                     "Error parsing \"address\" high byte in record at line %d in file %s.\n", 
                     lineno, filename);
             goto err_process;
         }
 
         /* Address low byte */
-        if (!parsehexbyte(fp, &addrl)) {
-            fprintf(stderr, 
+        if (!parsehexbyte(in, &addrl)) {
+            errmsg(
                     "Error parsing \"address\" low byte in record at line %d in file %s.\n", 
                     lineno, filename);
             goto err_process;
         }
 
         /* Record type */
-        if (!parsehexbyte(fp, &rectype)) {
-            fprintf(stderr, 
+        if (!parsehexbyte(in, &rectype)) {
+            errmsg(
                     "Error parsing \"record type\" in record at line %d in file %s.\n", 
                     lineno, filename);
             goto err_process;
@@ -151,26 +211,26 @@ int parseihexfile(const char *filename, struct wordlist **wl)
                 for (wordcount = bytecount >> 1; wordcount; wordcount--, wordaddress++) {
 
                     /* Parse data word low byte */
-                    if (!parsehexbyte(fp, &wdl)) {
-                        fprintf(stderr, 
+                    if (!parsehexbyte(in, &wdl)) {
+                        errmsg(
                                 "Error parsing \"word\" low byte in record at line %d in file %s.\n", 
                                 lineno, filename);
-                        goto err_datarecord;
+                        goto err_process;
                     }
 
                     /* Parse data word high byte */
-                    if (!parsehexbyte(fp, &wdh)) {
-                        fprintf(stderr, 
+                    if (!parsehexbyte(in, &wdh)) {
+                        errmsg(
                                 "Error parsing \"word\" high byte in record at line %d in file %s.\n", 
                                 lineno, filename);
-                        goto err_datarecord;
+                        goto err_process;
                     }
 
                     /* Allocate word structure */
-                    newword = (struct wordlist *) malloc(sizeof(struct wordlist));
+                    newword = (struct wordlist *) arenaalloc(a, sizeof(struct wordlist));
                     if (!newword) {
-                        fprintf(stderr, "Error allocating memory.\n");
-                        goto err_datarecord;
+                        errmsg("Error allocating memory.\n");
+                        goto err_process;
                     }
 
                     /* Zero out allocated memory */
@@ -190,11 +250,11 @@ int parseihexfile(const char *filename, struct wordlist **wl)
                 } /* Data word parser loop */
 
                 /* Parse checksum */
-                if (!parsehexbyte(fp, &chksum)) {
-                    fprintf(stderr, 
+                if (!parsehexbyte(in, &chksum)) {
+                    errmsg(
                             "Error parsing \"checksum\" in record at line %d in file %s.\n", 
                             lineno, filename);
-                    goto err_datarecord;
+                    goto err_process;
                 }
 
                 /* Calculate data word sum for checksum check */
@@ -203,8 +263,8 @@ int parseihexfile(const char *filename, struct wordlist **wl)
 
                 /* Check checksum */
                 if ((uint8_t) (bytecount + addrh + addrl + rectype + wordsum + chksum) != 0) {
-                    fprintf(stderr, "Checksum error at line %d in file %s.\n", lineno, filename);
-                    goto err_datarecord;
+                    errmsg("Checksum error at line %d in file %s.\n", lineno, filename);
+                    goto err_process;
                 }
 
                 /* Link the list of accumulated data words into the word list */
@@ -219,8 +279,8 @@ int parseihexfile(const char *filename, struct wordlist **wl)
 
             case RECORDTYPE_IHEX_EOF_RECORD:
 
-                if (!parsehexbyte(fp, &chksum)) {
-                    fprintf(stderr, 
+                if (!parsehexbyte(in, &chksum)) {
+                    errmsg(
                             "Error parsing \"checksum\" in record at line %d in file %s.\n", 
                             lineno, filename);
                     goto err_process;
@@ -228,7 +288,7 @@ int parseihexfile(const char *filename, struct wordlist **wl)
 
                 /* Check checksum */
                 if ((uint8_t) (bytecount + addrh + addrl + rectype + chksum) != 0) {
-                    fprintf(stderr, "Checksum error at line %d in file %s.\n", lineno, filename);
+                    errmsg("Checksum error at line %d in file %s.\n", lineno, filename);
                     goto err_process;
                 }
 
@@ -240,36 +300,36 @@ int parseihexfile(const char *filename, struct wordlist **wl)
 
                 /* Check if the "Extended Segment Address" record is in the first position */
                 if (recparsed) {
-                    fprintf(stderr, 
+                    errmsg(
                             "\"Extended Segment Address\" record at line %d in file %s\n", 
                             lineno, filename);
                     goto err_process;
                 }
 
                 /* Parse the "Extended Segment Address" address */
-                if (!parsehexbyte(fp, &extsah)) {
-                    fprintf(stderr, 
+                if (!parsehexbyte(in, &extsah)) {
+                    errmsg(
                             "Error parsing \"segment base address\" high byte in record at line %d in file %s.\n", 
                             lineno, filename);
                     goto err_process;
                 }
-                if (!parsehexbyte(fp, &extsal)) {
-                    fprintf(stderr, 
+                if (!parsehexbyte(in, &extsal)) {
+                    errmsg(
                             "Error parsing \"segment base address\" low byte in record at line %d in file %s.\n", 
                             lineno, filename);
                     goto err_process;
                 }
     
                 /* Parse checksum */
-                if (!parsehexbyte(fp, &chksum)) {
-                    fprintf(stderr, "Error parsing \"checksum\" in record at line %d in file %s.\n", 
+                if (!parsehexbyte(in, &chksum)) {
+                    errmsg("Error parsing \"checksum\" in record at line %d in file %s.\n", 
                     lineno, filename);
                     goto err_process;
                 }
  
                 /* Check checksum */
                 if ((uint8_t) (bytecount + addrh + addrl + rectype + extsah + extsal + chksum) != 0) {
-                    fprintf(stderr, "Checksum error at line %d in file %s.\n", lineno, filename);
+                    errmsg("Checksum error at line %d in file %s.\n", lineno, filename);
                     goto err_process;
                 }
 
@@ -281,9 +341,9 @@ int parseihexfile(const char *filename, struct wordlist **wl)
             default:
 
                 /* Unsupported record types gets ignored */
-                while (isxdigit(c = fgetc(fp)))
+                while (isxdigit(c = nextchar(in)))
                     ;
-                ungetc(c, fp);
+                giveback(in, c);
 
                 recparsed = 1;  /* Flag record has been parsed */
                 break;
@@ -291,15 +351,15 @@ int parseihexfile(const char *filename, struct wordlist **wl)
         } /* Switch case on record type */
 
         /* Position after the end of line */
-        while ((c = fgetc(fp)) != EOF && c != '\n' && c != '\r')
+        while ((c = nextchar(in)) != EOF && c != '\n' && c != '\r')
             ;
         if (c == EOF)
             break;
  
         /* Increment line number when end of line found */
         if (c == '\n') {
-            if ((c = fgetc(fp)) != '\r')
-                ungetc(c, fp);
+            if ((c = nextchar(in)) != '\r')
+                giveback(in, c);
             lineno++;
         } else if (c == '\r') {
             lineno++;
@@ -309,7 +369,7 @@ int parseihexfile(const char *filename, struct wordlist **wl)
 
     /* No "End Of File" record was found */
     if (!eofr) {
-        fprintf(stderr, 
+        errmsg(
                 "No \"End Of File\" record was found when reaching the end of file %s\n", 
                 filename);
         goto err_process;
@@ -317,20 +377,171 @@ int parseihexfile(const char *filename, struct wordlist **wl)
 
     res = 1;            /* Success */
 
-    if (wl) {
+    if (wl)
         *wl = firstword;    /* Set the word list as output */
-        goto out;
-    } else
-        goto out_cleanup;
 
-    /* Cascading Cleanup Section */
-err_datarecord:
-    freewordlist(firstdrw);
 err_process:
-out_cleanup:
-    freewordlist(firstword);
+    return res;
+}
+
+/*
+ * Fills the free chunks with the reads of the input until its end or a failed
+ * read. Cancelled only while reading, when the parser stops early.
+ */
+static void *readchunks(void *arg)
+{
+    struct readqueue *q = arg;
+    ssize_t n;
+    char *buf;
+    int state;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    do {
+        pthread_mutex_lock(&q->lock);
+        while (q->head - q->tail == READ_CHUNKS && !q->stop)
+            pthread_cond_wait(&q->changed, &q->lock);
+        if (q->stop) {
+            pthread_mutex_unlock(&q->lock);
+            break;
+        }
+        buf = q->bufs + (q->head % READ_CHUNKS) * READ_CHUNK_SIZE;
+        pthread_mutex_unlock(&q->lock);
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+        while ((n = read(q->fd, buf, READ_CHUNK_SIZE)) < 0 && errno == EINTR)
+            ;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+
+        pthread_mutex_lock(&q->lock);
+        q->lens[q->head++ % READ_CHUNKS] = n;
+        pthread_cond_signal(&q->changed);
+        pthread_mutex_unlock(&q->lock);
+    } while (n > 0);
+    return NULL;
+}
+
+/* The next character of the chunks of the reader, EOF at the end of the input or a failed read */
+static int takechar(struct readqueue *q)
+{
+    size_t slot = q->tail % READ_CHUNKS;
+
+    if (q->taken && q->pos == (size_t) q->lens[slot]) {
+        pthread_mutex_lock(&q->lock);
+        q->taken = 0;
+        q->tail++;
+        pthread_cond_signal(&q->changed);
+        pthread_mutex_unlock(&q->lock);
+        slot = q->tail % READ_CHUNKS;
+    }
+    if (q->done)
+        return EOF;
+    if (!q->taken) {
+        pthread_mutex_lock(&q->lock);
+        while (q->head == q->tail)
+            pthread_cond_wait(&q->changed, &q->lock);
+        pthread_mutex_unlock(&q->lock);
+        q->taken = 1;
+        q->pos = 0;
+        if (q->lens[slot] <= 0) {
+            q->done = 1;
+            q->err = q->lens[slot] < 0;
+            return EOF;
+        }
+    }
+    return (unsigned char) q->bufs[slot * READ_CHUNK_SIZE + q->pos++];
+}
+
+/* Parses a pipe or a file with the reads on a thread of their own, overlapping the parsing */
+static int parseihexthreaded(int fd, const char *filename, struct arena *a, struct wordlist **wl)
+{
+    struct ihexinput in = { NULL, NULL, EOF };
+    struct readqueue q;
+    int res = 0;
+
+    memset(&q, 0, sizeof(struct readqueue));
+    q.fd = fd;
+    if ((q.bufs = malloc(READ_CHUNKS * READ_CHUNK_SIZE)) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.changed, NULL);
+    if (pthread_create(&q.reader, NULL, readchunks, &q)) {
+        errmsg("Failed to start reading file %s\n", filename);
+        goto out;
+    }
+
+    in.q = &q;
+    res = parseihex(&in, filename, a, wl);
+    if (q.err) {
+        errmsg("Error reading file %s\n", filename);
+        res = 0;
+    }
+
+    /* The reader may still wait for a free chunk or the input, when the parser has stopped early */
+    pthread_mutex_lock(&q.lock);
+    q.stop = 1;
+    pthread_cond_signal(&q.changed);
+    pthread_mutex_unlock(&q.lock);
+    pthread_cancel(q.reader);
+    pthread_join(q.reader, NULL);
+
 out:
+    pthread_cond_destroy(&q.changed);
+    pthread_mutex_destroy(&q.lock);
+    free(q.bufs);
+    return res;
+}
+
+int parseihexfile(const char *filename, struct arena *a, struct wordlist **wl)
+{
+    struct ihexinput in = { NULL, NULL, EOF };
+    struct stat st;
+    int res;
+    FILE *fp;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        errmsg("Error opening file: %s\n", filename);
+        return 0;
+    }
+
+    /*
+     * A pipe, or a file big enough to be slow on a network mount, is read on
+     * a thread of its own, a small file is read in a few reads anyway
+     */
+    if (fstat(fileno(fp), &st) == 0 && (S_ISFIFO(st.st_mode) || (S_ISREG(st.st_mode) && st.st_size >= THREADED_READ_SIZE)))
+        res = parseihexthreaded(fileno(fp), filename, a, wl);
+    else {
+        in.fp = fp;
+        if ((res = parseihex(&in, filename, a, wl)) && ferror(fp)) {
+            errmsg("Error reading file %s\n", filename);
+            res = 0;
+        }
+    }
     fclose(fp);
-err_file:
+    return res;
+}
+
+/* Parses the ihex text in buf, the same way as a file named name */
+int parseihexbuffer(const char *buf, size_t len, const char *name, struct arena *a, struct wordlist **wl)
+{
+    struct ihexinput in = { NULL, NULL, EOF };
+    int res;
+
+    /* An empty stream has no "End Of File" record either */
+    if (!len) {
+        errmsg("No \"End Of File\" record was found when reaching the end of file %s\n", name);
+        return 0;
+    }
+
+    in.fp = fmemopen((void *) buf, len, "r");
+    if (!in.fp) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+
+    res = parseihex(&in, name, a, wl);
+    fclose(in.fp);
     return res;
 }
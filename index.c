@@ -0,0 +1,102 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Output index module for the avrdis project, collects the byte offsets
+ *     of the sampled addresses and the labels in the generated output, and
+ *     writes them into a sidecar file for seeking in large listings.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "avrdis.h"
+
+#define DEFAULT_INDEX_SIZE 256
+
+struct outindex *allocindex(void)
+{
+    struct outindex *ix = malloc(sizeof(struct outindex));
+
+    if (ix)
+        memset(ix, 0, sizeof(struct outindex));
+    return ix;
+}
+
+void freeindex(struct outindex *ix)
+{
+    free(ix->entries);
+    free(ix);
+}
+
+int addindexentry(struct outindex *ix, uint32_t wordaddress, const char *label, uint64_t offset)
+{
+    struct indexentry *entries;
+    size_t size;
+
+    if (ix->count == ix->size) {
+        size = ix->size ? 2 * ix->size : DEFAULT_INDEX_SIZE;
+        if ((entries = realloc(ix->entries, size * sizeof(struct indexentry))) == NULL)
+            return 0;
+        ix->entries = entries;
+        ix->size = size;
+    }
+
+    ix->entries[ix->count].wordaddress = wordaddress;
+    ix->entries[ix->count].label = label;
+    ix->entries[ix->count].offset = offset;
+    ix->count++;
+    return 1;
+}
+
+/* Appends the entries of src, moving their offsets by base */
+int appendindex(struct outindex *dst, struct outindex *src, uint64_t base)
+{
+    size_t i;
+
+    for (i = 0; i < src->count; i++)
+        if (!addindexentry(dst, src->entries[i].wordaddress, src->entries[i].label,
+                           base + src->entries[i].offset))
+            return 0;
+    return 1;
+}
+
+/*
+ * Writes the index as text, a header line with the sampling step, then a
+ * line per entry in the order of the output: the word address, the byte
+ * offset of its line and the label defined there, if any.
+ */
+int writeindex(struct outindex *ix, unsigned int step, const char *filename)
+{
+    FILE *fp;
+    struct indexentry *e;
+
+    fp = fopen(filename, "w");
+    if (!fp) {
+        errmsg("Error opening file: %s\n", filename);
+        return 0;
+    }
+
+    fprintf(fp, "avrdis-index 1 step %u\n", step);
+    for (e = ix->entries; e < ix->entries + ix->count; e++) {
+        fprintf(fp, "0x%04x %" PRIu64, e->wordaddress, e->offset);
+        if (e->label)
+            fprintf(fp, " %s", e->label);
+        fprintf(fp, "\n");
+    }
+
+    if (fclose(fp)) {
+        errmsg("Error writing file: %s\n", filename);
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,278 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Library module for the avrdis project, drives the parser, the analyses
+ *     and the renderer through a context object instead of the command
+ *     line, capturing the diagnostics of the calls as error messages.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "avrdis.h"
+#include "libavrdis.h"
+
+#define MESSAGE_SIZE 256
+#define INPUT_NAME "<buffer>"
+
+struct avrdis {
+    pthread_mutex_t lock;       /* Serializes the calls on the context */
+    struct wordlist *wl;        /* The image, NULL when none */
+    struct arena *arena;        /* Of the image, reset when it is dropped */
+    struct regionstruct *enaregs;
+    struct analysis *an;        /* NULL when not analyzed yet */
+    struct options opts;        /* The options of the analysis */
+    int (*textfn)(void *arg, const char *buf, size_t len);
+    int (*instrfn)(void *arg, const struct avrdisinstr *in);
+    void *arg;
+    int stopped;                /* The callback asked to stop */
+    char message[MESSAGE_SIZE];
+};
+
+static const char *errors[] = {
+    "Success",
+    "Out of memory",
+    "Malformed image",
+    "Invalid argument",
+    "No image parsed or not analyzed yet",
+    "Analysis failed",
+    "Rendering the output failed",
+    "Stopped by the callback"
+};
+
+void avrdisdefaults(struct avrdisoptions *opts)
+{
+    memset(opts, 0, sizeof(struct avrdisoptions));
+    opts->format = AVRDIS_FORMAT_ASM;
+    opts->enablethreshold = -1;
+    opts->timebudget = -1;
+}
+
+struct avrdis *allocavrdis(void)
+{
+    struct avrdis *ad = malloc(sizeof(struct avrdis));
+
+    if (!ad)
+        return NULL;
+    memset(ad, 0, sizeof(struct avrdis));
+
+    if ((ad->enaregs = allocregions()) == NULL || (ad->arena = allocarena()) == NULL) {
+        if (ad->enaregs)
+            freeregions(ad->enaregs);
+        free(ad);
+        return NULL;
+    }
+    pthread_mutex_init(&ad->lock, NULL);
+    return ad;
+}
+
+static void dropimage(struct avrdis *ad)
+{
+    if (ad->an)
+        freeanalysis(ad->an);
+    ad->an = NULL;
+    resetarena(ad->arena);
+    ad->wl = NULL;
+}
+
+void freeavrdis(struct avrdis *ad)
+{
+    if (!ad)
+        return;
+    dropimage(ad);
+    freeregions(ad->enaregs);
+    freearena(ad->arena);
+    pthread_mutex_destroy(&ad->lock);
+    free(ad);
+}
+
+/* Starts a call on the context, the diagnostics of the modules go into its message */
+static void enter(struct avrdis *ad)
+{
+    pthread_mutex_lock(&ad->lock);
+    captureerrors(ad->message, sizeof(ad->message));
+}
+
+static int leave(struct avrdis *ad, int err)
+{
+    captureerrors(NULL, 0);
+
+    /* The modules report the failed allocations by the message only */
+    if (err != AVRDIS_OK && !strncmp(ad->message, "Error allocating memory", 23))
+        err = AVRDIS_ENOMEM;
+    if (err == AVRDIS_ECALLBACK || (err != AVRDIS_OK && !*ad->message))
+        snprintf(ad->message, sizeof(ad->message), "%s\n", errors[err]);
+    pthread_mutex_unlock(&ad->lock);
+    return err;
+}
+
+int avrdisparseihex(struct avrdis *ad, const char *buf, size_t len)
+{
+    struct regionstruct *enaregs;
+
+    if (!ad || !buf)
+        return AVRDIS_EINVAL;
+    enter(ad);
+
+    dropimage(ad);
+    if ((enaregs = allocregions()) == NULL)
+        return leave(ad, AVRDIS_ENOMEM);
+    freeregions(ad->enaregs);
+    ad->enaregs = enaregs;
+
+    if (!parseihexbuffer(buf, len, INPUT_NAME, ad->arena, &ad->wl))
+        return leave(ad, AVRDIS_EINPUT);
+    return leave(ad, AVRDIS_OK);
+}
+
+int avrdisenable(struct avrdis *ad, uint32_t begin, uint32_t end)
+{
+    if (!ad || begin > end)
+        return AVRDIS_EINVAL;
+    enter(ad);
+
+    /* The analysis done already does not know about the region */
+    if (ad->an)
+        freeanalysis(ad->an);
+    ad->an = NULL;
+
+    if (!addregion(ad->enaregs, begin, end))
+        return leave(ad, AVRDIS_ENOMEM);
+    return leave(ad, AVRDIS_OK);
+}
+
+int avrdisanalyze(struct avrdis *ad, const struct avrdisoptions *opts)
+{
+    struct avrdisoptions defaults;
+
+    if (!ad)
+        return AVRDIS_EINVAL;
+    if (!opts) {
+        avrdisdefaults(&defaults);
+        opts = &defaults;
+    }
+    if (opts->format < AVRDIS_FORMAT_ASM || opts->format > AVRDIS_FORMAT_BIN || opts->jobs < 0 ||
+        (opts->range && opts->rangebegin > opts->rangeend))
+        return AVRDIS_EINVAL;
+    enter(ad);
+
+    if (!ad->wl)
+        return leave(ad, AVRDIS_ESTATE);
+    if (ad->an)
+        freeanalysis(ad->an);
+    ad->an = NULL;
+
+    memset(&ad->opts, 0, sizeof(struct options));
+    ad->opts.listing = opts->format == AVRDIS_FORMAT_LISTING;
+    ad->opts.format = opts->format == AVRDIS_FORMAT_JSONL ? FORMAT_JSONL :
+                      opts->format == AVRDIS_FORMAT_BIN ? FORMAT_BIN : FORMAT_ASM;
+    ad->opts.jobs = opts->jobs;
+    ad->opts.functions = opts->functions;
+    ad->opts.deadstores = opts->deadstores;
+    ad->opts.loops = opts->loops;
+    ad->opts.scores = opts->scores;
+    ad->opts.compactdata = opts->compactdata;
+    ad->opts.enablethreshold = opts->enablethreshold;
+    ad->opts.range = opts->range;
+    ad->opts.rangebegin = opts->rangebegin;
+    ad->opts.rangeend = opts->rangeend;
+    ad->opts.timebudget = opts->timebudget;
+    ad->opts.indexstep = 256;
+
+    if ((ad->an = allocanalysis(ad->wl, ad->enaregs, &ad->opts)) == NULL)
+        return leave(ad, AVRDIS_EANALYSIS);
+    return leave(ad, AVRDIS_OK);
+}
+
+/* Adapt the callbacks of the renderer, those return 1 to go on */
+static int passtext(void *arg, const char *buf, size_t len)
+{
+    struct avrdis *ad = arg;
+
+    if (ad->textfn(ad->arg, buf, len))
+        ad->stopped = 1;
+    return !ad->stopped;
+}
+
+static int passinstr(void *arg, const struct instrrecord *ir)
+{
+    struct avrdis *ad = arg;
+    struct avrdisinstr in;
+
+    in.wordaddress = ir->wordaddress;
+    in.target = ir->target;
+    in.words[0] = ir->words[0];
+    in.words[1] = ir->size == 2 ? ir->words[1] : 0;
+    in.size = ir->size;
+    in.region = ir->region;
+    in.flow = ir->flow;
+    in.hastarget = ir->hastarget;
+    in.text = ir->text;
+    in.textlen = ir->textlen;
+    in.label = ir->label;
+
+    if (ad->instrfn(ad->arg, &in))
+        ad->stopped = 1;
+    return !ad->stopped;
+}
+
+int avrdisinstrs(struct avrdis *ad, int (*fn)(void *arg, const struct avrdisinstr *in), void *arg)
+{
+    int res;
+
+    if (!ad || !fn)
+        return AVRDIS_EINVAL;
+    enter(ad);
+
+    if (!ad->an)
+        return leave(ad, AVRDIS_ESTATE);
+    ad->instrfn = fn;
+    ad->arg = arg;
+    ad->stopped = 0;
+    res = renderrecords(ad->an, ad->enaregs, &ad->opts, passinstr, ad);
+
+    if (ad->stopped)
+        return leave(ad, AVRDIS_ECALLBACK);
+    return leave(ad, res ? AVRDIS_OK : AVRDIS_EOUTPUT);
+}
+
+int avrdisrender(struct avrdis *ad, int (*fn)(void *arg, const char *buf, size_t len), void *arg)
+{
+    int res;
+
+    if (!ad || !fn)
+        return AVRDIS_EINVAL;
+    enter(ad);
+
+    if (!ad->an)
+        return leave(ad, AVRDIS_ESTATE);
+    ad->textfn = fn;
+    ad->arg = arg;
+    ad->stopped = 0;
+    res = renderanalysis(ad->an, ad->enaregs, &ad->opts, passtext, ad, NULL);
+
+    if (ad->stopped)
+        return leave(ad, AVRDIS_ECALLBACK);
+    return leave(ad, res ? AVRDIS_OK : AVRDIS_EOUTPUT);
+}
+
+const char *avrdismessage(struct avrdis *ad)
+{
+    return ad->message;
+}
+
+const char *avrdisstrerror(int err)
+{
+    if (err < AVRDIS_OK || err > AVRDIS_ECALLBACK)
+        return "Unknown error";
+    return errors[err];
+}
@@ -0,0 +1,119 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Public header of the avrdis library, disassembles ihex images held in
+ *     memory through a context object. The calls return error codes instead
+ *     of printing, and the contexts share no state, so a process can work on
+ *     many images on many threads at once.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#ifndef _LIBAVRDIS_H_
+#define _LIBAVRDIS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum avrdiserror {
+    AVRDIS_OK = 0,
+    AVRDIS_ENOMEM,          /* Out of memory */
+    AVRDIS_EINPUT,          /* Malformed image */
+    AVRDIS_EINVAL,          /* Invalid argument */
+    AVRDIS_ESTATE,          /* No image parsed or not analyzed yet */
+    AVRDIS_EANALYSIS,       /* The analysis of the image failed */
+    AVRDIS_EOUTPUT,         /* Rendering the output failed */
+    AVRDIS_ECALLBACK        /* The callback asked to stop */
+};
+
+enum avrdisformat {
+    AVRDIS_FORMAT_ASM,      /* AVRASM source */
+    AVRDIS_FORMAT_LISTING,  /* Listing with the disabled regions, word addresses and raw words */
+    AVRDIS_FORMAT_JSONL,    /* A JSON object per instruction per line */
+    AVRDIS_FORMAT_BIN       /* Fixed size binary records with a string table */
+};
+
+/* Same values as the "region" of the records */
+enum avrdisregion {
+    AVRDIS_REGION_CODE,     /* Code found by the label collection */
+    AVRDIS_REGION_ENABLED,  /* In an enabled region */
+    AVRDIS_REGION_DATA      /* In a disabled region */
+};
+
+/* Same values as the "flow" of the binary records */
+enum avrdisflow {
+    AVRDIS_FLOW_NONE,       /* Continues with the next instruction */
+    AVRDIS_FLOW_SKIP,       /* Conditionally skips the next instruction */
+    AVRDIS_FLOW_BRANCH,     /* Conditional relative branch */
+    AVRDIS_FLOW_JUMP,       /* Unconditional jump */
+    AVRDIS_FLOW_CALL,       /* Subroutine call */
+    AVRDIS_FLOW_RET,        /* Return from subroutine or interrupt */
+    AVRDIS_FLOW_IJUMP,      /* Indirect jump, target unknown */
+    AVRDIS_FLOW_ICALL       /* Indirect call, target unknown */
+};
+
+struct avrdisoptions {
+    int format;             /* One of enum avrdisformat */
+    int jobs;               /* Rendering threads, 0 for one per processor */
+    int functions;          /* Name function entry points with function labels */
+    int deadstores;         /* Annotate the instructions writing registers never read */
+    int loops;              /* Annotate the loop headers */
+    int scores;             /* Print code-probability scores of disabled regions in the listing */
+    int compactdata;        /* Write the data words as strings, fills and rows in the source */
+    int enablethreshold;    /* Enable disabled regions scoring at least this, -1 when off */
+    int range;              /* Render the words between rangebegin and rangeend only */
+    uint32_t rangebegin;
+    uint32_t rangeend;
+    int timebudget;         /* Milliseconds the analysis may take, -1 when unlimited */
+};
+
+/* An instruction, or a data word, valid during the callback only */
+struct avrdisinstr {
+    uint32_t wordaddress;
+    uint32_t target;        /* Only when hastarget is set */
+    uint16_t words[2];      /* The second one only for 32-bit opcodes */
+    int size;               /* Size in words */
+    int region;             /* One of enum avrdisregion */
+    int flow;               /* One of enum avrdisflow */
+    int hastarget;
+    const char *text;       /* Mnemonic and operands, not terminated */
+    size_t textlen;
+    const char *label;      /* NULL when none */
+};
+
+struct avrdis;
+
+/* The calls exported by the shared library, the internal symbols are hidden in it */
+#define AVRDIS_API __attribute__((visibility("default")))
+
+/* The defaults of the command line */
+AVRDIS_API void avrdisdefaults(struct avrdisoptions *opts);
+
+AVRDIS_API struct avrdis *allocavrdis(void);
+AVRDIS_API void freeavrdis(struct avrdis *ad);
+
+/* Parses the ihex text in buf, replacing the image and the enabled regions of the context */
+AVRDIS_API int avrdisparseihex(struct avrdis *ad, const char *buf, size_t len);
+
+/* Enables disassembly of a disabled region, like -e, before the analysis */
+AVRDIS_API int avrdisenable(struct avrdis *ad, uint32_t begin, uint32_t end);
+
+/* Analyzes the image, opts NULL for the defaults */
+AVRDIS_API int avrdisanalyze(struct avrdis *ad, const struct avrdisoptions *opts);
+
+/* Passes the instructions to fn in address order, fn returns nonzero to stop */
+AVRDIS_API int avrdisinstrs(struct avrdis *ad, int (*fn)(void *arg, const struct avrdisinstr *in), void *arg);
+
+/* Passes the output text to fn in big chunks, fn returns nonzero to stop */
+AVRDIS_API int avrdisrender(struct avrdis *ad, int (*fn)(void *arg, const char *buf, size_t len), void *arg);
+
+/* The diagnostics of the last call on the context, empty when there was none */
+AVRDIS_API const char *avrdismessage(struct avrdis *ad);
+AVRDIS_API const char *avrdisstrerror(int err);
+
+#endif /* _LIBAVRDIS_H_ */
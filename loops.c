@@ -0,0 +1,517 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Loop module for the avrdis project, computes the dominator tree of the
+ *     control flow graph, finds the natural loops and their nesting, and
+ *     estimates the iteration counts of the common loop idioms.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "avrdis.h"
+
+#define MAX_REACHING_DEFS 4
+
+struct loopforest *allocloops(void)
+{
+    struct loopforest *lf = malloc(sizeof(struct loopforest));
+
+    if (lf)
+        memset(lf, 0, sizeof(struct loopforest));
+    return lf;
+}
+
+void freeloops(struct loopforest *lf)
+{
+    size_t i;
+
+    for (i = 0; i < lf->loopcount; i++)
+        free(lf->loops[i].blocks);
+    free(lf->loops);
+    free(lf->idom);
+    free(lf);
+}
+
+/* Tells if block a dominates block b */
+int dominates(struct loopforest *lf, size_t a, size_t b)
+{
+    for (; b != CFG_NONE; b = lf->idom[b])
+        if (b == a)
+            return 1;
+    return 0;
+}
+
+/*
+ * Numbers the blocks in postorder with a depth first search from the blocks
+ * without predecessors, then from the ones left unvisited in address order.
+ * Returns the blocks in reverse postorder, and the roots of the search are
+ * marked dominated by the virtual root.
+ */
+static void postorder(struct cfg *g, size_t *po, size_t *rpo, size_t *idom, size_t *stack, size_t *edge)
+{
+    size_t b, root, s, sp, n = 0, pass;
+
+    for (b = 0; b < g->blockcount; b++)
+        po[b] = CFG_NONE;
+
+    for (pass = 0; pass < 2; pass++)
+        for (root = 0; root < g->blockcount; root++) {
+            if (po[root] != CFG_NONE || (!pass && g->predoff[root] != g->predoff[root+1]))
+                continue;
+
+            sp = 0;
+            stack[sp] = root;
+            edge[sp++] = g->succoff[root];
+            po[root] = g->blockcount;   /* Visited, not yet numbered */
+            idom[root] = g->blockcount;
+
+            while (sp) {
+                b = stack[sp-1];
+                if (edge[sp-1] < g->succoff[b+1]) {
+                    s = g->succ[edge[sp-1]++];
+                    if (po[s] == CFG_NONE) {
+                        po[s] = g->blockcount;
+                        stack[sp] = s;
+                        edge[sp++] = g->succoff[s];
+                    }
+                } else {
+                    rpo[g->blockcount - 1 - n] = b;
+                    po[b] = n++;
+                    sp--;
+                }
+            }
+        }
+}
+
+/*
+ * Computes the immediate dominators with the iterative algorithm of Cooper,
+ * Harvey and Kennedy. The roots of the search are dominated by a virtual
+ * root only, their immediate dominator is CFG_NONE.
+ */
+static int dominators(struct cfg *g, struct loopforest *lf)
+{
+    size_t *po, *rpo, *stack, *edge, *idom;
+    size_t i, b, p, e, f1, f2, newidom, root = g->blockcount;
+    int changed, res = 0;
+
+    po = malloc((g->blockcount + 1) * sizeof(size_t));
+    rpo = malloc((g->blockcount + 1) * sizeof(size_t));
+    stack = malloc((g->blockcount + 1) * sizeof(size_t));
+    edge = malloc((g->blockcount + 1) * sizeof(size_t));
+    idom = lf->idom = malloc((g->blockcount + 1) * sizeof(size_t));
+    if (!po || !rpo || !stack || !edge || !idom) {
+        errmsg("Error allocating memory\n");
+        goto out;
+    }
+
+    /* The virtual root comes last in postorder */
+    for (b = 0; b <= g->blockcount; b++)
+        idom[b] = CFG_NONE;
+    postorder(g, po, rpo, idom, stack, edge);
+    po[root] = g->blockcount;
+    idom[root] = root;
+
+    do {
+        changed = 0;
+        for (i = 0; i < g->blockcount; i++) {
+            b = rpo[i];
+            if (idom[b] == root)
+                continue;
+
+            newidom = CFG_NONE;
+            for (e = g->predoff[b]; e < g->predoff[b+1]; e++) {
+                if (idom[p = g->pred[e]] == CFG_NONE)
+                    continue;
+                if (newidom == CFG_NONE) {
+                    newidom = p;
+                    continue;
+                }
+
+                /* Intersect walking up the dominator tree */
+                for (f1 = p, f2 = newidom; f1 != f2;) {
+                    while (po[f1] < po[f2])
+                        f1 = idom[f1];
+                    while (po[f2] < po[f1])
+                        f2 = idom[f2];
+                }
+                newidom = f1;
+            }
+
+            if (newidom != CFG_NONE && idom[b] != newidom) {
+                idom[b] = newidom;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    for (b = 0; b < g->blockcount; b++)
+        if (idom[b] == root)
+            idom[b] = CFG_NONE;
+
+    res = 1;
+out:
+    free(edge);
+    free(stack);
+    free(rpo);
+    free(po);
+    return res;
+}
+
+static int sizecmp(const void *lhs, const void *rhs)
+{
+    size_t l = *(const size_t *) lhs;
+    size_t r = *(const size_t *) rhs;
+
+    return l < r ? -1 : l > r;
+}
+
+/* Tells if the block is in the body of the loop */
+int inloop(struct loop *lp, size_t block)
+{
+    return bsearch(&block, lp->blocks, lp->blockcount, sizeof(size_t), sizecmp) != NULL;
+}
+
+/*
+ * Collects the body of the natural loop with header h: the blocks reaching
+ * any of the latches, the sources of the back edges, without passing h.
+ */
+static int loopbody(struct cfg *g, struct loopforest *lf, size_t h, size_t *mark, size_t *stack)
+{
+    struct loop *lp = &lf->loops[lf->loopcount];
+    size_t sp = 0, b, e, i, n = 0, stamp = lf->loopcount;
+
+    memset(lp, 0, sizeof(struct loop));
+    lp->header = h;
+    lp->parent = CFG_NONE;
+    lp->tripcount = -1;
+
+    /* Seed with the latches, more of them leave the latch unknown */
+    mark[h] = stamp;
+    stack[sp++] = h;
+    for (e = g->predoff[h]; e < g->predoff[h+1]; e++) {
+        if (!dominates(lf, h, b = g->pred[e]))
+            continue;
+        lp->latch = n++ ? CFG_NONE : b;
+        if (mark[b] != stamp) {
+            mark[b] = stamp;
+            stack[sp++] = b;
+        }
+    }
+
+    /* Walk the predecessors backwards up to the header */
+    for (i = 1; i < sp; i++) {
+        b = stack[i];
+        for (e = g->predoff[b]; e < g->predoff[b+1]; e++)
+            if (mark[g->pred[e]] != stamp) {
+                mark[g->pred[e]] = stamp;
+                stack[sp++] = g->pred[e];
+            }
+    }
+
+    if ((lp->blocks = malloc(sp * sizeof(size_t))) == NULL)
+        return 0;
+    memcpy(lp->blocks, stack, sp * sizeof(size_t));
+    qsort(lp->blocks, sp, sizeof(size_t), sizecmp);
+    lp->blockcount = sp;
+    lf->loopcount++;
+
+    return 1;
+}
+
+/* Tells if the block has a back edge into it */
+static int loopheader(struct cfg *g, struct loopforest *lf, size_t h)
+{
+    size_t e;
+
+    for (e = g->predoff[h]; e < g->predoff[h+1]; e++)
+        if (dominates(lf, h, g->pred[e]))
+            return 1;
+    return 0;
+}
+
+static int isdec(uint16_t word)
+{
+    return (word & 0xfe0f) == 0x940a;
+}
+
+static int isbrne(uint16_t word)
+{
+    return (word & 0xfc07) == 0xf401;
+}
+
+static int isldi(uint16_t word)
+{
+    return (word & 0xf000) == 0xe000;
+}
+
+static int issbisorsbic(uint16_t word)
+{
+    return (word & 0xfd00) == 0x9900;
+}
+
+/* Tells if any instruction of the loop except the one given writes the register */
+static int writtenelsewhere(struct cfg *g, struct loop *lp, size_t instr, int reg)
+{
+    struct basicblock *bb;
+    size_t l, i;
+
+    for (l = 0; l < lp->blockcount; l++) {
+        bb = &g->blocks[lp->blocks[l]];
+        for (i = bb->first; i < bb->first + bb->count; i++)
+            if (i != instr && (g->instrs[i].def & REG(reg)))
+                return 1;
+    }
+    return 0;
+}
+
+/*
+ * Recognizes the counted loop idiom, the latch ending in dec Rd and brne to
+ * the header, with a single ldi Rd, K reaching the header from outside.
+ * Returns the iteration count, or -1 when the loop is not such.
+ */
+static long countedloop(struct cfg *g, struct loop *lp, struct reachingdefs *rd)
+{
+    struct basicblock *bb;
+    struct regdef defs[MAX_REACHING_DEFS];
+    size_t last, dec, n, i, ldi = CFG_NONE;
+    int reg, K;
+
+    if (lp->latch == CFG_NONE || !rd)
+        return -1;
+    bb = &g->blocks[lp->latch];
+    last = bb->first + bb->count - 1;
+    if (bb->count < 2 || !isbrne(g->instrs[last].word) ||
+        g->instrs[last].target != g->blocks[lp->header].begin ||
+        !isdec(g->instrs[dec = last-1].word))
+        return -1;
+
+    reg = (g->instrs[dec].word >> 4) & 0x1f;
+    if (writtenelsewhere(g, lp, dec, reg))
+        return -1;
+
+    n = reachingdefsof(g, rd, g->blocks[lp->header].first, reg, defs, MAX_REACHING_DEFS);
+    if (n == CFG_NONE || n > MAX_REACHING_DEFS)
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (defs[i].instr == dec)
+            continue;
+        if (defs[i].instr == CFG_NONE || !isldi(g->instrs[defs[i].instr].word) || ldi != CFG_NONE)
+            return -1;
+        ldi = defs[i].instr;
+    }
+    if (ldi == CFG_NONE)
+        return -1;
+
+    K = ((g->instrs[ldi].word >> 4) & 0xf0) | (g->instrs[ldi].word & 0x0f);
+    return K ? K : 256;
+}
+
+/* Recognizes the polling loop idiom, sbis or sbic followed by rjmp to the header */
+static int pollingloop(struct cfg *g, struct loop *lp)
+{
+    struct basicblock *bb;
+    size_t last;
+
+    if (lp->latch == CFG_NONE)
+        return 0;
+    bb = &g->blocks[lp->latch];
+    last = bb->first + bb->count - 1;
+    if (g->instrs[last].flow != FLOW_JUMP || g->instrs[last].size != 1 ||
+        g->instrs[last].target != g->blocks[lp->header].begin || !last)
+        return 0;
+    return g->instrs[last-1].wordaddress + 1 == g->instrs[last].wordaddress &&
+           issbisorsbic(g->instrs[last-1].word) && inloop(lp, g->blockof[last-1]);
+}
+
+/* Collects the blocks owned by the function f */
+static size_t functionblocks(struct cfg *g, size_t f, size_t *blocks)
+{
+    size_t b, n = 0;
+
+    for (b = 0; b < g->blockcount; b++)
+        if (g->blocks[b].func == f)
+            blocks[n++] = b;
+    return n;
+}
+
+/*
+ * Estimates the iteration counts using the reaching definitions of the
+ * owning functions. The blocks not owned by any function (eg. reached by
+ * indirect jumps only) are taken together.
+ */
+static int tripcounts(struct cfg *g, struct callgraph *cg, struct loopforest *lf, size_t *blocks)
+{
+    struct reachingdefs *rd = NULL;
+    struct loop *lp;
+    size_t i, f, func = 0, n;
+
+    for (i = 0; i < lf->loopcount; i++) {
+        lp = &lf->loops[i];
+
+        if (pollingloop(g, lp)) {
+            lp->polling = 1;
+            continue;
+        }
+
+        /* Reaching definitions are computed once for each function */
+        f = g->blocks[lp->header].func;
+        if (!rd || f != func) {
+            if (rd)
+                freereachingdefs(rd);
+            n = functionblocks(g, f, blocks);
+            if ((rd = reachingdefs(g, blocks, n, f != CFG_NONE ? cg->funcs[f].block : blocks[0])) == NULL)
+                return 0;
+            func = f;
+        }
+        lp->tripcount = countedloop(g, lp, rd);
+    }
+
+    if (rd)
+        freereachingdefs(rd);
+    return 1;
+}
+
+/*
+ * Finds the natural loops of the control flow graph in header address order,
+ * loops sharing a header are merged. The enclosing loop of a loop is the
+ * smallest other loop containing its header.
+ */
+int findloops(struct cfg *g, struct callgraph *cg, struct loopforest *lf)
+{
+    size_t *mark = NULL, *stack = NULL;
+    size_t h, i, j, n;
+    int res = 0;
+
+    if (!g->blockcount)
+        return 1;
+
+    if (!dominators(g, lf))
+        return 0;
+
+    mark = malloc(g->blockcount * sizeof(size_t));
+    stack = malloc(g->blockcount * sizeof(size_t));
+    if (!mark || !stack)
+        goto err_alloc;
+
+    for (h = 0, n = 0; h < g->blockcount; h++) {
+        mark[h] = CFG_NONE;
+        if (loopheader(g, lf, h))
+            n++;
+    }
+    if ((lf->loops = calloc(n + 1, sizeof(struct loop))) == NULL)
+        goto err_alloc;
+
+    for (h = 0; h < g->blockcount; h++)
+        if (loopheader(g, lf, h) && !loopbody(g, lf, h, mark, stack))
+            goto err_alloc;
+
+    /* Nesting */
+    for (i = 0; i < lf->loopcount; i++) {
+        for (j = 0; j < lf->loopcount; j++)
+            if (j != i && inloop(&lf->loops[j], lf->loops[i].header) &&
+                (lf->loops[i].parent == CFG_NONE ||
+                 lf->loops[j].blockcount < lf->loops[lf->loops[i].parent].blockcount))
+                lf->loops[i].parent = j;
+    }
+    for (i = 0; i < lf->loopcount; i++)
+        for (j = i; j != CFG_NONE; j = lf->loops[j].parent)
+            lf->loops[i].depth++;
+
+    if (!tripcounts(g, cg, lf, stack))
+        goto out;
+
+    res = 1;
+    goto out;
+
+err_alloc:
+    errmsg("Error allocating memory\n");
+out:
+    free(stack);
+    free(mark);
+    return res;
+}
+
+static char *iterations(struct cfg *g, struct loop *lp, char *buf)
+{
+    struct instrinfo *ii;
+
+    if (lp->tripcount >= 0)
+        sprintf(buf, "%ld iterations", lp->tripcount);
+    else if (lp->polling) {
+        ii = &g->instrs[g->blocks[lp->latch].first + g->blocks[lp->latch].count - 2];
+        sprintf(buf, "polls 0x%02x bit %d", (ii->word >> 3) & 0x1f, ii->word & 0x07);
+    } else
+        sprintf(buf, "unknown iterations");
+    return buf;
+}
+
+/* Annotates the loop headers with the nesting depth and the estimated iterations */
+int annotateloops(struct cfg *g, struct loopforest *lf, struct annotations *as)
+{
+    struct loop *lp;
+    char text[80], buf[40];
+    size_t i;
+
+    for (i = 0; i < lf->loopcount; i++) {
+        lp = &lf->loops[i];
+        sprintf(text, "loop depth %zu, %s", lp->depth, iterations(g, lp, buf));
+        if (!addannotation(as, g->blocks[lp->header].begin, text)) {
+            errmsg("Error allocating memory\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Writes the loops one per line: the header, the nesting depth, the header
+ * of the enclosing loop, the estimated iterations and the body as word
+ * address ranges.
+ */
+int writeloops(struct cfg *g, struct loopforest *lf, const char *filename)
+{
+    FILE *fp;
+    struct loop *lp;
+    size_t i, l;
+    char buf[40];
+
+    fp = fopen(filename, "w");
+    if (!fp) {
+        errmsg("Error opening file: %s\n", filename);
+        return 0;
+    }
+
+    for (i = 0; i < lf->loopcount; i++) {
+        lp = &lf->loops[i];
+        fprintf(fp, "loop 0x%04x depth %zu", g->blocks[lp->header].begin, lp->depth);
+        if (lp->parent != CFG_NONE)
+            fprintf(fp, " in 0x%04x", g->blocks[lf->loops[lp->parent].header].begin);
+        fprintf(fp, ", %s:", iterations(g, lp, buf));
+
+        /* Adjacent blocks are merged into a single range */
+        for (l = 0; l < lp->blockcount; l++) {
+            fprintf(fp, " 0x%04x", g->blocks[lp->blocks[l]].begin);
+            while (l+1 < lp->blockcount &&
+                   g->blocks[lp->blocks[l]].end + 1 == g->blocks[lp->blocks[l+1]].begin)
+                l++;
+            fprintf(fp, ":0x%04x", g->blocks[lp->blocks[l]].end);
+        }
+        fprintf(fp, "\n");
+    }
+
+    if (fclose(fp)) {
+        errmsg("Error writing file: %s\n", filename);
+        return 0;
+    }
+    return 1;
+}
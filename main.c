@@ -21,12 +21,6 @@
 
 #define VERSION "1.0.0"
 
-enum filetype {
-    FILETYPE_ERROR = -1,
-    FILETYPE_UNKNOWN,
-    FILETYPE_IHEX
-};
-
 const char *command;
 
 char *cmdname(char *path)
@@ -40,41 +34,6 @@ char *cmdname(char *path)
     return p;
 }
 
-char *fileextension(char *filename)
-{
-    char *p = filename;
-
-    while (*p) p++;
-    while (filename < p && *p != '.' && *p != '/' && *p != '\\') p--;
-    if (filename < p && *p == '.' && *(p+1) && *(p+1) != '/' && *(p+1) != '\\')
-        return p+1;
-
-    return NULL;
-}
-
-enum filetype deterfiletype(char *filename)
-{
-    int checks;
-    char *ext = fileextension(filename);
-
-    /* When file has an extension, determine file type by the extension */
-    if (ext) {
-        if (!strcmpnocase(ext, "hex"))
-            return FILETYPE_IHEX;
-        /* TODO: More extension types goes here below... */
-
-    }
-
-    /* Otherwise, try to infer type by its contents */
-    if ((checks = ihexfile(filename)) == -1)
-        return FILETYPE_ERROR;
-    if (checks)
-        return FILETYPE_IHEX;
-    /* TODO: More file type-checks goes here below... */
-
-    return FILETYPE_UNKNOWN;
-}
-
 void printusage(void)
 {
     fprintf(stderr, "AVR Disassembler for the 8-bit AVRs. v%s (c) Imre Horvath, 2023, 2024, 2025, 2026\n", VERSION);
@@ -84,9 +43,47 @@ void printusage(void)
 "  IHEX: Intel hex format, file should have an extension .hex\n" \
 "Options:\n" \
 "  -h : Show this usage info and exit.\n" \
+"  -o file : Write the output to file instead of the standard output.\n" \
 "  -l : List disabled regions, word addresses and raw instructions together with the disassembled code.\n" \
+"  --listing file : Write the listing to file too, in the same pass as the output.\n" \
+"  --gas file : Write GNU as source to file too, in the same pass as the output.\n" \
 "  -e nnnn:nnnn : Enable disassembly of otherwise disabled region. Multiple options are possible.\n" \
-"                 Use hex numbers. For reference, see listing of disabled regions in listing mode.\n"
+"                 Use hex numbers. For reference, see listing of disabled regions in listing mode.\n" \
+"  -E file : Enable the regions listed in file too, an nnnn:nnnn range per line, # starts a comment line.\n" \
+"  --range nnnn:nnnn : Output the instructions between the hex word addresses only, analyzing the whole image.\n" \
+"  --around nnnn:n : Output the n words before and after the hex word address only.\n" \
+"  --format=fmt : Output format, asm (default), jsonl for a JSON object per instruction per line,\n" \
+"                 or bin for fixed size binary records with a string table.\n" \
+"  --index file : Write the byte offsets of the output lines of the labels and sampled word addresses to file.\n" \
+"  --index-step n : Sample every n word addresses for the index. Defaults to 256.\n" \
+"  --jobs n : Render the output on n threads. Defaults to the number of processors.\n" \
+"  --compact-data : Write the data words in the sources as strings, skipped erased flash or fills,\n" \
+"                   and rows of up to 8 words, instead of a word per line.\n" \
+"  --split-dir dir : Write each function and each data region to a file of its own in dir,\n" \
+"                    with an index of the files in dir/index.txt.\n" \
+"  --batch : Disassemble each of the files given, or listed on stdin when none, into a file of its own,\n" \
+"            its extension replaced with .asm, .lst, .jsonl or .bin, on --jobs threads.\n" \
+"            The status of each file is printed to stdout.\n" \
+"  --serve path : Serve disassembly requests on the Unix domain socket at path on --jobs threads,\n" \
+"                 keeping the analyzed images cached, until interrupted.\n" \
+"  --watch : Write the output again whenever the inputfile or the -E file changes, until interrupted.\n" \
+"            The files are replaced atomically. Needs -o.\n" \
+"  -i : Explore the image interactively, reading commands from stdin, see help for them.\n" \
+"  --session file : Load the enabled and data regions, entry points, label names and comments\n" \
+"                   of the image from the session file. With -i, the changes are saved into it.\n" \
+"  --time-budget ms : Stop the analysis after ms milliseconds, writing the output of the part analyzed.\n" \
+"                     With --session, the next run goes on from where this one stopped.\n" \
+"  --symbols file : Name the labels after the symbols of an earlier build, read from avr-nm output\n" \
+"                   or a linker map file, and collect code from its functions and keep its data as data.\n" \
+"  --scores : In listing mode, show the estimated probability of being code for each disabled region.\n" \
+"  --enable-above nn : Enable disassembly of disabled regions scoring at least nn percent.\n" \
+"  --auto : Enable the disabled regions proven to be valid code one by one, until none is left.\n" \
+"           The resulting -e options are printed to stderr.\n" \
+"  --functions : Name the function entry points F_nnnn instead of the numbered local labels.\n" \
+"  --callgraph file : Export the call graph between the functions found in Graphviz DOT format.\n" \
+"  --dead-stores : Comment the instructions writing registers those are never read afterwards.\n" \
+"  --loops : Comment the loop headers with the nesting depth and the estimated iteration count.\n" \
+"  --loop-file file : Export the loops with their headers, nesting, iteration counts and bodies.\n"
 
     fprintf(stderr, USAGE_DESCRIPTION);
 }
@@ -94,11 +91,17 @@ void printusage(void)
 int main(int argc, char **argv)
 {
     int res = 1;    /* Default to error */
-    int i, listing = 0;
-    char *filename = NULL;
+    int i;
+    char *filename = NULL, **filenames;
+    size_t nfiles = 0;
     struct wordlist *wl = NULL;
+    struct arena *arena = NULL;
+    struct session *session = NULL;
+    struct symbols *symbols = NULL;
+    struct region *r;
     struct regionstruct *enaregs;
     uint32_t begin, end;
+    struct options opts = { .output = NULL, .listing = 0, .listingfile = NULL, .gasfile = NULL, .jobs = 0, .format = FORMAT_ASM, .scores = 0, .enablethreshold = -1, .functions = 0, .callgraph = NULL, .deadstores = 0, .autoenable = 0, .loops = 0, .loopfile = NULL, .range = 0, .indexfile = NULL, .indexstep = 256, .compactdata = 0, .splitdir = NULL, .batch = 0, .socket = NULL, .interactive = 0, .regionsfile = NULL, .watch = 0, .sessionfile = NULL, .session = NULL, .timebudget = -1, .resume = NULL, .symbolsfile = NULL, .symbols = NULL };
 
     command = cmdname(argv[0]);
 
@@ -113,15 +116,41 @@ int main(int argc, char **argv)
         goto err;
     }
 
+    filenames = malloc(argc * sizeof(char *));
+    if (!filenames) {
+        fprintf(stderr, "Error allocating memory\n");
+        goto err_files;
+    }
+
     for (i = 1; i < argc; i++) {
         if (*argv[i] == '-') {
             /* Process options */
             if (!strcmp(argv[i], "-l"))
-                listing = 1;
-            else if (!strcmp(argv[i], "-h")) {
+                opts.listing = 1;
+            else if (!strcmp(argv[i], "-o")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option -o missing.\n");
+                    goto err_reg;
+                }
+                opts.output = argv[++i];
+            } else if (!strcmp(argv[i], "--listing")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option --listing missing.\n");
+                    goto err_reg;
+                }
+                opts.listingfile = argv[++i];
+            } else if (!strcmp(argv[i], "--gas")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option --gas missing.\n");
+                    goto err_reg;
+                }
+                opts.gasfile = argv[++i];
+            } else if (!strcmp(argv[i], "-h")) {
                 printusage();
                 goto out;
-            } else if (!strcmp(argv[i], "-e")) {
+            } else if (!strcmp(argv[i], "-i"))
+                opts.interactive = 1;
+            else if (!strcmp(argv[i], "-e")) {
                 if (i+1 >= argc) {
                     fprintf(stderr, "Address after option -e missing.\n");
                     goto err_reg;
@@ -139,50 +168,278 @@ int main(int argc, char **argv)
                     fprintf(stderr, "Error allocating memory\n");
                     goto err_reg;
                 }
+            } else if (!strcmp(argv[i], "-E")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option -E missing.\n");
+                    goto err_reg;
+                }
+                opts.regionsfile = argv[++i];
+            } else if (!strcmp(argv[i], "--range")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Address after option --range missing.\n");
+                    goto err_reg;
+                }
+                i++;
+                if (sscanf(argv[i], "%x:%x", &opts.rangebegin, &opts.rangeend) != 2) {
+                    fprintf(stderr, "Option --range : Failed to parse a hex memory address range.\n");
+                    goto err_reg;
+                }
+                if (opts.rangebegin > opts.rangeend) {
+                    fprintf(stderr, "Option --range : Starting address must be smaller or equal than end address.\n");
+                    goto err_reg;
+                }
+                opts.range = 1;
+            } else if (!strcmp(argv[i], "--around")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Address after option --around missing.\n");
+                    goto err_reg;
+                }
+                i++;
+                if (sscanf(argv[i], "%x:%u", &begin, &end) != 2) {
+                    fprintf(stderr, "Option --around : Failed to parse a hex memory address and a word count.\n");
+                    goto err_reg;
+                }
+                opts.rangebegin = begin > end ? begin - end : 0;
+                opts.rangeend = begin + end < begin ? UINT32_MAX : begin + end;
+                opts.range = 1;
+            } else if (!strcmp(argv[i], "--index")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option --index missing.\n");
+                    goto err_reg;
+                }
+                opts.indexfile = argv[++i];
+            } else if (!strcmp(argv[i], "--index-step")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Number after option --index-step missing.\n");
+                    goto err_reg;
+                }
+                i++;
+                if (sscanf(argv[i], "%u", &opts.indexstep) != 1 || opts.indexstep < 1) {
+                    fprintf(stderr, "Option --index-step : Failed to parse a positive number.\n");
+                    goto err_reg;
+                }
+            } else if (!strcmp(argv[i], "--jobs")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Number after option --jobs missing.\n");
+                    goto err_reg;
+                }
+                i++;
+                if (sscanf(argv[i], "%d", &opts.jobs) != 1 || opts.jobs < 1) {
+                    fprintf(stderr, "Option --jobs : Failed to parse a positive number.\n");
+                    goto err_reg;
+                }
+            } else if (!strncmp(argv[i], "--format=", 9)) {
+                if (!strcmp(argv[i]+9, "asm"))
+                    opts.format = FORMAT_ASM;
+                else if (!strcmp(argv[i]+9, "jsonl"))
+                    opts.format = FORMAT_JSONL;
+                else if (!strcmp(argv[i]+9, "bin"))
+                    opts.format = FORMAT_BIN;
+                else {
+                    fprintf(stderr, "Option --format : Unknown format %s\n", argv[i]+9);
+                    goto err_reg;
+                }
+            } else if (!strcmp(argv[i], "--compact-data"))
+                opts.compactdata = 1;
+            else if (!strcmp(argv[i], "--scores"))
+                opts.scores = 1;
+            else if (!strcmp(argv[i], "--enable-above")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Percentage after option --enable-above missing.\n");
+                    goto err_reg;
+                }
+                i++;
+                if (sscanf(argv[i], "%d", &opts.enablethreshold) != 1 ||
+                    opts.enablethreshold < 0 || opts.enablethreshold > 100) {
+                    fprintf(stderr, "Option --enable-above : Failed to parse a percentage between 0 and 100.\n");
+                    goto err_reg;
+                }
+            } else if (!strcmp(argv[i], "--auto"))
+                opts.autoenable = 1;
+            else if (!strcmp(argv[i], "--dead-stores"))
+                opts.deadstores = 1;
+            else if (!strcmp(argv[i], "--functions"))
+                opts.functions = 1;
+            else if (!strcmp(argv[i], "--callgraph")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option --callgraph missing.\n");
+                    goto err_reg;
+                }
+                opts.callgraph = argv[++i];
+            } else if (!strcmp(argv[i], "--loops"))
+                opts.loops = 1;
+            else if (!strcmp(argv[i], "--loop-file")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option --loop-file missing.\n");
+                    goto err_reg;
+                }
+                opts.loopfile = argv[++i];
+            } else if (!strcmp(argv[i], "--split-dir")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Directory after option --split-dir missing.\n");
+                    goto err_reg;
+                }
+                opts.splitdir = argv[++i];
+            } else if (!strcmp(argv[i], "--batch"))
+                opts.batch = 1;
+            else if (!strcmp(argv[i], "--watch"))
+                opts.watch = 1;
+            else if (!strcmp(argv[i], "--session")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option --session missing.\n");
+                    goto err_reg;
+                }
+                opts.sessionfile = argv[++i];
+            } else if (!strcmp(argv[i], "--symbols")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Filename after option --symbols missing.\n");
+                    goto err_reg;
+                }
+                opts.symbolsfile = argv[++i];
+            } else if (!strcmp(argv[i], "--time-budget")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Number after option --time-budget missing.\n");
+                    goto err_reg;
+                }
+                i++;
+                if (sscanf(argv[i], "%d", &opts.timebudget) != 1 || opts.timebudget < 0) {
+                    fprintf(stderr, "Option --time-budget : Failed to parse a non-negative number.\n");
+                    goto err_reg;
+                }
+            }
+            else if (!strcmp(argv[i], "--serve")) {
+                if (i+1 >= argc) {
+                    fprintf(stderr, "Path after option --serve missing.\n");
+                    goto err_reg;
+                }
+                opts.socket = argv[++i];
             } else {
                 fprintf(stderr, "Invalid option %s\n", argv[i]);
                 goto err_reg;
             }
         } else {
-            /* Process arguments */
-            if (!filename)
-                filename = argv[i];
-            else {
-                fprintf(stderr, "%s expects a single filename\n", command);
-                goto err_reg;
-            }
+            /* Process arguments, only the batch takes more */
+            filenames[nfiles++] = argv[i];
+        }
+    }
+
+    if (opts.batch || opts.socket || opts.interactive) {
+        if (opts.output || opts.listingfile || opts.gasfile || opts.indexfile || opts.callgraph ||
+            opts.loopfile || opts.splitdir || opts.autoenable || opts.watch ||
+            ((opts.batch || opts.socket) && (opts.sessionfile || opts.symbolsfile)) || opts.batch + !!opts.socket + opts.interactive > 1) {
+            fprintf(stderr, "Option %s : Only the options of the output format are allowed.\n",
+                    opts.batch ? "--batch" : opts.socket ? "--serve" : "-i");
+            goto err_reg;
         }
     }
 
+    /* The watch reads the regions file again after each change */
+    if (opts.regionsfile && !opts.watch && !parseregionsfile(opts.regionsfile, enaregs))
+        goto err_reg;
+
+    if (opts.symbolsfile && (opts.symbols = symbols = loadsymbols(opts.symbolsfile)) == NULL)
+        goto err_reg;
+
+    if (opts.socket) {
+        if (nfiles) {
+            fprintf(stderr, "Option --serve : The images come with the requests.\n");
+            goto err_reg;
+        }
+        if (!runserver(opts.socket, enaregs, &opts))
+            goto err_reg;
+        goto out;
+    }
+
+    if (opts.batch) {
+        if (!runbatch(filenames, nfiles, enaregs, &opts))
+            goto err_reg;
+        goto out;
+    }
+
+    if (nfiles > 1) {
+        fprintf(stderr, "%s expects a single filename\n", command);
+        goto err_reg;
+    }
+    filename = nfiles ? filenames[0] : NULL;
+
+    if (opts.splitdir && opts.format != FORMAT_ASM) {
+        fprintf(stderr, "Option --split-dir : Only the asm format can be split.\n");
+        goto err_reg;
+    }
+
     if (!filename) {
         fprintf(stderr, "No filename specified\n");
         goto err_reg;
     }
 
-    switch (deterfiletype(filename)) {
-        case FILETYPE_ERROR:
+    if (opts.watch) {
+        if (!opts.output || opts.splitdir || opts.sessionfile) {
+            fprintf(stderr, "Option --watch : An output file is needed, it can not be split, and there is no session.\n");
             goto err_reg;
-        case FILETYPE_UNKNOWN:
-            fprintf(stderr, "Unknown file type %s\n", filename);
+        }
+        if (!runwatch(filename, enaregs, &opts))
             goto err_reg;
+        goto out;
+    }
 
-        case FILETYPE_IHEX:
-            if (!parseihexfile(filename, &wl))
-                goto err_reg;
-            break;
+    if ((arena = allocarena()) == NULL) {
+        fprintf(stderr, "Error allocating memory\n");
+        goto err_reg;
+    }
+    if (!parsefile(filename, arena, &wl))
+        goto err_emit;
+
+    /*
+     * The regions enabled in the session are enabled as if given with -e, the
+     * interactive session can be new, and so can the one of the budgeted runs
+     */
+    if (opts.sessionfile) {
+        if ((session = opensession(opts.sessionfile, wl, opts.interactive || opts.timebudget >= 0)) == NULL)
+            goto err_emit;
+        for (r = session->enaregs->first; r; r = r->next)
+            if (!addregion(enaregs, r->begin, r->end)) {
+                fprintf(stderr, "Error allocating memory\n");
+                goto err_emit;
+            }
+        opts.session = session;
+        if (!opts.interactive && opts.timebudget >= 0)
+            opts.resume = session;
+    }
 
-        /* TODO: Other file types goes here... */
+    if (opts.interactive) {
+        if (opts.format == FORMAT_BIN) {
+            fprintf(stderr, "Option -i : The bin format can not be listed.\n");
+            goto err_emit;
+        }
+        if (!session && (session = allocsession()) == NULL) {
+            fprintf(stderr, "Error allocating memory\n");
+            goto err_emit;
+        }
+        if (!runrepl(wl, enaregs, session, &opts))
+            goto err_emit;
+        goto out;
     }
 
-    if (!emitavrasm(wl, enaregs, listing))
+    if (!emitavrasm(wl, enaregs, &opts, NULL))
+        goto err_emit;
+
+    /* The walk stopped by the time budget, or its end, goes into the session */
+    if (opts.resume && !storesession(opts.sessionfile, session))
         goto err_emit;
 
 out:
     res = 0;    /* Success */
 
 err_emit:
-    freewordlist(wl);
+    if (session)
+        freesession(session);
+    if (arena)
+        freearena(arena);
 err_reg:
+    if (symbols)
+        freesymbols(symbols);
+    free(filenames);
+err_files:
     freeregions(enaregs);
 err:
     return res;
@@ -0,0 +1,246 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Output buffer module for the avrdis project, collects the generated
+ *     text in a large buffer with a minimal formatter, and writes it out to
+ *     a file descriptor or passes it to a callback in big chunks, or keeps
+ *     all of it in memory.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "avrdis.h"
+
+#define OUTBUF_SIZE (256 * 1024)
+
+static const char hexdigits[] = "0123456789abcdef";
+static const char spaces[] = "                                                                ";
+
+/* Allocates a buffer writing to fd, or growing in memory when fd is negative */
+struct outbuf *allocoutbuf(int fd)
+{
+    struct outbuf *ob = malloc(sizeof(struct outbuf));
+
+    if (!ob)
+        return NULL;
+    memset(ob, 0, sizeof(struct outbuf));
+
+    if ((ob->buf = malloc(OUTBUF_SIZE)) == NULL) {
+        free(ob);
+        return NULL;
+    }
+    ob->size = OUTBUF_SIZE;
+    ob->fd = fd;
+    return ob;
+}
+
+void freeoutbuf(struct outbuf *ob)
+{
+    free(ob->buf);
+    free(ob);
+}
+
+/* Empties the buffer for writing to fd from the start again, keeping its memory */
+void resetoutbuf(struct outbuf *ob, int fd)
+{
+    ob->fd = fd;
+    ob->err = 0;
+    ob->len = 0;
+    ob->pos = 0;
+    ob->flush = NULL;
+    ob->arg = NULL;
+}
+
+/* Gives back the memory of a buffer grown past its initial size, when empty */
+void shrinkoutbuf(struct outbuf *ob)
+{
+    char *buf;
+
+    if (ob->len || ob->size <= OUTBUF_SIZE || (buf = realloc(ob->buf, OUTBUF_SIZE)) == NULL)
+        return;
+    ob->buf = buf;
+    ob->size = OUTBUF_SIZE;
+}
+
+/* Writes out the buffered text, returns 0 when any of the writes so far failed */
+int flushoutbuf(struct outbuf *ob)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    if (ob->flush) {
+        if (!ob->err && ob->len && !ob->flush(ob->arg, ob->buf, ob->len))
+            ob->err = 1;
+        ob->pos += ob->len;
+        ob->len = 0;
+        return !ob->err;
+    }
+    if (ob->fd < 0)
+        return !ob->err;
+
+    while (!ob->err && done < ob->len) {
+        if ((n = write(ob->fd, ob->buf + done, ob->len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            ob->err = 1;
+            break;
+        }
+        done += n;
+    }
+    ob->pos += ob->len;
+    ob->len = 0;
+    return !ob->err;
+}
+
+/* Makes room for at least n more bytes, returns the room available */
+size_t obreserve(struct outbuf *ob, size_t n)
+{
+    char *buf;
+    size_t size;
+
+    if (ob->size - ob->len >= n)
+        return ob->size - ob->len;
+
+    if (ob->fd >= 0 || ob->flush)
+        flushoutbuf(ob);
+    else if (!ob->err) {
+        for (size = 2 * ob->size; size - ob->len < n; size *= 2);
+        if ((buf = realloc(ob->buf, size)) == NULL)
+            ob->err = 1;
+        else {
+            ob->buf = buf;
+            ob->size = size;
+        }
+    }
+    return ob->size - ob->len;
+}
+
+void obwrite(struct outbuf *ob, const char *s, size_t n)
+{
+    size_t chunk;
+
+    while (n) {
+        if (ob->len == ob->size && !obreserve(ob, 1))
+            return;
+        chunk = ob->size - ob->len < n ? ob->size - ob->len : n;
+        memcpy(ob->buf + ob->len, s, chunk);
+        ob->len += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+}
+
+void obputs(struct outbuf *ob, const char *s)
+{
+    if (!s)
+        s = "(null)";   /* As printf does */
+    obwrite(ob, s, strlen(s));
+}
+
+void obputc(struct outbuf *ob, char c)
+{
+    if (ob->len == ob->size && !obreserve(ob, 1))
+        return;
+    ob->buf[ob->len++] = c;
+}
+
+void obpad(struct outbuf *ob, size_t n)
+{
+    size_t chunk;
+
+    for (; n; n -= chunk) {
+        chunk = n < sizeof(spaces) - 1 ? n : sizeof(spaces) - 1;
+        obwrite(ob, spaces, chunk);
+    }
+}
+
+/* Writes v in lowercase hex, zero padded to width digits */
+void obhex(struct outbuf *ob, unsigned int v, int width)
+{
+    char digits[8];
+    int n = 0;
+
+    do {
+        digits[n++] = hexdigits[v & 0xf];
+        v >>= 4;
+    } while (v && n < 8);
+    while (n < width && n < 8)
+        digits[n++] = '0';
+    while (n)
+        obputc(ob, digits[--n]);
+}
+
+static void obdec(struct outbuf *ob, unsigned int u, int negative)
+{
+    char digits[12];
+    int n = 0;
+
+    do {
+        digits[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (negative)
+        digits[n++] = '-';
+    while (n)
+        obputc(ob, digits[--n]);
+}
+
+/*
+ * Formats into the buffer like printf, knowing only the conversions the
+ * generator uses: %d, %u, %s, %c and %x with an optional zero padded width.
+ */
+void obfmt(struct outbuf *ob, const char *fmt, ...)
+{
+    va_list ap;
+    const char *p;
+    int width, d;
+
+    va_start(ap, fmt);
+    for (p = fmt; *p; p++) {
+        if (*p != '%') {
+            obputc(ob, *p);
+            continue;
+        }
+
+        for (width = 0, p++; *p >= '0' && *p <= '9'; p++)
+            width = 10 * width + *p - '0';
+
+        switch (*p) {
+            case 'd':
+                d = va_arg(ap, int);
+                obdec(ob, d < 0 ? -(unsigned int) d : (unsigned int) d, d < 0);
+                break;
+            case 'u':
+                obdec(ob, va_arg(ap, unsigned int), 0);
+                break;
+            case 'x':
+                obhex(ob, va_arg(ap, unsigned int), width);
+                break;
+            case 's':
+                obputs(ob, va_arg(ap, const char *));
+                break;
+            case 'c':
+                obputc(ob, (char) va_arg(ap, int));
+                break;
+            case '%':
+                obputc(ob, '%');
+                break;
+            case '\0':
+                p--;
+                break;
+        }
+    }
+    va_end(ap);
+}
@@ -0,0 +1,236 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Record output module for the avrdis project, writes the disassembled
+ *     instructions as machine readable records, either JSON Lines or fixed
+ *     size binary records followed by a string table.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "avrdis.h"
+
+#define DEFAULT_STRTAB_SIZE 4096
+#define DEFAULT_STRTAB_SLOTS 1024
+
+static const char *regionnames[] = { "code", "enabled", "data" };
+
+/* Splits the rendered text into the mnemonic and the operands */
+static void splittext(const struct instrrecord *ir, size_t *mnemoniclen, const char **operands, size_t *operandslen)
+{
+    const char *sp = memchr(ir->text, ' ', ir->textlen);
+
+    *mnemoniclen = sp ? (size_t) (sp - ir->text) : ir->textlen;
+    *operands = sp ? sp + 1 : ir->text + ir->textlen;
+    *operandslen = ir->textlen - (*operands - ir->text);
+}
+
+static void jsonstring(struct outbuf *ob, const char *s, size_t n)
+{
+    size_t i;
+
+    obputc(ob, '"');
+    for (i = 0; i < n; i++) {
+        if (s[i] == '"' || s[i] == '\\')
+            obputc(ob, '\\');
+        obputc(ob, s[i]);
+    }
+    obputc(ob, '"');
+}
+
+/* Writes the instruction as a JSON object on a line of its own */
+void writejsonrecord(struct outbuf *ob, const struct instrrecord *ir)
+{
+    const char *operands;
+    size_t mnemoniclen, operandslen;
+
+    splittext(ir, &mnemoniclen, &operands, &operandslen);
+
+    obfmt(ob, "{\"address\":%u,\"words\":[%d", ir->wordaddress, ir->words[0]);
+    if (ir->size == 2)
+        obfmt(ob, ",%d", ir->words[1]);
+    obputs(ob, "],\"mnemonic\":");
+    jsonstring(ob, ir->text, mnemoniclen);
+    obputs(ob, ",\"operands\":");
+    jsonstring(ob, operands, operandslen);
+    if (ir->hastarget)
+        obfmt(ob, ",\"target\":%u", ir->target);
+    else
+        obputs(ob, ",\"target\":null");
+    if (ir->label) {
+        obputs(ob, ",\"label\":");
+        jsonstring(ob, ir->label, strlen(ir->label));
+    } else
+        obputs(ob, ",\"label\":null");
+    obfmt(ob, ",\"region\":\"%s\"}\n", regionnames[ir->region]);
+}
+
+struct strtab *allocstrtab(void)
+{
+    struct strtab *st = malloc(sizeof(struct strtab));
+
+    if (!st)
+        return NULL;
+    memset(st, 0, sizeof(struct strtab));
+
+    st->buf = malloc(DEFAULT_STRTAB_SIZE);
+    st->slots = malloc(DEFAULT_STRTAB_SLOTS * sizeof(uint32_t));
+    if (!st->buf || !st->slots) {
+        freestrtab(st);
+        return NULL;
+    }
+    memset(st->slots, 0xff, DEFAULT_STRTAB_SLOTS * sizeof(uint32_t));
+    st->size = DEFAULT_STRTAB_SIZE;
+    st->slotcount = DEFAULT_STRTAB_SLOTS;
+
+    /* Offset 0 is the empty string */
+    st->buf[st->len++] = '\0';
+    return st;
+}
+
+void freestrtab(struct strtab *st)
+{
+    free(st->buf);
+    free(st->slots);
+    free(st);
+}
+
+static uint32_t strhash(const char *s, size_t n)
+{
+    uint32_t h = 2166136261u;  /* FNV-1a */
+
+    while (n--)
+        h = (h ^ (uint8_t) *s++) * 16777619u;
+    return h;
+}
+
+static int rehash(struct strtab *st)
+{
+    uint32_t *slots, off;
+    size_t i, j, count = 2 * st->slotcount;
+
+    if ((slots = malloc(count * sizeof(uint32_t))) == NULL)
+        return 0;
+    memset(slots, 0xff, count * sizeof(uint32_t));
+
+    for (i = 0; i < st->slotcount; i++) {
+        if ((off = st->slots[i]) == STRTAB_NONE)
+            continue;
+        for (j = strhash(st->buf + off, strlen(st->buf + off)) & (count - 1);
+             slots[j] != STRTAB_NONE; j = (j + 1) & (count - 1));
+        slots[j] = off;
+    }
+
+    free(st->slots);
+    st->slots = slots;
+    st->slotcount = count;
+    return 1;
+}
+
+/* Returns the offset of the string in the table, adding it when new, STRTAB_NONE on error */
+uint32_t addstring(struct strtab *st, const char *s, size_t n)
+{
+    size_t i, size;
+    uint32_t off;
+    char *buf;
+
+    if (!n)
+        return 0;
+
+    if (2 * (st->used + 1) > st->slotcount && !rehash(st))
+        return STRTAB_NONE;
+
+    for (i = strhash(s, n) & (st->slotcount - 1); (off = st->slots[i]) != STRTAB_NONE;
+         i = (i + 1) & (st->slotcount - 1))
+        if (!strncmp(st->buf + off, s, n) && st->buf[off + n] == '\0')
+            return off;
+
+    if (st->len + n + 1 > st->size) {
+        for (size = 2 * st->size; st->len + n + 1 > size; size *= 2);
+        if ((buf = realloc(st->buf, size)) == NULL)
+            return STRTAB_NONE;
+        st->buf = buf;
+        st->size = size;
+    }
+
+    off = st->len;
+    memcpy(st->buf + st->len, s, n);
+    st->buf[st->len + n] = '\0';
+    st->len += n + 1;
+    st->slots[i] = off;
+    st->used++;
+    return off;
+}
+
+static void putle(struct outbuf *ob, uint64_t v, int bytes)
+{
+    while (bytes--) {
+        obputc(ob, (char) (v & 0xff));
+        v >>= 8;
+    }
+}
+
+void writebinheader(struct outbuf *ob)
+{
+    obwrite(ob, BIN_HEADER_MAGIC, 8);
+    putle(ob, BIN_VERSION, 4);
+    putle(ob, BIN_RECORD_SIZE, 4);
+}
+
+/*
+ * Writes the instruction as a fixed size record, little endian:
+ *   0  u32 word address
+ *   4  u16 first word, u16 second word (0 for 16-bit opcodes)
+ *   8  u32 target word address, 0xffffffff when none
+ *  12  u32 label, 16 mnemonic, 20 operands: string table offsets, label
+ *      0xffffffff when none
+ *  24  u8 size in words, u8 region state, u8 flow kind, 5 reserved bytes
+ */
+int writebinrecord(struct outbuf *ob, struct strtab *st, const struct instrrecord *ir)
+{
+    const char *operands;
+    size_t mnemoniclen, operandslen;
+    uint32_t label = STRTAB_NONE, mnemonic, operandsoff;
+
+    splittext(ir, &mnemoniclen, &operands, &operandslen);
+    if ((mnemonic = addstring(st, ir->text, mnemoniclen)) == STRTAB_NONE ||
+        (operandsoff = addstring(st, operands, operandslen)) == STRTAB_NONE ||
+        (ir->label && (label = addstring(st, ir->label, strlen(ir->label))) == STRTAB_NONE))
+        return 0;
+
+    putle(ob, ir->wordaddress, 4);
+    putle(ob, ir->words[0], 2);
+    putle(ob, ir->size == 2 ? ir->words[1] : 0, 2);
+    putle(ob, ir->hastarget ? ir->target : 0xffffffff, 4);
+    putle(ob, label, 4);
+    putle(ob, mnemonic, 4);
+    putle(ob, operandsoff, 4);
+    putle(ob, ir->size, 1);
+    putle(ob, ir->region, 1);
+    putle(ob, ir->flow, 1);
+    putle(ob, 0, 5);
+    return 1;
+}
+
+/*
+ * Writes the string table and the footer locating it: u64 record count,
+ * u64 string table offset, u64 string table size and the footer magic.
+ */
+void writebinfooter(struct outbuf *ob, struct strtab *st, uint64_t records)
+{
+    obwrite(ob, st->buf, st->len);
+    putle(ob, records, 8);
+    putle(ob, BIN_HEADER_SIZE + records * BIN_RECORD_SIZE, 8);
+    putle(ob, st->len, 8);
+    obwrite(ob, BIN_FOOTER_MAGIC, 8);
+}
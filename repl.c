@@ -0,0 +1,332 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Interactive module for the avrdis project, keeps the image and its
+ *     analysis resident and reads commands from stdin, enabling and
+ *     disabling regions and listing the parts of the output asked for.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "avrdis.h"
+
+#define REPL_PROMPT "avrdis> "
+
+#define REPL_HELP "Commands:\n" \
+"  enable nnnn:nnnn : Enable disassembly of the region, then list the words changed.\n" \
+"  disable nnnn:nnnn : Drop the enabled and the data regions over the range, then list the words changed.\n" \
+"  data nnnn:nnnn : Confirm the region to be data, then list the words changed.\n" \
+"  entry nnnn : Collect the code from the word address like a call target, then list the words changed.\n" \
+"  label nnnn [name] : Name the label of the word address, or drop the name given.\n" \
+"  comment nnnn [text] : Comment the word address, or drop the comment.\n" \
+"  list [nnnn nnnn] : List the words between the hex word addresses, or all of them.\n" \
+"  regions : Print the disabled regions.\n" \
+"  enabled : Print the enabled regions.\n" \
+"  labels : Print the labels with their word addresses.\n" \
+"  save file : Write the whole output to file.\n" \
+"  help : Show the commands.\n" \
+"  quit : Exit.\n"
+
+struct repl {
+    struct wordlist *wl;
+    struct regionstruct *enaregs;   /* Of the resident analysis */
+    struct analysis *an;
+    struct options opts;
+    struct outbuf *ob;              /* The standard output */
+    struct renderbuffers *rb;
+    struct session *session;        /* Changed by the commands, saved after each change with --session */
+};
+
+static int writefile(void *arg, const char *buf, size_t len)
+{
+    return fwrite(buf, 1, len, arg) == len;
+}
+
+/* Parses two hex word addresses separated by a colon or spaces */
+static int parserange(char *args, uint32_t *begin, uint32_t *end)
+{
+    char *p;
+
+    for (p = args; *p; p++)
+        if (*p == ':')
+            *p = ' ';
+    if (sscanf(args, "%x %x", begin, end) != 2) {
+        errmsg("Failed to parse a hex memory address range.\n");
+        return 0;
+    }
+    if (*begin > *end) {
+        errmsg("Starting address must be smaller or equal than end address.\n");
+        return 0;
+    }
+    return 1;
+}
+
+static int list(struct repl *r, uint32_t begin, uint32_t end)
+{
+    struct options opts = r->opts;
+
+    opts.range = 1;
+    opts.rangebegin = begin;
+    opts.rangeend = end;
+    return renderanalysis(r->an, r->enaregs, &opts, writefile, stdout, r->rb);
+}
+
+static int save(struct repl *r, const char *filename)
+{
+    FILE *fp;
+    int res;
+
+    if ((fp = fopen(filename, "w")) == NULL) {
+        errmsg("Failed to open file %s\n", filename);
+        return 0;
+    }
+    res = renderanalysis(r->an, r->enaregs, &r->opts, writefile, fp, r->rb);
+    if (fclose(fp) || !res) {
+        errmsg("Failed to write file %s\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Analyzes the resident image again with the enabled regions given, and the
+ * data regions given unless NULL, taking those, then saves the session and
+ * lists the words rendered differently besides the ones between begin and
+ * end. The previous analysis and regions are kept when the new one fails.
+ */
+static int reanalyze(struct repl *r, struct regionstruct *enaregs, struct regionstruct *dataregs,
+                     uint32_t begin, uint32_t end)
+{
+    struct regionstruct *sessionregs, *olddata = r->session->dataregs;
+    struct analysis *an;
+    uint32_t from, to;
+
+    if ((sessionregs = copyregions(enaregs)) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto drop;
+    }
+    /* The analysis takes the data regions from the session */
+    if (dataregs)
+        r->session->dataregs = dataregs;
+    if ((an = allocanalysis(r->wl, enaregs, &r->opts)) == NULL) {
+        r->session->dataregs = olddata;
+        freeregions(sessionregs);
+        goto drop;
+    }
+
+    if (diffanalysis(r->an, an, &from, &to)) {
+        begin = from < begin ? from : begin;
+        end = to > end ? to : end;
+    }
+    freeanalysis(r->an);
+    freeregions(r->enaregs);
+    freeregions(r->session->enaregs);
+    if (dataregs)
+        freeregions(olddata);
+
+    /* A walk stopped by the time budget was made without the change */
+    if (r->session->walk) {
+        freewalk(r->session->walk);
+        r->session->walk = NULL;
+    }
+    r->an = an;
+    r->enaregs = enaregs;
+    r->session->enaregs = sessionregs;
+
+    if (r->opts.sessionfile && !storesession(r->opts.sessionfile, r->session))
+        return 0;
+    return list(r, begin, end);
+
+drop:
+    freeregions(enaregs);
+    if (dataregs)
+        freeregions(dataregs);
+    return 0;
+}
+
+/* Applies the change to copies of the regions, then analyzes the image again with those */
+static int change(struct repl *r, const char *cmd, uint32_t begin, uint32_t end)
+{
+    struct regionstruct *enaregs, *dataregs = NULL;
+
+    if ((enaregs = copyregions(r->enaregs)) == NULL)
+        goto err_alloc;
+    if (strcmp(cmd, "enable") && (dataregs = copyregions(r->session->dataregs)) == NULL)
+        goto err_alloc;
+    if (!strcmp(cmd, "enable") ? !addregion(enaregs, begin, end) :
+        !strcmp(cmd, "data") ? !addregion(dataregs, begin, end) :
+        !removeregion(enaregs, begin, end) || !removeregion(dataregs, begin, end))
+        goto err_alloc;
+    return reanalyze(r, enaregs, dataregs, begin, end);
+
+err_alloc:
+    errmsg("Error allocating memory\n");
+    if (enaregs)
+        freeregions(enaregs);
+    if (dataregs)
+        freeregions(dataregs);
+    return 0;
+}
+
+/* Finds whether an other word address has the label name, given or rendered */
+static int labeltaken(struct repl *r, uint32_t wordaddress, const char *name)
+{
+    const struct sessiontexts *t = &r->session->labels;
+    uint32_t at;
+    size_t i;
+
+    for (i = 0; i < t->count; i++)
+        if (t->items[i].wordaddress != wordaddress && !strcmp(t->items[i].text, name)) {
+            errmsg("Label name %s already used at 0x%04x\n", name, t->items[i].wordaddress);
+            return 1;
+        }
+    if (findlabelname(r->an, name, &at) && at != wordaddress) {
+        errmsg("Label name %s already used at 0x%04x\n", name, at);
+        return 1;
+    }
+    return 0;
+}
+
+/* Names a label, comments or adds an entry point at the word address, then analyzes the image again */
+static int annotate(struct repl *r, const char *cmd, char *args)
+{
+    struct regionstruct *enaregs;
+    uint32_t wordaddress;
+    char *text;
+    int n = 0;
+
+    if (sscanf(args, "%x %n", &wordaddress, &n) != 1) {
+        errmsg("Failed to parse a hex memory address.\n");
+        return 0;
+    }
+    text = args + n;
+
+    if (!strcmp(cmd, "label")) {
+        for (n = 0; text[n] && (isalnum((unsigned char) text[n]) || text[n] == '_'); n++);
+        if (text[n] || isdigit((unsigned char) *text)) {
+            errmsg("Invalid label name %s\n", text);
+            return 0;
+        }
+        if (*text && labeltaken(r, wordaddress, text))
+            return 0;
+    }
+
+    if ((enaregs = copyregions(r->enaregs)) == NULL ||
+        !(!strcmp(cmd, "label") ? settext(&r->session->labels, wordaddress, text) :
+          !strcmp(cmd, "comment") ? settext(&r->session->comments, wordaddress, text) :
+          addentry(r->session, wordaddress))) {
+        errmsg("Error allocating memory\n");
+        if (enaregs)
+            freeregions(enaregs);
+        return 0;
+    }
+    return reanalyze(r, enaregs, NULL, wordaddress, wordaddress);
+}
+
+/* Runs a command line, returns 0 on quit */
+static int command(struct repl *r, char *line)
+{
+    char cmd[16], *args;
+    uint32_t begin, end;
+    int n = 0;
+
+    if (sscanf(line, "%15s %n", cmd, &n) != 1)
+        return 1;
+    args = line + n;
+
+    if (!strcmp(cmd, "quit") || !strcmp(cmd, "exit"))
+        return 0;
+    if (!strcmp(cmd, "help"))
+        fputs(REPL_HELP, stdout);
+    else if (!strcmp(cmd, "enable") || !strcmp(cmd, "disable") || !strcmp(cmd, "data")) {
+        if (parserange(args, &begin, &end))
+            change(r, cmd, begin, end);
+    } else if (!strcmp(cmd, "label") || !strcmp(cmd, "comment") || !strcmp(cmd, "entry"))
+        annotate(r, cmd, args);
+    else if (!strcmp(cmd, "list")) {
+        if (!*args)
+            list(r, 0, UINT32_MAX);
+        else if (parserange(args, &begin, &end))
+            list(r, begin, end);
+    } else if (!strcmp(cmd, "regions") || !strcmp(cmd, "enabled") || !strcmp(cmd, "labels")) {
+        if (!strcmp(cmd, "regions"))
+            printanalysisregions(r->ob, r->an);
+        else if (!strcmp(cmd, "enabled"))
+            printregions(r->ob, r->enaregs);
+        else
+            printlabels(r->ob, r->an);
+        flushoutbuf(r->ob);
+    } else if (!strcmp(cmd, "save")) {
+        if (!*args)
+            errmsg("Filename after command save missing.\n");
+        else
+            save(r, args);
+    } else
+        errmsg("Unknown command %s, try help\n", cmd);
+    return 1;
+}
+
+/*
+ * Reads the commands from stdin until the end of it or quit, analyzing the
+ * image once up front and again after each change only. The changes go into
+ * the session. Returns 0 when the image could not be analyzed.
+ */
+int runrepl(struct wordlist *wl, struct regionstruct *enaregs, struct session *session, const struct options *opts)
+{
+    struct repl r;
+    char line[4096];
+    int prompt = isatty(STDIN_FILENO);
+    int res = 0;
+
+    memset(&r, 0, sizeof(struct repl));
+    r.wl = wl;
+    r.opts = *opts;
+    r.opts.session = r.session = session;
+
+    if ((r.enaregs = copyregions(enaregs)) == NULL || (r.ob = allocoutbuf(-1)) == NULL ||
+        (r.rb = allocrenderbuffers()) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto out;
+    }
+    r.ob->flush = writefile;
+    r.ob->arg = stdout;
+    if ((r.an = allocanalysis(wl, r.enaregs, &r.opts)) == NULL)
+        goto out;
+
+    for (;;) {
+        if (prompt) {
+            fputs(REPL_PROMPT, stdout);
+            fflush(stdout);
+        }
+        if (!fgets(line, sizeof(line), stdin))
+            break;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!command(&r, line))
+            break;
+        fflush(stdout);
+    }
+    res = 1;
+
+out:
+    if (r.an)
+        freeanalysis(r.an);
+    if (r.rb)
+        freerenderbuffers(r.rb);
+    if (r.ob)
+        freeoutbuf(r.ob);
+    if (r.enaregs)
+        freeregions(r.enaregs);
+    return res;
+}
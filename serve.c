@@ -0,0 +1,648 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Server module for the avrdis project, keeps the parsed and analyzed
+ *     images in a cache keyed by their content hash, and answers requests
+ *     over a Unix domain socket, serving the clients on a pool of threads.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "avrdis.h"
+
+#define CACHE_ENTRIES 64
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+#define SERVE_MESSAGE_SIZE 256
+#define LISTEN_BACKLOG 64
+#define MAX_CONNECTIONS 256     /* Open at once, the ones over it are refused */
+#define FRAME_TIMEOUT_MS 10000  /* For the rest of a request once its first byte has come */
+#define KEEP_BUFFER_SIZE (1024 * 1024)  /* The buffers of a thread grown past it are given back after the request */
+
+/*
+ * The protocol: every request and response is a frame, a 32-bit big endian
+ * payload length and the payload. A request is a command line, then the
+ * image for "-" as the key:
+ *
+ *   load|asm|listing|jsonl|regions|labels key|- [begin:end]\n[image]
+ *
+ * The response starts with "ok key\n" and the text asked for, or is an
+ * "error message\n".
+ *
+ * A thread answers one request of a connection, then gives it back to the
+ * accepting thread, which polls the open connections and queues the ones
+ * with a request in the order those came, so an idle client holds no thread.
+ */
+
+/* A parsed and analyzed image, shared by the requests using it */
+struct cacheentry {
+    struct cacheentry *prev;    /* Towards the most recently used */
+    struct cacheentry *next;
+    uint64_t key;               /* Hash of the image */
+    char *image;                /* The ihex text, to tell the hash collisions apart */
+    size_t imagelen;
+    struct wordlist *wl;
+    struct arena *arena;        /* Of the words */
+    struct regionstruct *enaregs;
+    struct analysis *an;
+    int refs;                   /* The cache and the requests holding it */
+};
+
+struct server {
+    const struct options *opts;
+    struct regionstruct *enaregs;   /* Of the command line */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct cacheentry *head;        /* Most recently used */
+    struct cacheentry *tail;
+    size_t entries;
+    int *queue;                     /* Ring of the connections with a request, waiting for a thread */
+    size_t first;
+    size_t nqueued;
+    int *idle;                      /* Connections waiting for their next request, polled when accepting */
+    size_t nidle;
+    int *serving;                   /* The connection of each thread, -1 when idle */
+    size_t threads;
+    size_t nserving;
+    int wake[2];                    /* Pipe telling the accepting thread about the connections given back */
+    int woken;                      /* A byte is in the pipe */
+    int stop;
+};
+
+static volatile sig_atomic_t stopping;
+
+static void stopserver(int sig)
+{
+    stopping = 1;
+}
+
+static uint64_t imagehash(const char *s, size_t n)
+{
+    uint64_t h = 14695981039346656037u;     /* FNV-1a */
+
+    while (n--)
+        h = (h ^ (uint8_t) *s++) * 1099511628211u;
+    return h;
+}
+
+static void releaseentry(struct cacheentry *e)
+{
+    if (--e->refs)
+        return;
+    if (e->an)
+        freeanalysis(e->an);
+    if (e->enaregs)
+        freeregions(e->enaregs);
+    if (e->arena)
+        freearena(e->arena);
+    free(e->image);
+    free(e);
+}
+
+static void unlinkentry(struct server *sv, struct cacheentry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        sv->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        sv->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void pushentry(struct server *sv, struct cacheentry *e)
+{
+    e->prev = NULL;
+    e->next = sv->head;
+    if (sv->head)
+        sv->head->prev = e;
+    else
+        sv->tail = e;
+    sv->head = e;
+}
+
+/* Finds the image and marks it the most recently used, holding it for the caller, lock held */
+static struct cacheentry *findentry(struct server *sv, uint64_t key, const char *image, size_t imagelen)
+{
+    struct cacheentry *e;
+
+    for (e = sv->head; e; e = e->next)
+        if (e->key == key && (!image || (e->imagelen == imagelen && !memcmp(e->image, image, imagelen))))
+            break;
+    if (!e)
+        return NULL;
+
+    unlinkentry(sv, e);
+    pushentry(sv, e);
+    e->refs++;
+    return e;
+}
+
+/* Parses and analyzes the image, NULL on error */
+static struct cacheentry *loadentry(struct server *sv, uint64_t key, const char *image, size_t imagelen)
+{
+    struct cacheentry *e = calloc(1, sizeof(struct cacheentry));
+    struct region *r;
+
+    if (!e || (e->image = malloc(imagelen)) == NULL || (e->enaregs = allocregions()) == NULL ||
+        (e->arena = allocarena()) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto err;
+    }
+    e->refs = 1;
+    e->key = key;
+    memcpy(e->image, image, imagelen);
+    e->imagelen = imagelen;
+
+    /* The -e regions, copied as the analysis may enable more */
+    for (r = sv->enaregs->first; r; r = r->next)
+        if (!addregion(e->enaregs, r->begin, r->end)) {
+            errmsg("Error allocating memory\n");
+            goto err;
+        }
+
+    if (!parseihexbuffer(image, imagelen, "request", e->arena, &e->wl) ||
+        (e->an = allocanalysis(e->wl, e->enaregs, sv->opts)) == NULL)
+        goto err;
+    return e;
+
+err:
+    if (e) {
+        e->refs = 1;
+        releaseentry(e);
+    }
+    return NULL;
+}
+
+/* Gets the image from the cache, loading and caching it when missing, held for the caller */
+static struct cacheentry *getentry(struct server *sv, const char *keytext, const char *image, size_t imagelen)
+{
+    struct cacheentry *e, *loaded, *old;
+    uint64_t key;
+    char *end;
+
+    if (strcmp(keytext, "-")) {
+        key = strtoull(keytext, &end, 16);
+        if (*end || end == keytext) {
+            errmsg("Invalid key %s\n", keytext);
+            return NULL;
+        }
+        pthread_mutex_lock(&sv->lock);
+        e = findentry(sv, key, NULL, 0);
+        pthread_mutex_unlock(&sv->lock);
+        if (!e)
+            errmsg("Image %016llx not cached\n", (unsigned long long) key);
+        return e;
+    }
+
+    key = imagehash(image, imagelen);
+    pthread_mutex_lock(&sv->lock);
+    e = findentry(sv, key, image, imagelen);
+    pthread_mutex_unlock(&sv->lock);
+    if (e)
+        return e;
+
+    /* Analyze outside of the lock, an other thread may have cached it meanwhile */
+    if ((loaded = loadentry(sv, key, image, imagelen)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&sv->lock);
+    if ((e = findentry(sv, key, image, imagelen)) == NULL) {
+        e = loaded;
+        loaded = NULL;
+        pushentry(sv, e);
+        e->refs++;
+        if (++sv->entries > CACHE_ENTRIES) {
+            old = sv->tail;
+            unlinkentry(sv, old);
+            sv->entries--;
+            releaseentry(old);
+        }
+    }
+    pthread_mutex_unlock(&sv->lock);
+
+    if (loaded)
+        releaseentry(loaded);
+    return e;
+}
+
+/* Reads len bytes before the deadline, 0 at the end of the connection or past the deadline */
+static int readfull(int fd, char *buf, size_t len, const struct timespec *deadline)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    struct timespec now;
+    long ms;
+    ssize_t n;
+
+    while (len) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0 || (n = poll(&pfd, 1, ms)) == 0)
+            return 0;
+        if (n < 0 || (n = read(fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (!n)
+            return 0;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int writefull(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        if ((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/*
+ * Reads a request frame into buf, growing it, returns 0 at the end of the
+ * connection, or when the client does not send the whole frame in time, so
+ * a stalled client holds no thread.
+ */
+static int readframe(int fd, char **buf, size_t *size, size_t *len)
+{
+    struct timespec deadline;
+    uint8_t head[4];
+    char *nb;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += FRAME_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += FRAME_TIMEOUT_MS % 1000 * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    if (!readfull(fd, (char *) head, 4, &deadline))
+        return 0;
+    *len = (uint32_t) head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3];
+    if (*len > MAX_FRAME_SIZE)
+        return 0;
+    if (*len + 1 > *size) {
+        if ((nb = realloc(*buf, *len + 1)) == NULL)
+            return 0;
+        *buf = nb;
+        *size = *len + 1;
+    }
+    if (!readfull(fd, *buf, *len, &deadline))
+        return 0;
+    (*buf)[*len] = '\0';
+    return 1;
+}
+
+static int writeframe(int fd, struct outbuf *ob)
+{
+    uint8_t head[4] = { ob->len >> 24, ob->len >> 16, ob->len >> 8, ob->len };
+
+    return writefull(fd, (const char *) head, 4) && writefull(fd, ob->buf, ob->len);
+}
+
+/* Appends the rendered text to the response */
+static int appendtext(void *arg, const char *buf, size_t len)
+{
+    struct outbuf *resp = arg;
+
+    obwrite(resp, buf, len);
+    return !resp->err;
+}
+
+/* Answers a request into resp, the diagnostics of the modules go into message */
+static int answer(struct server *sv, char *req, size_t len, struct outbuf *resp, struct renderbuffers *rb)
+{
+    char *nl, cmd[16], keytext[32];
+    const char *image = "";
+    struct cacheentry *e;
+    struct options opts = *sv->opts;
+    size_t imagelen = 0;
+    int fields, res = 0;
+
+    if ((nl = memchr(req, '\n', len)) != NULL) {
+        *nl = '\0';
+        image = nl + 1;
+        imagelen = len - (image - req);
+    }
+    fields = sscanf(req, "%15s %31s %x:%x", cmd, keytext, &opts.rangebegin, &opts.rangeend);
+    if (fields != 2 && fields != 4) {
+        errmsg("Invalid request\n");
+        return 0;
+    }
+    opts.range = fields == 4;
+    opts.jobs = 1;      /* The clients are served in parallel instead */
+
+    if (strcmp(cmd, "load") && strcmp(cmd, "asm") && strcmp(cmd, "listing") && strcmp(cmd, "jsonl") &&
+        strcmp(cmd, "regions") && strcmp(cmd, "labels")) {
+        errmsg("Unknown command %s\n", cmd);
+        return 0;
+    }
+    if ((e = getentry(sv, keytext, image, imagelen)) == NULL)
+        return 0;
+
+    obfmt(resp, "ok ");
+    obhex(resp, e->key >> 32, 8);
+    obhex(resp, e->key & 0xffffffff, 8);
+    obputc(resp, '\n');
+
+    if (!strcmp(cmd, "regions"))
+        printanalysisregions(resp, e->an);
+    else if (!strcmp(cmd, "labels"))
+        printlabels(resp, e->an);
+    else if (strcmp(cmd, "load")) {
+        opts.listing = !strcmp(cmd, "listing");
+        opts.format = !strcmp(cmd, "jsonl") ? FORMAT_JSONL : FORMAT_ASM;
+        if (!renderanalysis(e->an, e->enaregs, &opts, appendtext, resp, rb))
+            goto out;
+    }
+    res = !resp->err;
+
+out:
+    pthread_mutex_lock(&sv->lock);
+    releaseentry(e);
+    pthread_mutex_unlock(&sv->lock);
+    return res;
+}
+
+/* Serves a request of the connection, returns 0 when it has ended */
+static int serverequest(struct server *sv, int fd, char **req, size_t *size, struct outbuf *resp,
+                        struct renderbuffers *rb)
+{
+    char message[SERVE_MESSAGE_SIZE];
+    size_t len;
+
+    if (!readframe(fd, req, size, &len))
+        return 0;
+    resetoutbuf(resp, -1);
+    captureerrors(message, sizeof(message));
+    if (!answer(sv, *req, len, resp, rb)) {
+        resetoutbuf(resp, -1);
+        obfmt(resp, "error %s", *message ? message : "Error writing output\n");
+    }
+    captureerrors(NULL, 0);
+    return writeframe(fd, resp);
+}
+
+/* Answers the connection over the limit with an error, without waiting for the client */
+static void refuse(int fd)
+{
+    static const char message[] = "error Too many connections\n";
+    uint8_t frame[4 + sizeof(message) - 1] = { 0, 0, 0, sizeof(message) - 1 };
+
+    memcpy(frame + 4, message, sizeof(message) - 1);
+    send(fd, frame, sizeof(frame), MSG_NOSIGNAL | MSG_DONTWAIT);
+    close(fd);
+}
+
+/* Queues the connection with a request behind the others, lock held */
+static void queueconnection(struct server *sv, int fd)
+{
+    sv->queue[(sv->first + sv->nqueued++) % MAX_CONNECTIONS] = fd;
+    pthread_cond_signal(&sv->ready);
+}
+
+/* Gives the connection back to the accepting thread to wait for its next request, lock held */
+static void parkconnection(struct server *sv, int fd)
+{
+    char c = 0;
+
+    sv->idle[sv->nidle++] = fd;
+    if (!sv->woken && write(sv->wake[1], &c, 1) == 1)
+        sv->woken = 1;
+}
+
+static void *serveworker(void *arg)
+{
+    struct server *sv = arg;
+    struct renderbuffers *rb = allocrenderbuffers();
+    struct outbuf *resp = allocoutbuf(-1);
+    char *req = NULL;
+    size_t self, size = 0;
+    int fd, open;
+
+    pthread_mutex_lock(&sv->lock);
+    for (self = 0; sv->serving[self] != -2; self++);
+    sv->serving[self] = -1;
+    for (;;) {
+        while (!sv->nqueued && !sv->stop)
+            pthread_cond_wait(&sv->ready, &sv->lock);
+        if (sv->stop)
+            break;
+        fd = sv->queue[sv->first];
+        sv->first = (sv->first + 1) % MAX_CONNECTIONS;
+        sv->nqueued--;
+        sv->serving[self] = fd;
+        sv->nserving++;
+        pthread_mutex_unlock(&sv->lock);
+
+        open = rb && resp && serverequest(sv, fd, &req, &size, resp, rb);
+        if (size > KEEP_BUFFER_SIZE) {
+            free(req);
+            req = NULL;
+            size = 0;
+        }
+        if (resp)
+            shrinkoutbuf(resp);
+
+        pthread_mutex_lock(&sv->lock);
+        sv->serving[self] = -1;
+        sv->nserving--;
+        if (open && !sv->stop)
+            parkconnection(sv, fd);
+        else
+            close(fd);
+    }
+    pthread_mutex_unlock(&sv->lock);
+
+    free(req);
+    if (rb)
+        freerenderbuffers(rb);
+    if (resp)
+        freeoutbuf(resp);
+    return NULL;
+}
+
+/*
+ * Listens on the Unix domain socket at path, and serves the clients on a
+ * pool of --jobs threads, until interrupted by SIGINT or SIGTERM.
+ */
+int runserver(const char *path, struct regionstruct *enaregs, const struct options *opts)
+{
+    struct server sv;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    sigset_t signals, old;
+    pthread_t *threads = NULL;
+    struct pollfd *pfds = NULL;
+    struct cacheentry *e;
+    size_t i, j, n, started = 0;
+    int lfd, fd, res = 0;
+    char c;
+
+    memset(&sv, 0, sizeof(struct server));
+    sv.wake[0] = sv.wake[1] = -1;
+    sv.opts = opts;
+    sv.enaregs = enaregs;
+    sv.threads = jobcount(opts);
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errmsg("Socket path too long: %s\n", path);
+        return 0;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(lfd, LISTEN_BACKLOG)) {
+        errmsg("Error opening socket: %s\n", path);
+        if (lfd >= 0)
+            close(lfd);
+        return 0;
+    }
+
+    if ((threads = calloc(sv.threads, sizeof(pthread_t))) == NULL ||
+        (sv.queue = malloc(MAX_CONNECTIONS * sizeof(int))) == NULL ||
+        (sv.idle = malloc(MAX_CONNECTIONS * sizeof(int))) == NULL ||
+        (pfds = malloc((MAX_CONNECTIONS + 2) * sizeof(struct pollfd))) == NULL ||
+        (sv.serving = malloc(sv.threads * sizeof(int))) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto out;
+    }
+    if (pipe(sv.wake)) {
+        errmsg("Error opening socket: %s\n", path);
+        goto out;
+    }
+    for (i = 0; i < sv.threads; i++)
+        sv.serving[i] = -2;     /* Not taken by a thread yet */
+    pthread_mutex_init(&sv.lock, NULL);
+    pthread_cond_init(&sv.ready, NULL);
+
+    /* Only the accepting thread gets the signals, those interrupt poll() */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopserver;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old);
+    for (i = 0; i < sv.threads; i++, started++)
+        if (pthread_create(&threads[i], NULL, serveworker, &sv))
+            break;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /*
+     * The threads only add to the idle connections, so the ones polled keep
+     * their places until those with a request are queued here.
+     */
+    pfds[0].fd = lfd;
+    pfds[1].fd = sv.wake[0];
+    for (i = 0; i < MAX_CONNECTIONS + 2; i++)
+        pfds[i].events = POLLIN;
+    while (started && !stopping) {
+        pthread_mutex_lock(&sv.lock);
+        for (n = 0; n < sv.nidle; n++)
+            pfds[n + 2].fd = sv.idle[n];
+        pthread_mutex_unlock(&sv.lock);
+
+        if (poll(pfds, n + 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            errmsg("Error polling connections: %s\n", path);
+            break;
+        }
+
+        pthread_mutex_lock(&sv.lock);
+        if (pfds[1].revents && read(sv.wake[0], &c, 1) == 1)
+            sv.woken = 0;
+        for (i = j = 0; i < sv.nidle; i++)
+            if (i < n && pfds[i + 2].revents)
+                queueconnection(&sv, sv.idle[i]);
+            else
+                sv.idle[j++] = sv.idle[i];
+        sv.nidle = j;
+        pthread_mutex_unlock(&sv.lock);
+
+        if (!pfds[0].revents)
+            continue;
+        if ((fd = accept(lfd, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            errmsg("Error accepting connection: %s\n", path);
+            break;
+        }
+        pthread_mutex_lock(&sv.lock);
+        if (sv.nqueued + sv.nidle + sv.nserving < MAX_CONNECTIONS)
+            sv.idle[sv.nidle++] = fd;
+        else
+            refuse(fd);
+        pthread_mutex_unlock(&sv.lock);
+    }
+    res = started && stopping;
+
+    /* Ends the connections being served, the threads finish their requests */
+    pthread_mutex_lock(&sv.lock);
+    sv.stop = 1;
+    for (i = 0; i < sv.threads; i++)
+        if (sv.serving[i] >= 0)
+            shutdown(sv.serving[i], SHUT_RDWR);
+    for (; sv.nqueued; sv.nqueued--, sv.first = (sv.first + 1) % MAX_CONNECTIONS)
+        close(sv.queue[sv.first]);
+    while (sv.nidle)
+        close(sv.idle[--sv.nidle]);
+    pthread_cond_broadcast(&sv.ready);
+    pthread_mutex_unlock(&sv.lock);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    while ((e = sv.head) != NULL) {
+        unlinkentry(&sv, e);
+        releaseentry(e);
+    }
+    pthread_cond_destroy(&sv.ready);
+    pthread_mutex_destroy(&sv.lock);
+
+out:
+    free(threads);
+    free(pfds);
+    free(sv.queue);
+    free(sv.idle);
+    free(sv.serving);
+    if (sv.wake[0] >= 0) {
+        close(sv.wake[0]);
+        close(sv.wake[1]);
+    }
+    close(lfd);
+    unlink(path);
+    return res;
+}
@@ -0,0 +1,590 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Session module for the avrdis project, keeps the state of exploring
+ *     an image, the enabled and data regions, entry points, label names and
+ *     comments, in a compact binary file mapped into memory when loaded.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "avrdis.h"
+
+/*
+ * The session file, little endian:
+ *   0  "AVRDISSN", u32 version, u32 enabled, data, entry, label and comment
+ *      counts, u32 string table size, u32 reserved, u64 image hash
+ *  48  enabled then data regions: u32 begin, u32 end each
+ *      entry points: u32 word address each
+ *      labels then comments: u32 word address, u32 string table offset each
+ *      string table: NUL terminated strings
+ *
+ * Version 2 is written when a walk stopped by the time budget is pending,
+ * its header goes on with the u32 next, previous and skip begin word
+ * addresses, u32 flags (1: skipping), u32 label, region and frame counts of
+ * the walk, and u64 digest of the enabled regions and entry points walked
+ * with. The frames of the walks of the cut regions, innermost first:
+ * u32 next, previous, skip begin and end word addresses and u32 flags each,
+ * then the walk's disabled regions and label word addresses go before the
+ * string table.
+ */
+#define SESSION_MAGIC "AVRDISSN"
+#define SESSION_VERSION 1
+#define SESSION_WALK_VERSION 2
+#define SESSION_HEADER_SIZE 48
+#define SESSION_WALK_HEADER_SIZE 84
+
+#define DEFAULT_SESSION_ITEMS 16
+
+/* FNV-1a of the word addresses and words, so the formatting of the input does not matter */
+uint64_t wordlisthash(struct wordlist *wl)
+{
+    uint64_t h = 14695981039346656037u;
+    uint64_t v;
+    int i;
+
+    for (; wl; wl = wl->next) {
+        v = (uint64_t) wl->wordaddress | (uint64_t) wl->word << 32;
+        for (i = 0; i < 6; i++, v >>= 8)
+            h = (h ^ (v & 0xff)) * 1099511628211u;
+    }
+    return h;
+}
+
+static uint64_t hashvalue(uint64_t h, uint64_t v)
+{
+    int i;
+
+    for (i = 0; i < 8; i++, v >>= 8)
+        h = (h ^ (v & 0xff)) * 1099511628211u;
+    return h;
+}
+
+/* FNV-1a of what the walk of the label collection depends on, a walk is resumed with the same only */
+uint64_t walkdigest(const struct session *s, struct regionstruct *enaregs, const uint32_t *entries, size_t entriescount)
+{
+    uint64_t h = hashvalue(14695981039346656037u, s->imagehash);
+    struct region *r;
+    size_t i;
+
+    for (r = enaregs->first; r; r = r->next)
+        h = hashvalue(h, (uint64_t) r->begin | (uint64_t) r->end << 32);
+    h = hashvalue(h, UINT64_MAX);
+    for (i = 0; i < entriescount; i++)
+        h = hashvalue(h, entries[i]);
+    return h;
+}
+
+struct session *allocsession(void)
+{
+    struct session *s = malloc(sizeof(struct session));
+
+    if (!s)
+        return NULL;
+    memset(s, 0, sizeof(struct session));
+    if ((s->enaregs = allocregions()) == NULL || (s->dataregs = allocregions()) == NULL) {
+        freesession(s);
+        return NULL;
+    }
+    return s;
+}
+
+static void freetexts(struct sessiontexts *t)
+{
+    size_t i;
+
+    for (i = 0; i < t->count; i++)
+        if (t->items[i].owned)
+            free((char *) t->items[i].text);
+    free(t->items);
+}
+
+void freewalk(struct walkstate *ws)
+{
+    free(ws->frames);
+    free(ws->labels);
+    if (ws->disregs)
+        freeregions(ws->disregs);
+    free(ws);
+}
+
+void freesession(struct session *s)
+{
+    if (s->enaregs)
+        freeregions(s->enaregs);
+    if (s->dataregs)
+        freeregions(s->dataregs);
+    free(s->entries);
+    freetexts(&s->labels);
+    freetexts(&s->comments);
+    if (s->walk)
+        freewalk(s->walk);
+    if (s->map)
+        munmap(s->map, s->mapsize);
+    free(s);
+}
+
+/* Index of the first text at or after the word address */
+static size_t textpos(const struct sessiontexts *t, uint32_t wordaddress)
+{
+    size_t lo = 0, hi = t->count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (t->items[mid].wordaddress < wordaddress)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+const char *findtext(const struct sessiontexts *t, uint32_t wordaddress)
+{
+    size_t i = textpos(t, wordaddress);
+
+    return i < t->count && t->items[i].wordaddress == wordaddress ? t->items[i].text : NULL;
+}
+
+/* Sets the text of the word address, removes it when text is NULL or empty */
+int settext(struct sessiontexts *t, uint32_t wordaddress, const char *text)
+{
+    size_t i = textpos(t, wordaddress);
+    struct sessiontext *items;
+    int found = i < t->count && t->items[i].wordaddress == wordaddress;
+    char *copy = NULL;
+
+    if (text && *text && (copy = strdup(text)) == NULL)
+        return 0;
+
+    if (found && t->items[i].owned)
+        free((char *) t->items[i].text);
+    if (!copy) {
+        if (found)
+            memmove(&t->items[i], &t->items[i+1], (t->count-- - i - 1) * sizeof(struct sessiontext));
+        return 1;
+    }
+
+    if (!found) {
+        if (t->count == t->size) {
+            if ((items = realloc(t->items, (t->size ? 2 * t->size : DEFAULT_SESSION_ITEMS) *
+                                 sizeof(struct sessiontext))) == NULL) {
+                free(copy);
+                return 0;
+            }
+            t->items = items;
+            t->size = t->size ? 2 * t->size : DEFAULT_SESSION_ITEMS;
+        }
+        memmove(&t->items[i+1], &t->items[i], (t->count++ - i) * sizeof(struct sessiontext));
+        t->items[i].wordaddress = wordaddress;
+    }
+    t->items[i].text = copy;
+    t->items[i].owned = 1;
+    return 1;
+}
+
+int addentry(struct session *s, uint32_t wordaddress)
+{
+    size_t lo = 0, hi = s->entriescount, mid;
+    uint32_t *entries;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (s->entries[mid] < wordaddress)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < s->entriescount && s->entries[lo] == wordaddress)
+        return 1;
+
+    if (s->entriescount == s->entriessize) {
+        if ((entries = realloc(s->entries, (s->entriessize ? 2 * s->entriessize : DEFAULT_SESSION_ITEMS) *
+                               sizeof(uint32_t))) == NULL)
+            return 0;
+        s->entries = entries;
+        s->entriessize = s->entriessize ? 2 * s->entriessize : DEFAULT_SESSION_ITEMS;
+    }
+    memmove(&s->entries[lo+1], &s->entries[lo], (s->entriescount++ - lo) * sizeof(uint32_t));
+    s->entries[lo] = wordaddress;
+    return 1;
+}
+
+static uint64_t getle(const uint8_t *p, int bytes)
+{
+    uint64_t v = 0;
+
+    while (bytes--)
+        v = v << 8 | p[bytes];
+    return v;
+}
+
+static void putle(struct outbuf *ob, uint64_t v, int bytes)
+{
+    while (bytes--) {
+        obputc(ob, (char) (v & 0xff));
+        v >>= 8;
+    }
+}
+
+static int loadregions(const uint8_t *p, size_t count, struct regionstruct *rs)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++, p += 8)
+        if (!addregion(rs, getle(p, 4), getle(p + 4, 4)))
+            return 0;
+    return 1;
+}
+
+/* Points the texts into the string table of the mapped file, keeping them sorted */
+static int loadtexts(const uint8_t *p, size_t count, const char *strtab, size_t strsize, struct sessiontexts *t)
+{
+    size_t i, offset;
+
+    if (!count)
+        return 1;
+    if ((t->items = malloc(count * sizeof(struct sessiontext))) == NULL)
+        return 0;
+    t->size = count;
+    for (i = 0; i < count; i++, p += 8) {
+        offset = getle(p + 4, 4);
+        if (offset >= strsize || (i && getle(p, 4) <= t->items[i-1].wordaddress))
+            return -1;
+        t->items[t->count].wordaddress = getle(p, 4);
+        t->items[t->count].text = strtab + offset;
+        t->items[t->count++].owned = 0;
+    }
+    return 1;
+}
+
+/* The next word is up to one past the end, after the last instruction walked, skipping from before it */
+static int validframe(const struct walkframe *wf)
+{
+    return wf->end < UINT32_MAX && wf->next <= wf->end + 1 &&
+           (wf->prev == UINT32_MAX ? !wf->skip : wf->prev < wf->next) && (!wf->skip || wf->begin <= wf->next);
+}
+
+/* Loads the pending walk of a version 2 file, its arrays end at the string table, -1 when invalid */
+static int loadwalk(const uint8_t *map, const uint32_t *counts, size_t end, struct session *s)
+{
+    const uint8_t *p = map + end - 4 * (size_t) counts[0] - 8 * (size_t) counts[1] - 20 * (size_t) counts[2];
+    struct walkstate *ws;
+    size_t i;
+
+    if ((ws = malloc(sizeof(struct walkstate))) == NULL)
+        return 0;
+    memset(ws, 0, sizeof(struct walkstate));
+    ws->image.next = getle(map + 48, 4);
+    ws->image.prev = getle(map + 52, 4);
+    ws->image.begin = getle(map + 56, 4);
+    ws->image.skip = getle(map + 60, 4) & 1;
+    ws->image.end = UINT32_MAX - 1;     /* The last word of the image, checked when opened */
+    ws->digest = getle(map + 76, 8);
+    ws->framescount = counts[2];
+    ws->frames = malloc((counts[2] ? counts[2] : 1) * sizeof(struct walkframe));
+    ws->labelscount = counts[0];
+    ws->labels = malloc((counts[0] ? counts[0] : 1) * sizeof(uint32_t));
+    ws->disregs = allocregions();
+    s->walk = ws;
+    if (!ws->frames || !ws->labels || !ws->disregs)
+        return 0;
+    for (i = 0; i < counts[2]; i++, p += 20) {
+        ws->frames[i].next = getle(p, 4);
+        ws->frames[i].prev = getle(p + 4, 4);
+        ws->frames[i].begin = getle(p + 8, 4);
+        ws->frames[i].end = getle(p + 12, 4);
+        ws->frames[i].skip = getle(p + 16, 4) & 1;
+        if (getle(p + 16, 4) > 1 || !validframe(&ws->frames[i]))
+            return -1;
+    }
+    if (getle(map + 60, 4) > 1 || !validframe(&ws->image))
+        return -1;
+    if (!loadregions(p, counts[1], ws->disregs))
+        return 0;
+    for (p += 8 * (size_t) counts[1], i = 0; i < counts[0]; i++, p += 4)
+        ws->labels[i] = getle(p, 4);
+    return 1;
+}
+
+/*
+ * Loads the session file into the empty session. The file stays mapped
+ * while the session is in use, the texts are read from the mapping.
+ */
+int loadsession(const char *filename, struct session *s)
+{
+    struct stat st;
+    const uint8_t *p;
+    uint32_t counts[5], walkcounts[3] = {0, 0, 0}, strsize, version;
+    size_t i, size, headersize;
+    int fd, res;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        errmsg("Failed to open file %s\n", filename);
+        return 0;
+    }
+    if (fstat(fd, &st) || st.st_size < SESSION_HEADER_SIZE ||
+        (s->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        s->map = NULL;
+        close(fd);
+        errmsg("Invalid session file %s\n", filename);
+        return 0;
+    }
+    close(fd);
+    s->mapsize = st.st_size;
+    p = s->map;
+
+    version = getle(p + 8, 4);
+    headersize = version == SESSION_WALK_VERSION ? SESSION_WALK_HEADER_SIZE : SESSION_HEADER_SIZE;
+    if (memcmp(p, SESSION_MAGIC, 8) || (version != SESSION_VERSION && version != SESSION_WALK_VERSION) ||
+        s->mapsize < headersize)
+        goto err_format;
+    for (i = 0; i < 5; i++)
+        counts[i] = getle(p + 12 + 4 * i, 4);
+    strsize = getle(p + 32, 4);
+    s->imagehash = getle(p + 40, 8);
+    if (version == SESSION_WALK_VERSION) {
+        walkcounts[0] = getle(p + 64, 4);
+        walkcounts[1] = getle(p + 68, 4);
+        walkcounts[2] = getle(p + 72, 4);
+    }
+
+    size = headersize + 8 * ((uint64_t) counts[0] + counts[1] + counts[3] + counts[4] + walkcounts[1]) +
+           4 * ((uint64_t) counts[2] + walkcounts[0]) + 20 * (uint64_t) walkcounts[2] + strsize;
+    if (size != s->mapsize || (strsize && p[size - 1]))
+        goto err_format;
+
+    if (version == SESSION_WALK_VERSION && (res = loadwalk(p, walkcounts, size - strsize, s)) <= 0)
+        goto err_texts;
+
+    p += headersize;
+    if (!loadregions(p, counts[0], s->enaregs) || !loadregions(p + 8 * counts[0], counts[1], s->dataregs))
+        goto err_alloc;
+    p += 8 * (counts[0] + counts[1]);
+    for (i = 0; i < counts[2]; i++, p += 4)
+        if (!addentry(s, getle(p, 4)))
+            goto err_alloc;
+    if ((res = loadtexts(p, counts[3], (const char *) s->map + size - strsize, strsize, &s->labels)) <= 0 ||
+        (res = loadtexts(p + 8 * counts[3], counts[4], (const char *) s->map + size - strsize, strsize, &s->comments)) <= 0)
+        goto err_texts;
+
+    return 1;
+
+err_texts:
+    if (res < 0)
+        goto err_format;
+err_alloc:
+    errmsg("Error allocating memory\n");
+    return 0;
+err_format:
+    errmsg("Invalid session file %s\n", filename);
+    return 0;
+}
+
+static size_t regioncount(struct regionstruct *rs)
+{
+    struct region *r;
+    size_t n = 0;
+
+    for (r = rs->first; r; r = r->next)
+        n++;
+    return n;
+}
+
+static void storeregions(struct outbuf *ob, struct regionstruct *rs)
+{
+    struct region *r;
+
+    for (r = rs->first; r; r = r->next) {
+        putle(ob, r->begin, 4);
+        putle(ob, r->end, 4);
+    }
+}
+
+/* Writes the records of the texts, their strings follow each other in the string table */
+static uint32_t storetexts(struct outbuf *ob, const struct sessiontexts *t, uint32_t offset)
+{
+    size_t i;
+
+    for (i = 0; i < t->count; i++) {
+        putle(ob, t->items[i].wordaddress, 4);
+        putle(ob, offset, 4);
+        offset += strlen(t->items[i].text) + 1;
+    }
+    return offset;
+}
+
+static size_t stringssize(const struct sessiontexts *t)
+{
+    size_t i, size = 0;
+
+    for (i = 0; i < t->count; i++)
+        size += strlen(t->items[i].text) + 1;
+    return size;
+}
+
+static void storestrings(struct outbuf *ob, const struct sessiontexts *t)
+{
+    size_t i;
+
+    for (i = 0; i < t->count; i++)
+        obwrite(ob, t->items[i].text, strlen(t->items[i].text) + 1);
+}
+
+/* Writes the session into a temporary file next to the session file, then renames it over that */
+int storesession(const char *filename, struct session *s)
+{
+    struct outbuf *ob = NULL;
+    char *temp;
+    mode_t mask;
+    size_t i;
+    int fd, res = 0;
+
+    if ((temp = malloc(strlen(filename) + 8)) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+    sprintf(temp, "%s.XXXXXX", filename);
+    if ((fd = mkstemp(temp)) < 0) {
+        errmsg("Failed to create file %s\n", temp);
+        free(temp);
+        return 0;
+    }
+    if ((ob = allocoutbuf(fd)) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto out;
+    }
+
+    obwrite(ob, SESSION_MAGIC, 8);
+    putle(ob, s->walk ? SESSION_WALK_VERSION : SESSION_VERSION, 4);
+    putle(ob, regioncount(s->enaregs), 4);
+    putle(ob, regioncount(s->dataregs), 4);
+    putle(ob, s->entriescount, 4);
+    putle(ob, s->labels.count, 4);
+    putle(ob, s->comments.count, 4);
+    putle(ob, stringssize(&s->labels) + stringssize(&s->comments), 4);
+    putle(ob, 0, 4);
+    putle(ob, s->imagehash, 8);
+    if (s->walk) {
+        putle(ob, s->walk->image.next, 4);
+        putle(ob, s->walk->image.prev, 4);
+        putle(ob, s->walk->image.begin, 4);
+        putle(ob, s->walk->image.skip ? 1 : 0, 4);
+        putle(ob, s->walk->labelscount, 4);
+        putle(ob, regioncount(s->walk->disregs), 4);
+        putle(ob, s->walk->framescount, 4);
+        putle(ob, s->walk->digest, 8);
+    }
+
+    storeregions(ob, s->enaregs);
+    storeregions(ob, s->dataregs);
+    for (i = 0; i < s->entriescount; i++)
+        putle(ob, s->entries[i], 4);
+    storetexts(ob, &s->comments, storetexts(ob, &s->labels, 0));
+    if (s->walk) {
+        for (i = 0; i < s->walk->framescount; i++) {
+            putle(ob, s->walk->frames[i].next, 4);
+            putle(ob, s->walk->frames[i].prev, 4);
+            putle(ob, s->walk->frames[i].begin, 4);
+            putle(ob, s->walk->frames[i].end, 4);
+            putle(ob, s->walk->frames[i].skip ? 1 : 0, 4);
+        }
+        storeregions(ob, s->walk->disregs);
+        for (i = 0; i < s->walk->labelscount; i++)
+            putle(ob, s->walk->labels[i], 4);
+    }
+    storestrings(ob, &s->labels);
+    storestrings(ob, &s->comments);
+
+    mask = umask(0);
+    umask(mask);
+    if (!flushoutbuf(ob) || fchmod(fd, 0666 & ~mask)) {
+        errmsg("Failed to write file %s\n", temp);
+        goto out;
+    }
+    if (rename(temp, filename)) {
+        errmsg("Failed to replace file %s\n", filename);
+        goto out;
+    }
+    res = 1;
+
+out:
+    if (ob)
+        freeoutbuf(ob);
+    close(fd);
+    if (!res)
+        unlink(temp);
+    free(temp);
+    return res;
+}
+
+/*
+ * Loads the session file of the image, or starts a new session when the
+ * file does not exist and create is set. NULL on error, or when the session
+ * was saved for another image.
+ */
+/* Checks the words the walks stand at to be in the image, -1 when not */
+static int checkwalk(struct walkstate *ws, struct wordlist *wl)
+{
+    struct wordindex *wi;
+    struct walkframe *wf;
+    size_t i;
+    int res = 1;
+
+    if (!wl)
+        return -1;
+    if ((wi = allocwordindex(wl)) == NULL)
+        return 0;
+    ws->image.end = wi->words[wi->count - 1]->wordaddress;
+    for (i = 0; res > 0 && i <= ws->framescount; i++) {
+        wf = i < ws->framescount ? &ws->frames[i] : &ws->image;
+        if (wf->end > ws->image.end || wf->next > wf->end + 1 || (wf->prev != UINT32_MAX && !wordat(wi, wf->prev)))
+            res = -1;
+    }
+    freewordindex(wi);
+    return res;
+}
+
+struct session *opensession(const char *filename, struct wordlist *wl, int create)
+{
+    struct session *s = allocsession();
+    int res;
+
+    if (!s) {
+        errmsg("Error allocating memory\n");
+        return NULL;
+    }
+    if (create && access(filename, F_OK)) {
+        s->imagehash = wordlisthash(wl);
+        return s;
+    }
+    if (!loadsession(filename, s))
+        goto err;
+    if (s->imagehash != wordlisthash(wl)) {
+        errmsg("Session file %s was saved for another image\n", filename);
+        goto err;
+    }
+    if (s->walk && (res = checkwalk(s->walk, wl)) <= 0) {
+        errmsg(res < 0 ? "Invalid session file %s\n" : "Error allocating memory\n", filename);
+        goto err;
+    }
+    return s;
+
+err:
+    freesession(s);
+    return NULL;
+}
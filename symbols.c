@@ -0,0 +1,370 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Symbols module for the avrdis project, loads the symbols of an earlier
+ *     build of the firmware from avr-nm output or a GNU ld map file, line by
+ *     line into a hash table, to name the labels with them and to find more
+ *     code and data.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "avrdis.h"
+
+#define SYMBOLS_LINE_SIZE 1024
+#define SYMBOLS_MAX_TOKENS 5        /* One more than a symbol line has, to tell the longer lines apart */
+#define DEFAULT_SYMBOLS_SIZE 1024   /* Slots of the hash table, a power of two */
+#define FLASH_END 0x800000          /* The data memory and the eeprom are mapped above the flash */
+
+/* The state of reading a map file between the lines */
+struct mapstate {
+    int discarded;      /* In the list of the sections removed by the linker */
+    int data;           /* In a section of the data placed in the flash */
+    int pending;        /* The address and size of the section are on the next line */
+};
+
+static struct symbols *allocsymbols(void)
+{
+    struct symbols *st = malloc(sizeof(struct symbols));
+
+    if (!st)
+        return NULL;
+    memset(st, 0, sizeof(struct symbols));
+    st->size = DEFAULT_SYMBOLS_SIZE;
+    if ((st->slots = calloc(st->size, sizeof(struct symbol))) == NULL ||
+        (st->dataregs = allocregions()) == NULL || (st->arena = allocarena()) == NULL) {
+        freesymbols(st);
+        return NULL;
+    }
+    return st;
+}
+
+void freesymbols(struct symbols *st)
+{
+    free(st->slots);
+    free(st->entries);
+    if (st->dataregs)
+        freeregions(st->dataregs);
+    if (st->arena)
+        freearena(st->arena);
+    free(st);
+}
+
+/* The slot of the word address, or the free one it would go into */
+static struct symbol *findslot(const struct symbols *st, uint32_t wordaddress)
+{
+    size_t i = (wordaddress * 2654435761u) & (st->size - 1);
+
+    while (st->slots[i].name && st->slots[i].wordaddress != wordaddress)
+        i = (i + 1) & (st->size - 1);
+    return &st->slots[i];
+}
+
+const char *findsymbol(const struct symbols *st, uint32_t wordaddress)
+{
+    return findslot(st, wordaddress)->name;
+}
+
+static int growsymbols(struct symbols *st)
+{
+    struct symbol *old = st->slots;
+    size_t i, size = st->size;
+
+    if ((st->slots = calloc(2 * size, sizeof(struct symbol))) == NULL) {
+        st->slots = old;
+        return 0;
+    }
+    st->size = 2 * size;
+    for (i = 0; i < size; i++)
+        if (old[i].name)
+            *findslot(st, old[i].wordaddress) = old[i];
+    free(old);
+    return 1;
+}
+
+/* The markers the linker script defines around the sections are not symbols of the program */
+static int linkermarker(const char *name)
+{
+    size_t len = strlen(name);
+
+    return !strcmp(name, "_etext") || !strcmp(name, "_edata") || !strcmp(name, "_end") ||
+           (!strncmp(name, "__", 2) && ((len > 6 && !strcmp(name + len - 6, "_start")) ||
+                                        (len > 4 && !strcmp(name + len - 4, "_end"))));
+}
+
+/* Copies the name as a label both assemblers take, the other characters replaced with underscores */
+static char *labelname(struct arena *a, const char *name)
+{
+    char *label = arenaalloc(a, strlen(name) + 2), *p = label;
+
+    if (!label)
+        return NULL;
+    if (isdigit((unsigned char) *name))
+        *p++ = '_';
+    for (; *name; name++)
+        *p++ = isalnum((unsigned char) *name) || *name == '_' ? *name : '_';
+    *p = '\0';
+    return label;
+}
+
+/*
+ * Of the names of a word address, the one of the program is kept over the
+ * ones of the library, those start with more underscores, then the first
+ * in order, so the order of the lines does not matter.
+ */
+static int betterthan(const char *name, const char *label)
+{
+    size_t n = strspn(name, "_"), l = strspn(label, "_");
+
+    return n < l || (n == l && strcmp(name, label) < 0);
+}
+
+static int addsymbol(struct symbols *st, uint32_t address, const char *name, int code)
+{
+    struct symbol *slot;
+
+    /* Only the flash has instructions, and those start at even byte addresses */
+    if (address >= FLASH_END || (code && address & 1) || linkermarker(name))
+        return 1;
+    if (4 * (st->count + 1) > 3 * st->size && !growsymbols(st))
+        return 0;
+
+    slot = findslot(st, address / 2);
+    if (!slot->name) {
+        slot->wordaddress = address / 2;
+        st->count++;
+    } else if (!betterthan(name, slot->name)) {
+        slot->code |= code;
+        return 1;
+    }
+    slot->code |= code;
+    return (slot->name = labelname(st->arena, name)) != NULL;
+}
+
+static int adddata(struct symbols *st, uint32_t address, uint32_t size)
+{
+    if (!size || address >= FLASH_END)
+        return 1;
+    return addregion(st->dataregs, address / 2, (address + size - 1) / 2);
+}
+
+/* Splits the line at the white space in place, returns the number of tokens up to max */
+static int tokenize(char *line, char **tokens, int max)
+{
+    int n = 0;
+
+    while (n < max) {
+        while (isspace((unsigned char) *line))
+            line++;
+        if (!*line)
+            break;
+        tokens[n++] = line;
+        while (*line && !isspace((unsigned char) *line))
+            line++;
+        if (*line)
+            *line++ = '\0';
+    }
+    return n;
+}
+
+/* Parses a whole token as a hex number, with the 0x prefix of the map files when prefixed */
+static int hexnumber(const char *s, int prefixed, uint32_t *v)
+{
+    unsigned long long n;
+    char *end;
+
+    if (prefixed && strncmp(s, "0x", 2))
+        return 0;
+    if (!isxdigit((unsigned char) s[prefixed ? 2 : 0]))
+        return 0;
+    n = strtoull(s, &end, 16);
+    if (*end || n > UINT32_MAX)
+        return 0;
+    *v = n;
+    return 1;
+}
+
+/*
+ * Takes the symbols of a line of avr-nm output, with or without the sizes:
+ *   00000068 T main
+ *   00000100 0000000a r table
+ * or of a map file, the address and size of each section, and the address
+ * and name of each symbol indented below it:
+ *    .progmem.data  0x00000100        0xa main.o
+ *                   0x00000100                table
+ * The data sections are the .progmem.data ones. Returns 0 on error.
+ */
+static int parseline(struct symbols *st, struct mapstate *ms, char *line)
+{
+    char *t[SYMBOLS_MAX_TOKENS];
+    uint32_t address, size = 0;
+    int n, indented, type;
+
+    /* The sections removed by the linker are listed before the memory map */
+    if (!strncmp(line, "Discarded input sections", 24)) {
+        ms->discarded = 1;
+        return 1;
+    }
+    if (!strncmp(line, "Memory Configuration", 20) || !strncmp(line, "Linker script and memory map", 28)) {
+        ms->discarded = 0;
+        return 1;
+    }
+
+    indented = isspace((unsigned char) *line);
+    if ((n = tokenize(line, t, SYMBOLS_MAX_TOKENS)) == 0 || ms->discarded)
+        return 1;
+
+    if (!indented && (n == 3 || n == 4) && hexnumber(t[0], 0, &address) && strlen(t[n-2]) == 1 &&
+        (n == 3 || hexnumber(t[1], 0, &size))) {
+        type = *t[n-2];
+        if (strchr("TtWw", type))
+            return addsymbol(st, address, t[n-1], 1);
+        if (strchr("RrDdVv", type))
+            return addsymbol(st, address, t[n-1], 0) && adddata(st, address, size);
+        return 1;
+    }
+
+    if (*t[0] == '.') {
+        ms->data = !strncmp(t[0], ".progmem.data", 13);
+        ms->pending = n == 1;
+        if (ms->data && n >= 3 && hexnumber(t[1], 1, &address) && hexnumber(t[2], 1, &size))
+            return adddata(st, address, size);
+        return 1;
+    }
+    if (ms->pending && n >= 3 && hexnumber(t[0], 1, &address) && hexnumber(t[1], 1, &size)) {
+        ms->pending = 0;
+        return !ms->data || adddata(st, address, size);
+    }
+    ms->pending = 0;
+
+    if (indented && n == 2 && hexnumber(t[0], 1, &address) && (isalpha((unsigned char) *t[1]) || *t[1] == '_'))
+        return addsymbol(st, address, t[1], !ms->data);
+    return 1;
+}
+
+static int symbolnamecmp(const void *lhs, const void *rhs)
+{
+    const struct symbol *l = *(const struct symbol **) lhs;
+    const struct symbol *r = *(const struct symbol **) rhs;
+    int res = strcmp(l->name, r->name);
+
+    if (res)
+        return res;
+    return l->wordaddress < r->wordaddress ? -1 : l->wordaddress > r->wordaddress;
+}
+
+static int addrcmp(const void *lhs, const void *rhs)
+{
+    uint32_t l = *(const uint32_t *) lhs;
+    uint32_t r = *(const uint32_t *) rhs;
+
+    return l < r ? -1 : l > r;
+}
+
+/* The static functions of several files can share a name, the ones after the first get their word address appended */
+static int uniquenames(struct symbols *st)
+{
+    struct symbol **byname;
+    const char *prev = NULL, *name;
+    size_t i, n = 0;
+    char *label;
+
+    if ((byname = malloc((st->count ? st->count : 1) * sizeof(struct symbol *))) == NULL)
+        return 0;
+    for (i = 0; i < st->size; i++)
+        if (st->slots[i].name)
+            byname[n++] = &st->slots[i];
+    qsort(byname, n, sizeof(struct symbol *), symbolnamecmp);
+
+    for (i = 0; i < n; i++) {
+        name = byname[i]->name;
+        if (prev && !strcmp(name, prev)) {
+            if ((label = arenaalloc(st->arena, strlen(name) + 10)) == NULL) {
+                free(byname);
+                return 0;
+            }
+            sprintf(label, "%s_%04x", name, byname[i]->wordaddress);
+            byname[i]->name = label;
+        }
+        prev = name;
+    }
+    free(byname);
+    return 1;
+}
+
+static int collectentries(struct symbols *st)
+{
+    size_t i;
+
+    if ((st->entries = malloc((st->count ? st->count : 1) * sizeof(uint32_t))) == NULL)
+        return 0;
+    for (i = 0; i < st->size; i++)
+        if (st->slots[i].name && st->slots[i].code)
+            st->entries[st->entriescount++] = st->slots[i].wordaddress;
+    qsort(st->entries, st->entriescount, sizeof(uint32_t), addrcmp);
+    return 1;
+}
+
+/*
+ * Loads the symbols of the avr-nm output or the map file, the format is told
+ * by the lines themselves. The addresses are byte addresses, the symbols are
+ * kept by word address. NULL on error, or when the file has no symbols.
+ */
+struct symbols *loadsymbols(const char *filename)
+{
+    struct symbols *st;
+    struct mapstate ms;
+    char line[SYMBOLS_LINE_SIZE];
+    FILE *fp;
+    int c;
+
+    if ((fp = fopen(filename, "r")) == NULL) {
+        errmsg("Failed to open file %s\n", filename);
+        return NULL;
+    }
+    if ((st = allocsymbols()) == NULL)
+        goto err_alloc;
+
+    memset(&ms, 0, sizeof(struct mapstate));
+    while (fgets(line, sizeof(line), fp)) {
+        /* The lines too long for the buffer are the ones of long file names, never of symbols */
+        if (!strchr(line, '\n') && !feof(fp)) {
+            while ((c = fgetc(fp)) != EOF && c != '\n');
+            continue;
+        }
+        if (!parseline(st, &ms, line))
+            goto err_alloc;
+    }
+    if (ferror(fp)) {
+        errmsg("Failed to read file %s\n", filename);
+        goto err;
+    }
+    if (!st->count) {
+        errmsg("No symbols found in file %s\n", filename);
+        goto err;
+    }
+    if (!uniquenames(st) || !collectentries(st))
+        goto err_alloc;
+
+    fclose(fp);
+    return st;
+
+err_alloc:
+    errmsg("Error allocating memory\n");
+err:
+    if (st)
+        freesymbols(st);
+    fclose(fp);
+    return NULL;
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+
+# Measures the rendering cost per output line of the output modes: the best of the
+# runs of each mode, less the best of the runs analyzing the image only.
+
+AVRDIS=${AVRDIS:-../avrdis}
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 image.hex [runs]"
+    exit 1
+fi
+image=$1
+runs=${2:-20}
+elapsed() {
+    best=0
+    i=0
+    while [ $i -lt $runs ]; do
+        start=$(date +%s%N)
+        $AVRDIS --jobs 1 "$@" "$image" >/dev/null 2>&1
+        end=$(date +%s%N)
+        if [ $best -eq 0 ] || [ $((end - start)) -lt $best ]; then
+            best=$((end - start))
+        fi
+        i=$((i+1))
+    done
+    echo $best
+}
+base=$(elapsed --range 0:0)
+for mode in "" "-l" "--format=jsonl"; do
+    lines=$($AVRDIS --jobs 1 $mode "$image" 2>/dev/null | wc -l)
+    t=$(elapsed $mode)
+    echo "${mode:-asm}: $lines lines, $(( (t - base) / lines )) ns per line"
+done
+
+# Measures how the time of --auto grows with the image: on the first quarter,
+# half and all of its records. Each region tried collects the whole image
+# again, so a doubling should take about four times as long, not eight.
+tmp=${TMPDIR:-/tmp}/bench_auto.$$.hex
+whole=$image
+records=$(grep -v '^:00000001FF' "$whole" | grep -c '^:')
+runs=3
+prev=0
+for part in 4 2 1; do
+    grep -v '^:00000001FF' "$whole" | grep '^:' | head -n $((records / part)) > "$tmp"
+    echo ":00000001FF" >> "$tmp"
+    image=$tmp
+    t=$(elapsed --auto)
+    if [ $prev -eq 0 ]; then
+        echo "--auto on 1/$part of the image: $((t / 1000000)) ms"
+    else
+        echo "--auto on 1/$part of the image: $((t / 1000000)) ms, $((t * 10 / prev / 10)).$((t * 10 / prev % 10)) times the previous"
+    fi
+    prev=$t
+done
+rm -f "$tmp"
@@ -11,6 +11,33 @@ if ! ../avrdis test_src.hex 2>/dev/null | diff test_plain.asm -; then
 fi
 echo "Plain assembly source generation PASSED"
 
+if ! ../avrdis -o test_output.asm test_src.hex >/dev/null 2>&1 || ! diff test_plain.asm test_output.asm; then
+    rm -f test_output.asm
+    echo "Writing output file has FAILED"
+    exit 1
+fi
+rm -f test_output.asm
+echo "Writing output file PASSED"
+
+rm -f test_output.hex && mkfifo test_output.hex
+(cat test_src.hex > test_output.hex &)
+if ! ../avrdis test_output.hex 2>/dev/null | diff test_plain.asm -; then
+    rm -f test_output.hex
+    echo "Reading input from a pipe has FAILED"
+    exit 1
+fi
+rm -f test_output.hex
+echo "Reading input from a pipe PASSED"
+
+if ! ../avrdis -o test_output.asm --listing test_output.lst --gas test_output.S test_src.hex >/dev/null 2>&1 ||
+   ! diff test_plain.asm test_output.asm || ! diff test_plain.lst test_output.lst || ! diff test_src.S test_output.S; then
+    rm -f test_output.asm test_output.lst test_output.S
+    echo "Writing several outputs in one pass has FAILED"
+    exit 1
+fi
+rm -f test_output.asm test_output.lst test_output.S
+echo "Writing several outputs in one pass PASSED"
+
 if ! ../avrdis -l test_src.hex 2>/dev/null | diff test_plain.lst -; then
     echo "Listing generation has FAILED"
     exit 1
@@ -23,4 +50,247 @@ if ! ../avrdis -l -e 8:9 test_src.hex 2>/dev/null | diff test_ena.lst -; then
 fi
 echo "Enable region for disassembly in listing PASSED"
 
+if ! ../avrdis -l --scores test_src.hex 2>/dev/null | diff test_scores.lst -; then
+    echo "Scoring disabled regions in listing has FAILED"
+    exit 1
+fi
+echo "Scoring disabled regions in listing PASSED"
+
+if ! ../avrdis -l --functions test_func.hex 2>/dev/null | diff test_func.lst -; then
+    echo "Function labels in listing has FAILED"
+    exit 1
+fi
+echo "Function labels in listing PASSED"
+
+if ! ../avrdis --callgraph test_output.dot test_func.hex >/dev/null 2>&1 || ! diff test_func.dot test_output.dot; then
+    rm -f test_output.dot
+    echo "Call graph export has FAILED"
+    exit 1
+fi
+rm -f test_output.dot
+echo "Call graph export PASSED"
+
+if ! ../avrdis --dead-stores test_dead.hex 2>/dev/null | diff test_dead.asm -; then
+    echo "Dead store annotation has FAILED"
+    exit 1
+fi
+echo "Dead store annotation PASSED"
+
+if ! ../avrdis -l --auto test_auto.hex 2>/dev/null | diff test_auto.lst - ||
+   [ "$(../avrdis --auto test_auto.hex 2>&1 >/dev/null)" != "-e 4:4 -e d:10" ]; then
+    echo "Automatic enabling of regions has FAILED"
+    exit 1
+fi
+echo "Automatic enabling of regions PASSED"
+
+if ! ../avrdis -l --loops test_loops.hex 2>/dev/null | diff test_loops.lst -; then
+    echo "Loop annotation in listing has FAILED"
+    exit 1
+fi
+echo "Loop annotation in listing PASSED"
+
+if ! ../avrdis --loop-file test_output.txt test_loops.hex >/dev/null 2>&1 || ! diff test_loops.txt test_output.txt; then
+    rm -f test_output.txt
+    echo "Loop export has FAILED"
+    exit 1
+fi
+rm -f test_output.txt
+echo "Loop export PASSED"
+
+if ! ../avrdis --format=jsonl -e 8:9 test_src.hex 2>/dev/null | diff test_src.jsonl -; then
+    echo "JSON Lines output has FAILED"
+    exit 1
+fi
+echo "JSON Lines output PASSED"
+
+if ! ../avrdis --format=bin -e 8:9 test_src.hex 2>/dev/null | cmp -s test_src.bin -; then
+    echo "Binary record output has FAILED"
+    exit 1
+fi
+echo "Binary record output PASSED"
+
+if ! ../avrdis --range 6:9 test_loops.hex 2>/dev/null | diff test_range.asm -; then
+    echo "Address range output has FAILED"
+    exit 1
+fi
+echo "Address range output PASSED"
+
+if ! ../avrdis -l --index test_output.txt --index-step 8 test_loops.hex >/dev/null 2>&1 || ! diff test_index.txt test_output.txt; then
+    rm -f test_output.txt
+    echo "Output index has FAILED"
+    exit 1
+fi
+rm -f test_output.txt
+echo "Output index PASSED"
+
+if ! ../avrdis --compact-data --gas test_output.S test_data.hex 2>/dev/null | diff test_data.asm - || ! diff test_data.S test_output.S; then
+    rm -f test_output.S
+    echo "Compact data regions has FAILED"
+    exit 1
+fi
+rm -f test_output.S
+echo "Compact data regions PASSED"
+
+if ! ../avrdis --compact-data --split-dir test_output test_data.hex >/dev/null 2>&1 || ! diff -r test_split test_output; then
+    rm -rf test_output
+    echo "Split output has FAILED"
+    exit 1
+fi
+rm -rf test_output
+echo "Split output PASSED"
+
+mkdir -p test_output && cp test_src.hex test_output/
+if ! (cd test_output && printf "test_src.hex\nmissing.hex\n" | ../../avrdis --batch -l 2>/dev/null) | diff test_batch.txt - ||
+   ! diff test_plain.lst test_output/test_src.lst; then
+    rm -rf test_output
+    echo "Batch mode has FAILED"
+    exit 1
+fi
+rm -rf test_output
+echo "Batch mode PASSED"
+
+if ! ${CC:-cc} -I.. -o test_lib test_lib.c ../libavrdis.a -lpthread || ! ./test_lib test_src.hex | diff test_lib.txt - ||
+   ! ${CC:-cc} -I.. -o test_lib test_lib.c -L.. -Wl,-rpath,.. -lavrdis || ! ./test_lib test_src.hex | diff test_lib.txt - ||
+   nm -D --defined-only ../libavrdis.so | awk '$2 == "T" { print $3 }' | grep -v '^\(alloc\|free\)\?avrdis'; then
+    rm -f test_lib
+    echo "Library API has FAILED"
+    exit 1
+fi
+rm -f test_lib
+echo "Library API PASSED"
+
+if ! ${CC:-cc} -o test_serve test_serve.c; then
+    echo "Server mode has FAILED"
+    exit 1
+fi
+../avrdis --jobs 1 --serve test_output.sock 2>/dev/null &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S test_output.sock ] && break
+    sleep 0.1
+done
+if ! ./test_serve test_output.sock test_loops.hex | diff test_serve.txt -; then
+    kill $server
+    rm -f test_serve test_output.sock
+    echo "Server mode has FAILED"
+    exit 1
+fi
+kill $server
+wait $server
+rm -f test_serve
+echo "Server mode PASSED"
+
+if ! printf 'regions\nenable 4:4\nenable d:10\nlabels\nenabled\ndisable 4:4\nlist 0x0 0x6\nlabel 1a L0\nbogus\nsave test_output.asm\nquit\nregions\n' |
+     ../avrdis -i test_auto.hex 2>&1 | diff test_repl.txt - || ! ../avrdis -e d:10 test_auto.hex | diff - test_output.asm; then
+    rm -f test_output.asm
+    echo "Interactive exploration has FAILED"
+    exit 1
+fi
+rm -f test_output.asm
+echo "Interactive exploration PASSED"
+
+waitlines() {
+    for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+        [ "$(wc -l < test_output.log)" -ge $1 ] && return 0
+        sleep 0.1
+    done
+    return 1
+}
+
+cp test_src.hex test_output.hex
+: > test_output.txt
+../avrdis --watch -l -o test_output.lst -E test_output.txt test_output.hex > test_output.log 2>&1 &
+watcher=$!
+if ! waitlines 1 || ! echo 8:9 > test_output.txt || ! waitlines 2 || ! diff test_ena.lst test_output.lst ||
+   ! cp test_auto.hex test_output.hex || ! waitlines 3 || ! ../avrdis -l -e 8:9 test_auto.hex | diff - test_output.lst ||
+   ! diff test_watch.txt test_output.log; then
+    kill $watcher
+    rm -f test_output.hex test_output.txt test_output.lst test_output.log
+    echo "Watch mode has FAILED"
+    exit 1
+fi
+kill $watcher
+wait $watcher
+rm -f test_output.hex test_output.txt test_output.lst test_output.log
+
+# The regions found by --auto are not the ones of the file, writing it again changes nothing
+cp test_auto.hex test_output.hex
+: > test_output.txt
+../avrdis --watch --auto -l -o test_output.lst -E test_output.txt test_output.hex 2>/dev/null > test_output.log &
+watcher=$!
+if ! waitlines 1 || ! : > test_output.txt || ! sleep 0.5 || ! cp test_src.hex test_output.hex || ! waitlines 2 ||
+   ! diff test_watchauto.txt test_output.log; then
+    kill $watcher
+    rm -f test_output.hex test_output.txt test_output.lst test_output.log
+    echo "Watch mode has FAILED"
+    exit 1
+fi
+kill $watcher
+wait $watcher
+rm -f test_output.hex test_output.txt test_output.lst test_output.log
+echo "Watch mode PASSED"
+
+rm -f test_output.avrdis
+if ! printf 'enable d:10\nlabel 5 main\nlabel 1a copy_loop\ncomment 5 read the port\nentry 4\ndata 20:24\nquit\n' |
+     ../avrdis -i --session test_output.avrdis test_auto.hex >/dev/null 2>&1 || ! cmp test_session.avrdis test_output.avrdis ||
+   ! ../avrdis -l --session test_output.avrdis test_auto.hex 2>/dev/null | diff test_session.lst - ||
+   ../avrdis --session test_output.avrdis test_src.hex >/dev/null 2>&1; then
+    rm -f test_output.avrdis
+    echo "Session file has FAILED"
+    exit 1
+fi
+rm -f test_output.avrdis
+echo "Session file PASSED"
+
+rm -f test_output.avrdis
+../avrdis -l --time-budget 0 --session test_output.avrdis test_budget.hex > test_output.lst 2>/dev/null
+first=$(head -n 1 test_output.lst)
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    head -n 1 test_output.lst | grep -q '^; Partial' || break
+    ../avrdis -l --time-budget 0 --session test_output.avrdis test_budget.hex > test_output.lst 2>/dev/null
+done
+if [ "$first" != "; Partial analysis, the time budget ran out at 0x0040" ] ||
+   ! ../avrdis -l test_budget.hex 2>/dev/null | diff - test_output.lst; then
+    rm -f test_output.avrdis test_output.lst
+    echo "Time budget has FAILED"
+    exit 1
+fi
+
+# The walks of the regions cut by the labels found stop and go on too, 0x0036 is in one of them
+rm -f test_output.avrdis test_output.log
+for i in $(seq 1 40); do
+    ../avrdis -l --time-budget 0 --session test_output.avrdis test_nested.hex > test_output.lst 2>/dev/null
+    head -n 1 test_output.lst | grep '^; Partial' >> test_output.log || break
+done
+if ! grep -q 'ran out at 0x0036$' test_output.log || ! ../avrdis -l test_nested.hex 2>/dev/null | diff - test_output.lst; then
+    rm -f test_output.avrdis test_output.lst test_output.log
+    echo "Time budget has FAILED"
+    exit 1
+fi
+rm -f test_output.avrdis test_output.lst test_output.log
+
+# A walk stopped with other enabled regions starts over, one standing outside of the image is refused
+../avrdis -l --time-budget 0 --session test_output.avrdis test_budget.hex >/dev/null 2>&1
+cp test_output.avrdis test_output.bad
+cp test_output.avrdis test_output.repl
+printf 'enable f:1ff\nquit\n' | ../avrdis -i --session test_output.repl test_budget.hex >/dev/null 2>&1
+printf '\000\000\000\160' | dd of=test_output.bad bs=1 seek=52 conv=notrunc 2>/dev/null
+../avrdis -l -e f:1ff test_budget.hex > test_output.lst 2>/dev/null
+if ! ../avrdis -l -e f:1ff --time-budget 100000 --session test_output.avrdis test_budget.hex 2>/dev/null | diff test_output.lst - ||
+   ! ../avrdis -l --time-budget 100000 --session test_output.repl test_budget.hex 2>/dev/null | diff test_output.lst - ||
+   ../avrdis -l --time-budget 100000 --session test_output.bad test_budget.hex >/dev/null 2>&1; then
+    rm -f test_output.avrdis test_output.bad test_output.repl test_output.lst
+    echo "Time budget has FAILED"
+    exit 1
+fi
+rm -f test_output.avrdis test_output.bad test_output.repl test_output.lst
+echo "Time budget PASSED"
+
+if ! ../avrdis -l --symbols test_symbols.nm test_auto.hex 2>/dev/null | diff test_symbols.lst - ||
+   ! ../avrdis -l --symbols test_symbols.map test_auto.hex 2>/dev/null | diff test_symbols.lst -; then
+    echo "Symbol import has FAILED"
+    exit 1
+fi
+echo "Symbol import PASSED"
+
 exit 0
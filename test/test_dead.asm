@@ -0,0 +1,32 @@
+    .org 0x0000
+    rjmp L0
+    rjmp L5
+L0: ldi r16, 10
+    rcall L1
+    rcall L2
+    rcall L4
+    rcall L6
+    rcall L7
+    rjmp L0
+L1: dec r16
+    brne L1
+    ret
+L2: sbis 0x16, 0
+    rjmp L2
+    tst r17
+    breq L3
+    rjmp L1
+L3: ret
+L4: ldi r18, 5 ; dead store r18
+    ldi r18, 6
+    cpi r16, 3
+    brne L3
+    ret
+L5: push r16
+    in r16, 0x3f
+    out 0x3f, r16
+    pop r16
+    reti
+L6: ldi r16, 5
+    jmp L8
+L7: ldi r17, 1
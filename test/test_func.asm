@@ -0,0 +1,33 @@
+; Please note that the code below is for testing the features of the disassembler only,
+; and is not a code example that performs any useful stuff!
+.org 0
+rjmp reset
+rjmp isr
+reset:
+ldi r16, 10
+rcall delay
+rcall work
+rcall work2
+rjmp reset
+delay:
+dec r16
+brne delay
+ret
+work:
+sbis 0x16, 0
+rjmp work
+and r17, r17
+breq done
+rjmp delay
+done:
+ret
+work2:
+cpi r16, 3
+brne done
+ret
+isr:
+push r16
+in r16, 0x3f
+out 0x3f, r16
+pop r16
+reti
@@ -0,0 +1,105 @@
+/*
+ * Library test for the avrdis project: disassembles the image on several
+ * threads at once, each with its own context, checks they all render the
+ * same, then prints the source, the instructions and an error of a broken
+ * image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "libavrdis.h"
+
+#define THREADS 4
+
+struct run {
+    pthread_t thread;
+    const char *image;
+    size_t imagelen;
+    char *out;
+    size_t len;
+    int err;
+};
+
+static int collect(void *arg, const char *buf, size_t len)
+{
+    struct run *r = arg;
+    char *out;
+
+    if ((out = realloc(r->out, r->len + len)) == NULL)
+        return 1;
+    memcpy(out + r->len, buf, len);
+    r->out = out;
+    r->len += len;
+    return 0;
+}
+
+static int printinstr(void *arg, const struct avrdisinstr *in)
+{
+    printf("%04x %d %d %.*s%s%s\n", in->wordaddress, in->region, in->flow, (int) in->textlen, in->text,
+           in->label ? " " : "", in->label ? in->label : "");
+    return 0;
+}
+
+static void *render(void *arg)
+{
+    struct run *r = arg;
+    struct avrdis *ad = allocavrdis();
+
+    if (!ad) {
+        r->err = AVRDIS_ENOMEM;
+        return NULL;
+    }
+    if ((r->err = avrdisparseihex(ad, r->image, r->imagelen)) == AVRDIS_OK &&
+        (r->err = avrdisenable(ad, 8, 9)) == AVRDIS_OK &&
+        (r->err = avrdisanalyze(ad, NULL)) == AVRDIS_OK)
+        r->err = avrdisrender(ad, collect, r);
+    freeavrdis(ad);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    struct run runs[THREADS];
+    struct avrdis *ad;
+    char image[65536];
+    size_t len;
+    FILE *fp;
+    int i, err;
+
+    if (argc != 2 || (fp = fopen(argv[1], "r")) == NULL)
+        return 1;
+    len = fread(image, 1, sizeof(image), fp);
+    fclose(fp);
+
+    memset(runs, 0, sizeof(runs));
+    for (i = 0; i < THREADS; i++) {
+        runs[i].image = image;
+        runs[i].imagelen = len;
+        pthread_create(&runs[i].thread, NULL, render, &runs[i]);
+    }
+    for (i = 0; i < THREADS; i++)
+        pthread_join(runs[i].thread, NULL);
+    for (i = 0; i < THREADS; i++)
+        if (runs[i].err || runs[i].len != runs[0].len || memcmp(runs[i].out, runs[0].out, runs[0].len)) {
+            fprintf(stderr, "Thread %d: %s\n", i, avrdisstrerror(runs[i].err));
+            return 1;
+        }
+    fwrite(runs[0].out, 1, runs[0].len, stdout);
+
+    if ((ad = allocavrdis()) == NULL)
+        return 1;
+    if (avrdisparseihex(ad, image, len) || avrdisanalyze(ad, NULL) || avrdisinstrs(ad, printinstr, NULL))
+        return 1;
+    err = avrdisparseihex(ad, image, len / 2);
+    printf("%s: %s", avrdisstrerror(err), avrdismessage(ad));
+    err = avrdisrender(ad, collect, &runs[0]);
+    printf("%s: %s", avrdisstrerror(err), avrdismessage(ad));
+    freeavrdis(ad);
+
+    for (i = 0; i < THREADS; i++)
+        free(runs[i].out);
+    return 0;
+}
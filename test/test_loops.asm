@@ -0,0 +1,28 @@
+; Please note that the code below is for testing the features of the disassembler only,
+; and is not a code example that performs any useful stuff!
+.org 0
+rjmp reset
+reset:
+ldi r17, 4
+outer:
+ldi r16, 10
+inner:
+dec r16
+brne inner
+dec r17
+brne outer
+ldi r18, 0
+again:
+out 0x18, r17
+wait:
+sbic 0x16, 3
+rjmp wait
+dec r18
+brne again
+rcall work
+rjmp reset
+work:
+in r16, 0x16
+and r16, r16
+breq work
+ret
@@ -0,0 +1,6 @@
+    .equ L1 = 0x0002
+    .org 0x0006
+    brne L1
+    ldi r18, 0
+L3: out 0x18, r17
+L4: sbic 0x16, 3
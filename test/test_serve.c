@@ -0,0 +1,84 @@
+/*
+ * Server test for the avrdis project: loads the image over the socket, asks
+ * for the outputs of the cached image by its key, then for some invalid
+ * requests, printing every response. An other connection is kept open and
+ * idle meanwhile, which must not hold the thread of a one thread server.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static char image[65536];
+static size_t imagelen;
+static char key[17];
+
+static int request(int fd, const char *line, int withimage)
+{
+    size_t len = strlen(line), n = withimage ? imagelen : 0;
+    uint32_t total = len + n, got = 0;
+    uint8_t head[4] = { total >> 24, total >> 16, total >> 8, total };
+    char *resp;
+    ssize_t r;
+
+    if (write(fd, head, 4) != 4 || write(fd, line, len) != (ssize_t) len || write(fd, image, n) != (ssize_t) n)
+        return 0;
+    for (got = 0; got < 4; got += r)
+        if ((r = read(fd, head + got, 4 - got)) <= 0)
+            return 0;
+    total = (uint32_t) head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3];
+    if ((resp = malloc(total + 1)) == NULL)
+        return 0;
+    for (got = 0; got < total; got += r)
+        if ((r = read(fd, resp + got, total - got)) <= 0) {
+            free(resp);
+            return 0;
+        }
+    resp[total] = '\0';
+    if (!strncmp(resp, "ok ", 3))
+        memcpy(key, resp + 3, 16);
+    printf("> %s%s", line, resp);
+    free(resp);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    char line[64];
+    FILE *fp;
+    int idle, fd;
+
+    if (argc != 3 || (fp = fopen(argv[2], "r")) == NULL)
+        return 1;
+    imagelen = fread(image, 1, sizeof(image), fp);
+    fclose(fp);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if ((idle = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(idle, (struct sockaddr *) &addr, sizeof(addr)))
+        return 1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+        return 1;
+
+    if (!request(fd, "load -\n", 1))
+        return 1;
+    snprintf(line, sizeof(line), "asm %s\n", key);
+    request(fd, line, 0);
+    snprintf(line, sizeof(line), "listing %s 4:7\n", key);
+    request(fd, line, 0);
+    snprintf(line, sizeof(line), "regions %s\n", key);
+    request(fd, line, 0);
+    snprintf(line, sizeof(line), "labels %s\n", key);
+    request(fd, line, 0);
+    request(fd, "asm 0123456789abcdef\n", 0);
+    request(fd, "disassemble -\n", 1);
+    close(fd);
+    close(idle);
+    return 0;
+}
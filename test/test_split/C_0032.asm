@@ -0,0 +1,4 @@
+    .org 0x0032
+L0: ldi r16, 0
+L1: inc r16
+    rjmp L1
@@ -0,0 +1,6 @@
+    .org 0x0002
+    .db "Hello, world!", 0
+    .org 0x001d
+    .dw 0x0001, 0x0004, 0x0009, 0x0010, 0x0019, 0x0024, 0x0031, 0x0040
+    .dw 0x0051, 0x0064, 0x0079, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
+    .dw 0x0000, 0x0000, 0x0000, 0x0000, 0x0000
@@ -0,0 +1,4 @@
+    .equ L0 = 0x0032
+    .org 0x0000
+    ldi r17, 1
+    rjmp L0
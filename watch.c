@@ -0,0 +1,329 @@
+/*****************************************************************************
+ * 
+ * Description:
+ *     Watch module for the avrdis project, disassembles the input again
+ *     whenever it or the file of the enabled regions changes, replacing the
+ *     outputs atomically, until interrupted.
+ * 
+ * Author:
+ *     Imre Horvath <imi [dot] horvath [at] gmail [dot] com> (c) 2023
+ * 
+ * License:
+ *     GNU GPLv3
+ * 
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "avrdis.h"
+
+/* The changes are told by inotify, the other systems have no watch */
+#ifdef __linux__
+
+#define WATCH_SETTLE_MS 20
+#define WATCH_EVENTS_SIZE 4096
+
+/* A file watched through the events of its directory, as the builds often replace files by renaming */
+struct watchedfile {
+    const char *path;
+    const char *name;       /* In the directory */
+    int wd;
+};
+
+struct watcher {
+    const char *filename;
+    struct options opts;
+    struct regionstruct *enaregs;   /* Of the command line */
+    struct watchedfile files[2];    /* The input and the regions file */
+    size_t nfiles;
+    int fd;                         /* Of inotify */
+    mode_t mode;                    /* Of the outputs */
+    struct wordlist *wl;            /* Of the last written outputs */
+    struct arena *arenas[2];        /* Of the words of the last outputs and of the pass, swapped when written */
+    struct regionstruct *regs;      /* As read for the last outputs, without the ones found when writing */
+    struct renderbuffers *rb;
+};
+
+static volatile sig_atomic_t stopping;
+
+static void stopwatch(int sig)
+{
+    stopping = 1;
+}
+
+static int watchfile(struct watcher *w, const char *path)
+{
+    struct watchedfile *f = &w->files[w->nfiles];
+    const char *slash = strrchr(path, '/');
+    char *dir;
+
+    f->path = path;
+    f->name = slash ? slash + 1 : path;
+    if ((dir = strdup(slash ? path : ".")) == NULL) {
+        errmsg("Error allocating memory\n");
+        return 0;
+    }
+    if (slash)
+        dir[slash == path ? 1 : slash - path] = '\0';
+    f->wd = inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+    free(dir);
+    if (f->wd < 0) {
+        errmsg("Failed to watch file %s\n", path);
+        return 0;
+    }
+    w->nfiles++;
+    return 1;
+}
+
+/* Waits for a change of the watched files, then for the writes of the change to settle, 0 when stopping */
+static int waitchange(struct watcher *w)
+{
+    char buf[WATCH_EVENTS_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    struct pollfd pfd = { w->fd, POLLIN, 0 };
+    int changed = 0;
+    ssize_t n;
+    size_t i;
+    char *p;
+
+    while (!stopping) {
+        if (changed && poll(&pfd, 1, WATCH_SETTLE_MS) == 0)
+            return 1;
+        if ((n = read(w->fd, buf, sizeof(buf))) < 0) {
+            if (errno == EINTR)
+                continue;
+            errmsg("Failed to read the file events\n");
+            return 0;
+        }
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+            for (i = 0; i < w->nfiles; i++)
+                if (ev->wd == w->files[i].wd && ev->len && !strcmp(ev->name, w->files[i].name))
+                    changed = 1;
+        }
+    }
+    return 0;
+}
+
+/* Finds the range of the word addresses whose words differ in the images, 0 when there is none */
+static int diffimages(struct wordlist *a, struct wordlist *b, uint32_t *begin, uint32_t *end)
+{
+    uint32_t wordaddress;
+    int same, changed = 0;
+
+    while (a || b) {
+        if (!b || (a && a->wordaddress < b->wordaddress)) {
+            wordaddress = a->wordaddress;
+            a = a->next;
+        } else if (!a || b->wordaddress < a->wordaddress) {
+            wordaddress = b->wordaddress;
+            b = b->next;
+        } else {
+            same = a->word == b->word;
+            wordaddress = a->wordaddress;
+            a = a->next;
+            b = b->next;
+            if (same)
+                continue;
+        }
+        if (!changed)
+            *begin = wordaddress;
+        *end = wordaddress;
+        changed = 1;
+    }
+    return changed;
+}
+
+static int sameregions(struct regionstruct *a, struct regionstruct *b)
+{
+    struct region *r, *s;
+
+    for (r = a->first, s = b->first; r && s; r = r->next, s = s->next)
+        if (r->begin != s->begin || r->end != s->end)
+            return 0;
+    return !r && !s;
+}
+
+/* Writes the outputs into temporary files next to them, then renames those over the outputs */
+static int writeoutputs(struct watcher *w, struct wordlist *wl, struct regionstruct *regs)
+{
+    struct options opts = w->opts;
+    const char **names[] = { &opts.output, &opts.listingfile, &opts.gasfile, &opts.indexfile,
+                             &opts.callgraph, &opts.loopfile };
+    const char **finals[] = { &w->opts.output, &w->opts.listingfile, &w->opts.gasfile, &w->opts.indexfile,
+                              &w->opts.callgraph, &w->opts.loopfile };
+    char *temps[sizeof(names) / sizeof(names[0])];
+    struct regionstruct *emitregs = NULL;
+    size_t i, n = sizeof(names) / sizeof(names[0]);
+    int fd, res = 0;
+
+    memset(temps, 0, sizeof(temps));
+    for (i = 0; i < n; i++) {
+        if (!*finals[i])
+            continue;
+        if ((temps[i] = malloc(strlen(*finals[i]) + 8)) == NULL) {
+            errmsg("Error allocating memory\n");
+            goto out;
+        }
+        sprintf(temps[i], "%s.XXXXXX", *finals[i]);
+        if ((fd = mkstemp(temps[i])) < 0) {
+            errmsg("Failed to create file %s\n", temps[i]);
+            free(temps[i]);
+            temps[i] = NULL;
+            goto out;
+        }
+        fchmod(fd, w->mode);
+        close(fd);
+        *names[i] = temps[i];
+    }
+
+    /* The regions are extended by --enable-above and --auto, the ones read are kept to compare the next ones with */
+    if ((emitregs = copyregions(regs)) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto out;
+    }
+    if (!emitavrasm(wl, emitregs, &opts, w->rb))
+        goto out;
+
+    for (i = 0; i < n; i++)
+        if (temps[i] && rename(temps[i], *finals[i])) {
+            errmsg("Failed to replace file %s\n", *finals[i]);
+            goto out;
+        }
+    res = 1;
+
+out:
+    for (i = 0; i < n; i++) {
+        if (temps[i] && !res)
+            unlink(temps[i]);
+        free(temps[i]);
+    }
+    if (emitregs)
+        freeregions(emitregs);
+    return res;
+}
+
+/*
+ * Parses the input and the regions file, and writes the outputs when any of
+ * them differs from the ones of the last outputs, printing what has changed.
+ * The last outputs are kept on errors.
+ */
+static void rebuild(struct watcher *w)
+{
+    struct wordlist *wl = NULL;
+    struct regionstruct *regs;
+    struct arena *a;
+    uint32_t begin, end;
+    int words, regions;
+
+    if ((regs = copyregions(w->enaregs)) == NULL) {
+        errmsg("Error allocating memory\n");
+        return;
+    }
+    resetarena(w->arenas[1]);
+    if (!parsefile(w->filename, w->arenas[1], &wl) || (w->opts.regionsfile && !parseregionsfile(w->opts.regionsfile, regs)))
+        goto drop;
+
+    words = w->regs && diffimages(w->wl, wl, &begin, &end);
+    regions = w->regs && !sameregions(w->regs, regs);
+    if (w->regs && !words && !regions)
+        goto drop;
+
+    if (!writeoutputs(w, wl, regs))
+        goto drop;
+
+    printf("%s written", w->opts.output);
+    if (words)
+        printf(", words 0x%04x:0x%04x changed", begin, end);
+    if (regions)
+        printf(", regions changed");
+    printf("\n");
+    fflush(stdout);
+
+    if (w->regs)
+        freeregions(w->regs);
+    w->wl = wl;
+    w->regs = regs;
+    a = w->arenas[0];
+    w->arenas[0] = w->arenas[1];
+    w->arenas[1] = a;
+    return;
+
+drop:
+    freeregions(regs);
+}
+
+/*
+ * Writes the outputs of the input, then writes them again after every change
+ * of the input or the regions file, until interrupted by SIGINT or SIGTERM.
+ */
+int runwatch(const char *filename, struct regionstruct *enaregs, const struct options *opts)
+{
+    struct watcher w;
+    struct sigaction sa;
+    int res = 0;
+
+    memset(&w, 0, sizeof(struct watcher));
+    w.filename = filename;
+    w.opts = *opts;
+    w.enaregs = enaregs;
+    w.mode = umask(0);
+    umask(w.mode);
+    w.mode = 0666 & ~w.mode;
+
+    if ((w.fd = inotify_init1(IN_CLOEXEC)) < 0) {
+        errmsg("Failed to watch the files\n");
+        return 0;
+    }
+    if ((w.rb = allocrenderbuffers()) == NULL || (w.arenas[0] = allocarena()) == NULL ||
+        (w.arenas[1] = allocarena()) == NULL) {
+        errmsg("Error allocating memory\n");
+        goto out;
+    }
+    if (!watchfile(&w, filename) || (opts->regionsfile && !watchfile(&w, opts->regionsfile)))
+        goto out;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stopwatch;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* Watching before the first pass, so no change is missed */
+    rebuild(&w);
+    while (waitchange(&w))
+        rebuild(&w);
+    res = stopping;
+
+out:
+    if (w.arenas[0])
+        freearena(w.arenas[0]);
+    if (w.arenas[1])
+        freearena(w.arenas[1]);
+    if (w.regs)
+        freeregions(w.regs);
+    if (w.rb)
+        freerenderbuffers(w.rb);
+    close(w.fd);
+    return res;
+}
+
+#else
+
+int runwatch(const char *filename, struct regionstruct *enaregs, const struct options *opts)
+{
+    errmsg("--watch is not supported on this system\n");
+    return 0;
+}
+
+#endif